@@ -1,9 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "log.h"
 #include "private.h"
@@ -73,12 +75,12 @@ struct alloc_result {
 	uint32_t flags;
 	size_t planes_len;
 
+	/* candidate layers, sorted by descending priority */
+	struct liftoff_layer **layers;
+	size_t layers_len;
+
 	struct liftoff_layer **best;
 	int best_score;
-
-	/* per-output */
-	bool has_composition_layer;
-	size_t non_composition_layers_len;
 };
 
 /* Transient data, arguments for each step */
@@ -87,10 +89,14 @@ struct alloc_step {
 	size_t plane_idx;
 
 	struct liftoff_layer **alloc; /* only items up to plane_idx are valid */
+	/* layers whose slices are displayed by the planes from plane_idx on,
+	 * see plane_step_init_split; shared by all steps */
+	struct liftoff_layer **reserved;
 	int score; /* number of allocated layers */
 	int last_layer_zpos;
 
-	bool composited; /* per-output */
+	bool primary_enabled; /* per-output */
+	int overlays; /* overlay planes enabled for this output */
 
 	char log_prefix[64];
 };
@@ -109,20 +115,21 @@ plane_step_init_next(struct alloc_step *step, struct alloc_step *prev,
 	step->plane_idx = prev->plane_idx + 1;
 	step->alloc = prev->alloc;
 	step->alloc[prev->plane_idx] = layer;
+	step->reserved = prev->reserved;
 
-	if (layer != NULL && layer == layer->output->composition_layer) {
-		assert(!prev->composited);
-		step->composited = true;
-	} else {
-		step->composited = prev->composited;
-	}
-
-	if (layer != NULL && layer != layer->output->composition_layer) {
+	if (layer != NULL && !layer_is_composition(layer)) {
 		step->score = prev->score + 1;
 	} else {
 		step->score = prev->score;
 	}
 
+	step->primary_enabled = prev->primary_enabled ||
+		(layer != NULL && plane->type == DRM_PLANE_TYPE_PRIMARY);
+	step->overlays = prev->overlays;
+	if (layer != NULL && plane->type == DRM_PLANE_TYPE_OVERLAY) {
+		step->overlays++;
+	}
+
 	zpos_prop = NULL;
 	if (layer != NULL) {
 		zpos_prop = layer_get_property(layer, "zpos");
@@ -146,6 +153,28 @@ plane_step_init_next(struct alloc_step *step, struct alloc_step *prev,
 	}
 }
 
+/* Like plane_step_init_next, for the first slice of a layer split across
+ * several planes. The planes of the other slices are reserved by the caller
+ * until the search reaches them, the ones in between stay available. The
+ * layer only counts once in the score. */
+static void
+plane_step_init_split(struct alloc_step *step, struct alloc_step *prev,
+		      struct liftoff_layer *layer, size_t slices_len)
+{
+	plane_step_init_next(step, prev, layer);
+	step->overlays += (int)slices_len - 1;
+}
+
+/* Like plane_step_init_next, for a plane reserved for a slice */
+static void
+plane_step_init_slice(struct alloc_step *step, struct alloc_step *prev,
+		      struct liftoff_layer *layer)
+{
+	plane_step_init_next(step, prev, layer);
+	step->score = prev->score;
+	step->overlays = prev->overlays;
+}
+
 static bool
 is_layer_allocated(struct alloc_step *step, struct liftoff_layer *layer)
 {
@@ -161,9 +190,83 @@ is_layer_allocated(struct alloc_step *step, struct liftoff_layer *layer)
 	return false;
 }
 
+static struct liftoff_plane *
+step_get_layer_plane(struct liftoff_output *output, struct alloc_step *step,
+		     struct liftoff_layer *layer)
+{
+	struct liftoff_plane *plane;
+	size_t i;
+
+	i = 0;
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (i >= step->plane_idx) {
+			break;
+		}
+		if (step->alloc[i] == layer) {
+			return plane;
+		}
+		i++;
+	}
+
+	return NULL;
+}
+
+static bool
+layer_is_opaque(struct liftoff_layer *layer)
+{
+	struct liftoff_rect rect, opaque;
+
+	if (!layer_get_opaque_rect(layer, &opaque)) {
+		return false;
+	}
+
+	layer_get_rect(layer, &rect);
+	return rect.x == opaque.x && rect.y == opaque.y &&
+	       rect.width == opaque.width && rect.height == opaque.height;
+}
+
+/* Checks whether a layer mapped to the plane would be correctly stacked with a
+ * composited layer above it. Composited layers can be above the plane if
+ * they're drawn to an additional composition layer above it, or if the plane
+ * is below their composition layer: users punch a hole in the composition
+ * layer. Layers under an underlay would be hidden by the hole, so the layer
+ * needs to be opaque. */
+static bool
+can_be_under_composited(struct liftoff_output *output, struct alloc_step *step,
+			struct liftoff_layer *layer,
+			struct liftoff_plane *plane,
+			struct liftoff_layer *composited)
+{
+	struct liftoff_layer *target;
+	struct liftoff_plane *target_plane;
+	struct liftoff_layer_property *zpos_prop, *target_zpos_prop;
+
+	/* Composition layers are allocated before the planes below them */
+	target = composited->target;
+	if (target == NULL) {
+		return false;
+	} else if (target == layer) {
+		return true;
+	}
+	target_plane = step_get_layer_plane(output, step, target);
+	if (target_plane == NULL || target_plane->zpos <= plane->zpos) {
+		return false;
+	}
+
+	zpos_prop = layer_get_property(layer, "zpos");
+	target_zpos_prop = layer_get_property(target, "zpos");
+	if (target != output->composition_layer && target_zpos_prop != NULL &&
+	    target_zpos_prop->value > zpos_prop->value) {
+		return true;
+	}
+
+	return output->underlays && layer_is_opaque(layer);
+}
+
 static bool
 has_composited_layer_over(struct liftoff_output *output,
-			  struct alloc_step *step, struct liftoff_layer *layer)
+			  struct alloc_step *step, struct liftoff_layer *layer,
+			  struct liftoff_plane *plane)
 {
 	struct liftoff_layer *other_layer;
 	struct liftoff_layer_property *zpos_prop, *other_zpos_prop;
@@ -174,7 +277,11 @@ has_composited_layer_over(struct liftoff_output *output,
 	}
 
 	liftoff_list_for_each(other_layer, &output->layers, link) {
-		if (is_layer_allocated(step, other_layer)) {
+		/* Additional composition layers are stacked like regular
+		 * layers once allocated */
+		if (other_layer->extra_composition ||
+		    !layer_is_visible(other_layer) ||
+		    is_layer_allocated(step, other_layer)) {
 			continue;
 		}
 
@@ -184,7 +291,9 @@ has_composited_layer_over(struct liftoff_output *output,
 		}
 
 		if (layer_intersects(layer, other_layer) &&
-		    other_zpos_prop->value > zpos_prop->value) {
+		    other_zpos_prop->value > zpos_prop->value &&
+		    !can_be_under_composited(output, step, layer, plane,
+					     other_layer)) {
 			return true;
 		}
 	}
@@ -269,13 +378,39 @@ has_allocated_plane_under(struct liftoff_output *output,
 	return false;
 }
 
+/* A layer can't be displayed by a plane in between the slices of another
+ * layer if they intersect: it would be over some slices and under others */
+static bool
+has_intersecting_slice_under(struct liftoff_output *output,
+			     struct alloc_step *step,
+			     struct liftoff_layer *layer)
+{
+	struct liftoff_list *link;
+	struct liftoff_layer *other;
+	size_t i;
+
+	i = step->plane_idx;
+	for (link = step->plane_link; link != &output->device->planes;
+	     link = link->next) {
+		other = step->reserved[i];
+		i++;
+		if (other != NULL && other != layer &&
+		    layer_intersects(layer, other)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static bool
 check_layer_plane_compatible(struct alloc_step *step,
 			     struct liftoff_layer *layer,
 			     struct liftoff_plane *plane)
 {
 	struct liftoff_output *output;
-	struct liftoff_layer_property *zpos_prop;
+	struct liftoff_layer_property *zpos_prop, *fb_id_prop;
+	struct liftoff_fb_info fb_info;
 
 	output = layer->output;
 
@@ -311,8 +446,16 @@ check_layer_plane_compatible(struct alloc_step *step,
 		}
 	}
 
+	if (has_intersecting_slice_under(output, step, layer)) {
+		liftoff_log(LIFTOFF_DEBUG,
+			    "%s Layer %p -> plane %"PRIu32": "
+			    "intersects a layer split across planes under",
+			    step->log_prefix, (void *)layer, plane->id);
+		return false;
+	}
+
 	if (plane->type != DRM_PLANE_TYPE_PRIMARY &&
-	    has_composited_layer_over(output, step, layer)) {
+	    has_composited_layer_over(output, step, layer, plane)) {
 		liftoff_log(LIFTOFF_DEBUG,
 			    "%s Layer %p -> plane %"PRIu32": "
 			    "has composited layer on top",
@@ -330,55 +473,235 @@ check_layer_plane_compatible(struct alloc_step *step,
 		return false;
 	}
 
+	if (plane->type == DRM_PLANE_TYPE_PRIMARY &&
+	    layer != layer->output->composition_layer &&
+	    layer->extra_composition) {
+		liftoff_log(LIFTOFF_DEBUG,
+			    "%s Layer %p -> plane %"PRIu32": "
+			    "cannot put additional composition layer on "
+			    "primary plane",
+			    step->log_prefix, (void *)layer, plane->id);
+		return false;
+	}
+
+	/* Format and modifier mismatches don't need a test commit */
+	fb_id_prop = layer_get_property(layer, "FB_ID");
+	if (fb_id_prop != NULL &&
+	    device_get_fb_info(output->device, fb_id_prop->value, &fb_info) &&
+	    !plane_supports_fb(plane, &fb_info)) {
+		liftoff_log(LIFTOFF_DEBUG,
+			    "%s Layer %p -> plane %"PRIu32": "
+			    "unsupported format or modifier",
+			    step->log_prefix, (void *)layer, plane->id);
+		return false;
+	}
+
 	return true;
 }
 
 static bool
-check_alloc_valid(struct alloc_result *result, struct alloc_step *step)
-{
-	/* If composition isn't used, we need to have allocated all
-	 * layers. */
-	/* TODO: find a way to fail earlier, e.g. when the number of
-	 * layers exceeds the number of planes. */
-	if (result->has_composition_layer && !step->composited &&
-	    step->score != (int)result->non_composition_layers_len) {
-		liftoff_log(LIFTOFF_DEBUG,
-			    "%sCannot skip composition: some layers "
-			    "are missing a plane", step->log_prefix);
-		return false;
+has_missing_layer(struct liftoff_output *output, struct alloc_step *step,
+		  struct liftoff_layer *composition_layer)
+{
+	struct liftoff_layer *layer;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer->target == composition_layer &&
+		    layer_is_visible(layer) &&
+		    !is_layer_allocated(step, layer)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+check_alloc_valid(struct liftoff_output *output, struct alloc_step *step)
+{
+	struct liftoff_layer *layer;
+	bool composited, missing;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (!layer_is_composition(layer) || !layer_is_visible(layer)) {
+			continue;
+		}
+
+		composited = is_layer_allocated(step, layer);
+		missing = has_missing_layer(output, step, layer);
+
+		/* If composition isn't used, we need to have allocated all
+		 * layers. */
+		/* TODO: find a way to fail earlier, e.g. when the number of
+		 * layers exceeds the number of planes. */
+		if (!composited && missing) {
+			liftoff_log(LIFTOFF_DEBUG,
+				    "%sCannot skip composition layer %p: some "
+				    "layers are missing a plane",
+				    step->log_prefix, (void *)layer);
+			return false;
+		}
+		/* On the other hand, if we manage to allocate all layers, we
+		 * don't want to use composition. We don't want to use the
+		 * composition layer at all. */
+		if (composited && !missing) {
+			liftoff_log(LIFTOFF_DEBUG,
+				    "%sRefusing to use composition layer %p: "
+				    "all its layers have been put in a plane",
+				    step->log_prefix, (void *)layer);
+			return false;
+		}
+	}
+
+	/* TODO: check allocation isn't empty */
+
+	return true;
+}
+
+/* Picks the planes displaying the slices of a layer, and their index: the
+ * current plane, then the next ones available which pass the same checks.
+ * Slices don't overlap, so they only need to be stacked like the layer
+ * relative to other layers. */
+static bool
+find_slice_planes(struct liftoff_output *output, struct alloc_step *step,
+		  struct liftoff_layer *layer, struct liftoff_plane **planes,
+		  size_t *plane_idxs, size_t planes_len)
+{
+	struct liftoff_device *device;
+	struct liftoff_plane *plane;
+	struct alloc_step prev_step, slice_step;
+	size_t i;
+	int overlays;
+
+	device = output->device;
+	planes[0] = liftoff_container_of(step->plane_link, plane, link);
+	plane_idxs[0] = step->plane_idx;
+	if (planes_len == 1) {
+		return true;
 	}
-	/* On the other hand, if we manage to allocate all layers, we
-	 * don't want to use composition. We don't want to use the
-	 * composition layer at all. */
-	if (step->composited &&
-	    step->score == (int)result->non_composition_layers_len) {
+
+	if (planes_len > LIFTOFF_SPLIT_MAX ||
+	    planes[0]->type != DRM_PLANE_TYPE_OVERLAY) {
 		liftoff_log(LIFTOFF_DEBUG,
-			    "%sRefusing to use composition: all layers "
-			    "have been put in a plane", step->log_prefix);
+			    "%s Layer %p -> plane %"PRIu32": "
+			    "cannot split layer in %zu slices",
+			    step->log_prefix, (void *)layer, planes[0]->id,
+			    planes_len);
 		return false;
 	}
 
-	/* TODO: check allocation isn't empty */
+	/* Check the next planes as if the ones before were disabled: layers
+	 * put on them later are checked against the slices */
+	overlays = step->overlays + 1;
+	prev_step = *step;
+	i = 1;
+	while (i < planes_len) {
+		plane_step_init_next(&slice_step, &prev_step, NULL);
+		prev_step = slice_step;
+		if (slice_step.plane_link == &device->planes ||
+		    (device->max_overlay_planes >= 0 &&
+		     overlays >= device->max_overlay_planes)) {
+			liftoff_log(LIFTOFF_DEBUG,
+				    "%s Layer %p -> plane %"PRIu32": "
+				    "not enough planes for %zu slices",
+				    step->log_prefix, (void *)layer,
+				    planes[0]->id, planes_len);
+			return false;
+		}
+
+		plane = liftoff_container_of(slice_step.plane_link, plane,
+					     link);
+		if (plane->layer != NULL ||
+		    step->reserved[slice_step.plane_idx] != NULL ||
+		    (plane->possible_crtcs & (1 << output->crtc_index)) == 0 ||
+		    plane->type != DRM_PLANE_TYPE_OVERLAY) {
+			continue;
+		}
+		if (!check_layer_plane_compatible(&slice_step, layer, plane) ||
+		    plane_caps_predict_failure(plane, layer)) {
+			continue;
+		}
+
+		planes[i] = plane;
+		plane_idxs[i] = slice_step.plane_idx;
+		i++;
+		overlays++;
+	}
 
 	return true;
 }
 
+static int
+apply_slices(struct liftoff_layer *layer, struct liftoff_plane **planes,
+	     size_t planes_len, drmModeAtomicReq *req)
+{
+	size_t i;
+	int cursor, ret;
+
+	cursor = drmModeAtomicGetCursor(req);
+
+	for (i = 0; i < planes_len; i++) {
+		ret = plane_apply(planes[i], layer, i, req);
+		if (ret != 0) {
+			drmModeAtomicSetCursor(req, cursor);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Test commits fail for many reasons besides scaling, e.g. zpos, bandwidth or
+ * formats, and the request holds every plane placed so far. Only learn scaling
+ * limits from a failure if the same layer passes unscaled. */
+static int
+check_scaling_failure(struct liftoff_device *device,
+		      struct alloc_result *result, struct liftoff_plane *plane,
+		      struct liftoff_layer *layer)
+{
+	int cursor, ret;
+
+	if (!plane_caps_would_learn_failure(plane, layer)) {
+		return 0;
+	}
+
+	cursor = drmModeAtomicGetCursor(result->req);
+	ret = plane_apply_unscaled(plane, layer, result->req);
+	if (ret == 0) {
+		ret = device_test_commit(device, result->req, result->flags);
+	}
+	drmModeAtomicSetCursor(result->req, cursor);
+
+	if (ret == 0) {
+		plane_caps_record_scaling_failure(plane, layer);
+	} else if (ret == -EINVAL || ret == -ERANGE || ret == -ENOSPC) {
+		liftoff_log(LIFTOFF_DEBUG, "Layer %p -> plane %"PRIu32": "
+			    "failure isn't caused by scaling", (void *)layer,
+			    plane->id);
+		ret = 0;
+	}
+
+	return ret;
+}
+
 static int
 output_choose_layers(struct liftoff_output *output, struct alloc_result *result,
 		     struct alloc_step *step)
 {
 	struct liftoff_device *device;
 	struct liftoff_plane *plane;
+	struct liftoff_plane *slice_planes[LIFTOFF_SPLIT_MAX];
+	size_t slice_idxs[LIFTOFF_SPLIT_MAX];
 	struct liftoff_layer *layer;
 	int cursor, ret;
-	size_t remaining_planes;
+	size_t i, j, remaining_planes, slices_len;
 	struct alloc_step next_step = {0};
 
 	device = output->device;
 
 	if (step->plane_link == &device->planes) { /* Allocation finished */
 		if (step->score > result->best_score &&
-		    check_alloc_valid(result, step)) {
+		    check_alloc_valid(output, step)) {
 			/* We found a better allocation */
 			liftoff_log(LIFTOFF_DEBUG,
 				    "%sFound a better allocation with score=%d",
@@ -401,6 +724,13 @@ output_choose_layers(struct liftoff_output *output, struct alloc_result *result,
 		return 0;
 	}
 
+	layer = step->reserved[step->plane_idx];
+	if (layer != NULL) {
+		/* The slice has already been applied with the first one */
+		plane_step_init_slice(&next_step, step, layer);
+		return output_choose_layers(output, result, &next_step);
+	}
+
 	cursor = drmModeAtomicGetCursor(result->req);
 
 	if (plane->layer != NULL) {
@@ -410,12 +740,32 @@ output_choose_layers(struct liftoff_output *output, struct alloc_result *result,
 		goto skip;
 	}
 
+	/* Planes are sorted primary first, so if no layer has been put on the
+	 * primary plane by now, it will stay disabled */
+	if (device->primary_plane_required &&
+	    plane->type != DRM_PLANE_TYPE_PRIMARY && !step->primary_enabled) {
+		liftoff_log(LIFTOFF_DEBUG,
+			    "%sSkipping plane %"PRIu32": primary plane is "
+			    "disabled", step->log_prefix, plane->id);
+		goto skip;
+	}
+	if (device->max_overlay_planes >= 0 &&
+	    plane->type == DRM_PLANE_TYPE_OVERLAY &&
+	    step->overlays >= device->max_overlay_planes) {
+		liftoff_log(LIFTOFF_DEBUG,
+			    "%sSkipping plane %"PRIu32": too many overlay "
+			    "planes", step->log_prefix, plane->id);
+		goto skip;
+	}
+
 	liftoff_log(LIFTOFF_DEBUG,
 		    "%sPerforming allocation for plane %"PRIu32" (%zu/%zu)",
 		    step->log_prefix, plane->id, step->plane_idx + 1, result->planes_len);
 
-	liftoff_list_for_each(layer, &output->layers, link) {
-		if (layer->plane != NULL || layer->force_composition) {
+	for (i = 0; i < result->layers_len; i++) {
+		layer = result->layers[i];
+		if (layer->plane != NULL || layer->force_composition ||
+		    layer->group_composited) {
 			continue;
 		}
 		if (!layer_is_visible(layer)) {
@@ -424,9 +774,18 @@ output_choose_layers(struct liftoff_output *output, struct alloc_result *result,
 		if (!check_layer_plane_compatible(step, layer, plane)) {
 			continue;
 		}
+		if (plane_caps_predict_failure(plane, layer)) {
+			continue;
+		}
+
+		slices_len = layer_get_slices_len(layer);
+		if (!find_slice_planes(output, step, layer, slice_planes,
+				       slice_idxs, slices_len)) {
+			continue;
+		}
 
 		/* Try to use this layer for the current plane */
-		ret = plane_apply(plane, layer, result->req);
+		ret = apply_slices(layer, slice_planes, slices_len, result->req);
 		if (ret == -EINVAL) {
 			liftoff_log(LIFTOFF_DEBUG,
 				    "%s Layer %p -> plane %"PRIu32": "
@@ -438,13 +797,25 @@ output_choose_layers(struct liftoff_output *output, struct alloc_result *result,
 		}
 
 		ret = device_test_commit(device, result->req, result->flags);
+		/* The outcome of a split can't be attributed to one plane, so
+		 * only learn from single planes */
 		if (ret == 0) {
+			if (slices_len == 1) {
+				plane_caps_record_success(plane, layer);
+			}
 			liftoff_log(LIFTOFF_DEBUG,
 				    "%s Layer %p -> plane %"PRIu32": success",
 				    step->log_prefix, (void *)layer, plane->id);
 			/* Continue with the next plane */
-			plane_step_init_next(&next_step, step, layer);
+			for (j = 1; j < slices_len; j++) {
+				step->reserved[slice_idxs[j]] = layer;
+			}
+			plane_step_init_split(&next_step, step, layer,
+					      slices_len);
 			ret = output_choose_layers(output, result, &next_step);
+			for (j = 1; j < slices_len; j++) {
+				step->reserved[slice_idxs[j]] = NULL;
+			}
 			if (ret != 0) {
 				return ret;
 			}
@@ -456,6 +827,15 @@ output_choose_layers(struct liftoff_output *output, struct alloc_result *result,
 				    "test-only commit failed (%s)",
 				    step->log_prefix, (void *)layer, plane->id,
 				    strerror(-ret));
+
+			drmModeAtomicSetCursor(result->req, cursor);
+			if (slices_len == 1) {
+				ret = check_scaling_failure(device, result,
+							    plane, layer);
+				if (ret != 0) {
+					return ret;
+				}
+			}
 		}
 
 		drmModeAtomicSetCursor(result->req, cursor);
@@ -473,31 +853,82 @@ skip:
 	return 0;
 }
 
+static bool
+plane_is_applied_by(struct liftoff_plane *plane, struct liftoff_output *output)
+{
+	/* Planes used by other outputs are set when these are applied */
+	return plane->layer == NULL || plane->layer->output == output;
+}
+
 static int
-apply_current(struct liftoff_device *device, drmModeAtomicReq *req)
+apply_current(struct liftoff_output *output, drmModeAtomicReq *req)
 {
 	struct liftoff_plane *plane;
 	int cursor, ret;
 
 	cursor = drmModeAtomicGetCursor(req);
 
-	liftoff_list_for_each(plane, &device->planes, link) {
-		ret = plane_apply(plane, plane->layer, req);
-		assert(ret != -EINVAL);
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (!plane_is_applied_by(plane, output)) {
+			continue;
+		}
+		ret = plane_apply(plane, plane->layer, plane->slice, req);
 		if (ret != 0) {
 			drmModeAtomicSetCursor(req, cursor);
 			return ret;
 		}
 	}
 
+	/* Remember what the request contains, in case it gets committed */
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane_is_applied_by(plane, output)) {
+			plane->pending_output = output;
+			plane->pending_layer = plane->layer;
+		}
+	}
+
 	return 0;
 }
 
+static bool
+fb_format_changed(struct liftoff_device *device, uint32_t prev_fb_id,
+		  uint32_t fb_id)
+{
+	struct liftoff_fb_info prev_info, info;
+
+	/* If we can't query the FBs, let the test commit figure it out */
+	if (!device_get_fb_info(device, prev_fb_id, &prev_info) ||
+	    !device_get_fb_info(device, fb_id, &info)) {
+		return false;
+	}
+
+	return prev_info.format != info.format ||
+	       prev_info.modifier != info.modifier;
+}
+
+static bool
+fb_metadata_equal(struct liftoff_device *device, uint32_t prev_fb_id,
+		  uint32_t fb_id)
+{
+	struct liftoff_fb_info prev_info, info;
+
+	if (!device_get_fb_info(device, prev_fb_id, &prev_info) ||
+	    !device_get_fb_info(device, fb_id, &info)) {
+		return false;
+	}
+
+	return prev_info.format == info.format &&
+	       prev_info.modifier == info.modifier &&
+	       prev_info.width == info.width &&
+	       prev_info.height == info.height;
+}
+
 static bool
 layer_needs_realloc(struct liftoff_layer *layer)
 {
 	size_t i;
 	struct liftoff_layer_property *prop;
+	struct liftoff_realloc_policy *policy;
 
 	if (layer->changed) {
 		return true;
@@ -509,17 +940,33 @@ layer_needs_realloc(struct liftoff_layer *layer)
 			continue;
 		}
 
+		/* User-provided policies take precedence over the built-in
+		 * ones below */
+		policy = output_get_realloc_policy(layer->output, prop->name);
+		if (policy != NULL) {
+			if (realloc_policy_needs_realloc(policy,
+							 prop->prev_value,
+							 prop->value)) {
+				return true;
+			}
+			continue;
+		}
+
 		/* If FB_ID changes from non-zero to zero, we don't need to
 		 * display this layer anymore, so we may be able to re-use its
 		 * plane for another layer. If FB_ID changes from zero to
 		 * non-zero, we might be able to find a plane for this layer.
 		 * If FB_ID changes from non-zero to non-zero, we can try to
-		 * re-use the previous allocation. */
+		 * re-use the previous allocation unless the format or modifier
+		 * changed, since planes only support some of them. */
 		if (strcmp(prop->name, "FB_ID") == 0) {
 			if (prop->value == 0 || prop->prev_value == 0) {
 				return true;
 			}
-			/* TODO: check format/modifier is the same? */
+			if (fb_format_changed(layer->output->device,
+					      prop->prev_value, prop->value)) {
+				return true;
+			}
 			continue;
 		}
 
@@ -541,41 +988,261 @@ layer_needs_realloc(struct liftoff_layer *layer)
 			continue;
 		}
 
-		/* TODO: if CRTC_{X,Y,W,H} changed but intersection with other
-		 * layers hasn't changed, don't realloc */
+		/* If CRTC_{X,Y,W,H} changed, we can keep the current allocation
+		 * as long as the intersections between layers haven't changed.
+		 * This is checked by output_intersections_changed. */
+		if (strcmp(prop->name, "CRTC_X") == 0 ||
+		    strcmp(prop->name, "CRTC_Y") == 0 ||
+		    strcmp(prop->name, "CRTC_W") == 0 ||
+		    strcmp(prop->name, "CRTC_H") == 0) {
+			continue;
+		}
+
 		return true;
 	}
 
 	return false;
 }
 
-static int
-reuse_previous_alloc(struct liftoff_output *output, drmModeAtomicReq *req,
-		     uint32_t flags)
+static size_t
+layers_intersect_len(size_t layers_len)
 {
-	struct liftoff_device *device;
-	struct liftoff_layer *layer;
-	int cursor, ret;
+	return layers_len * (layers_len - 1) / 2;
+}
 
-	device = output->device;
+static bool
+output_intersections_changed(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer, *other;
+	size_t i;
 
-	if (output->layers_changed) {
-		return -EINVAL;
+	if (output->layers_intersect_len !=
+	    layers_intersect_len(liftoff_list_length(&output->layers))) {
+		return true;
 	}
 
+	i = 0;
 	liftoff_list_for_each(layer, &output->layers, link) {
-		if (layer_needs_realloc(layer)) {
-			return -EINVAL;
+		other = layer;
+		while (other->link.next != &output->layers) {
+			other = liftoff_container_of(other->link.next, other,
+						     link);
+			if (layer_intersects(layer, other) !=
+			    output->layers_intersect[i]) {
+				return true;
+			}
+			i++;
 		}
 	}
 
-	cursor = drmModeAtomicGetCursor(req);
-
-	ret = apply_current(device, req);
+	return false;
+}
+
+static void
+output_save_intersections(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer, *other;
+	bool *layers_intersect;
+	size_t i, len;
+
+	len = layers_intersect_len(liftoff_list_length(&output->layers));
+	if (len != output->layers_intersect_len) {
+		layers_intersect = realloc(output->layers_intersect,
+					   len * sizeof(bool));
+		if (layers_intersect == NULL && len > 0) {
+			liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+			/* Force a new allocation next time */
+			output->layers_changed = true;
+			return;
+		}
+		output->layers_intersect = layers_intersect;
+		output->layers_intersect_len = len;
+	}
+
+	i = 0;
+	liftoff_list_for_each(layer, &output->layers, link) {
+		other = layer;
+		while (other->link.next != &output->layers) {
+			other = liftoff_container_of(other->link.next, other,
+						     link);
+			output->layers_intersect[i] = layer_intersects(layer,
+								       other);
+			i++;
+		}
+	}
+}
+
+static bool
+layer_deserves_plane_over(struct liftoff_layer *layer,
+			  struct liftoff_layer *other, bool current)
+{
+	double priority, other_priority;
+
+	if (current) {
+		priority = layer->priority;
+		other_priority = other->priority;
+	} else {
+		priority = layer->alloc_priority;
+		other_priority = other->alloc_priority;
+	}
+
+	return priority > LIFTOFF_PRIORITY_REALLOC_FACTOR * other_priority + 1;
+}
+
+static bool
+output_priority_changed(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer, *other;
+
+	/* Check whether a layer which doesn't have a plane is now updated much
+	 * more often than a layer which has one. Only consider pairs whose
+	 * priority ordering has changed since the last plane allocation, to
+	 * avoid re-computing the same allocation over and over again. */
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (!liftoff_layer_needs_composition(layer) ||
+		    layer->force_composition || layer->group_composited) {
+			continue;
+		}
+
+		liftoff_list_for_each(other, &output->layers, link) {
+			if (other->plane == NULL ||
+			    layer_is_composition(other)) {
+				continue;
+			}
+
+			if (layer_deserves_plane_over(layer, other, true) &&
+			    !layer_deserves_plane_over(layer, other, false)) {
+				liftoff_log(LIFTOFF_DEBUG,
+					    "Layer %p priority (%.1f Hz) now "
+					    "exceeds layer %p priority (%.1f Hz)",
+					    (void *)layer, layer->priority,
+					    (void *)other, other->priority);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static bool
+layer_needs_test(struct liftoff_layer *layer)
+{
+	size_t i;
+	struct liftoff_layer_property *prop;
+
+	for (i = 0; i < layer->props_len; i++) {
+		prop = &layer->props[i];
+		if (prop->value == prop->prev_value) {
+			continue;
+		}
+
+		/* Only buffer updates can skip the test commit: swapping a
+		 * non-zero FB_ID for another one with the same format,
+		 * modifier and size, or changing the fence or the damage. */
+		if (strcmp(prop->name, "FB_ID") == 0 &&
+		    prop->value != 0 && prop->prev_value != 0 &&
+		    fb_metadata_equal(layer->output->device, prop->prev_value,
+				      prop->value)) {
+			continue;
+		}
+		if (strcmp(prop->name, "IN_FENCE_FD") == 0 ||
+		    strcmp(prop->name, "FB_DAMAGE_CLIPS") == 0) {
+			continue;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+output_can_skip_test(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer;
+
+	if (!output->trusted_reuse || !output->commit_succeeded) {
+		return false;
+	}
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer_needs_test(layer)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* A geometry change may change the number of planes a split layer needs */
+static bool
+layer_slices_changed(struct liftoff_layer *layer)
+{
+	struct liftoff_plane *plane;
+	size_t planes_len;
+
+	if (layer->plane == NULL) {
+		return false;
+	}
+
+	planes_len = 0;
+	liftoff_list_for_each(plane, &layer->output->device->planes, link) {
+		if (plane->layer == layer) {
+			planes_len++;
+		}
+	}
+
+	return planes_len != layer_get_slices_len(layer);
+}
+
+static int
+reuse_previous_alloc(struct liftoff_output *output, drmModeAtomicReq *req,
+		     uint32_t flags)
+{
+	struct liftoff_device *device;
+	struct liftoff_layer *layer;
+	int cursor, ret;
+	bool skip_test;
+
+	device = output->device;
+
+	if (output->layers_changed) {
+		return -EINVAL;
+	}
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer_needs_realloc(layer) || layer_slices_changed(layer)) {
+			return -EINVAL;
+		}
+	}
+
+	if (output_intersections_changed(output)) {
+		liftoff_log(LIFTOFF_DEBUG, "Layer intersections changed");
+		return -EINVAL;
+	}
+
+	if (output_priority_changed(output)) {
+		return -EINVAL;
+	}
+
+	skip_test = output_can_skip_test(output);
+
+	cursor = drmModeAtomicGetCursor(req);
+
+	/* This fails with -EINVAL if a layer property changed to a value the
+	 * plane doesn't support */
+	ret = apply_current(output, req);
 	if (ret != 0) {
 		return ret;
 	}
 
+	if (skip_test) {
+		liftoff_log(LIFTOFF_DEBUG, "Only buffers changed on output %p, "
+			    "skipping test commit", (void *)output);
+		return 0;
+	}
+
 	ret = device_test_commit(device, req, flags);
 	if (ret != 0) {
 		drmModeAtomicSetCursor(req, cursor);
@@ -583,38 +1250,316 @@ reuse_previous_alloc(struct liftoff_output *output, drmModeAtomicReq *req,
 	return ret;
 }
 
+static void
+unset_output_mappings(struct liftoff_output *output)
+{
+	struct liftoff_plane *plane;
+
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->layer != NULL && plane->layer->output == output) {
+			plane->layer->plane = NULL;
+			plane->layer = NULL;
+		}
+	}
+}
+
+static struct liftoff_layer *
+output_get_layer_at(struct liftoff_output *output, int index)
+{
+	struct liftoff_layer *layer;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (index == 0) {
+			return layer;
+		}
+		index--;
+	}
+
+	return NULL;
+}
+
+static bool
+scene_has_layer(struct liftoff_scene *scene, int layer_idx)
+{
+	size_t i;
+
+	for (i = 0; i < scene->planes_len; i++) {
+		if (scene->plane_layers[i] == layer_idx) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Like output_priority_changed, for the layers the scene left without a plane
+ * and the layers it put on planes */
+static bool
+scene_priority_changed(struct liftoff_output *output,
+		       struct liftoff_scene *scene)
+{
+	struct liftoff_layer *layer, *other;
+	int layer_idx, other_idx;
+
+	layer_idx = -1;
+	liftoff_list_for_each(layer, &output->layers, link) {
+		layer_idx++;
+		if (!layer_is_visible(layer) || layer_is_composition(layer) ||
+		    layer->force_composition || layer->group_composited ||
+		    scene_has_layer(scene, layer_idx)) {
+			continue;
+		}
+
+		other_idx = -1;
+		liftoff_list_for_each(other, &output->layers, link) {
+			other_idx++;
+			if (!scene_has_layer(scene, other_idx) ||
+			    layer_is_composition(other)) {
+				continue;
+			}
+
+			if (layer_deserves_plane_over(layer, other, true)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static bool
+scene_is_applicable(struct liftoff_output *output, struct liftoff_scene *scene)
+{
+	struct liftoff_plane *plane;
+	struct liftoff_layer *layer;
+	size_t i;
+	int layer_idx;
+
+	/* The hash covers most of this, but collisions are possible */
+	if (scene->planes_len != liftoff_list_length(&output->device->planes)) {
+		return false;
+	}
+
+	i = 0;
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		layer_idx = scene->plane_layers[i];
+		i++;
+		if (layer_idx < 0) {
+			continue;
+		}
+		if (plane->layer != NULL ||
+		    (plane->possible_crtcs & (1 << output->crtc_index)) == 0) {
+			return false;
+		}
+
+		layer = output_get_layer_at(output, layer_idx);
+		if (layer == NULL || !layer_is_visible(layer) ||
+		    layer->force_composition || layer->group_composited ||
+		    layer->plane != NULL) {
+			return false;
+		}
+	}
+
+	/* The hash doesn't cover priorities */
+	if (scene_priority_changed(output, scene)) {
+		liftoff_log(LIFTOFF_DEBUG, "Layer priorities changed since "
+			    "scene %016"PRIx64" was cached", scene->hash);
+		return false;
+	}
+
+	return true;
+}
+
+static int
+reuse_cached_scene(struct liftoff_output *output, uint64_t hash,
+		   drmModeAtomicReq *req, uint32_t flags)
+{
+	struct liftoff_device *device;
+	struct liftoff_scene *scene;
+	struct liftoff_plane *plane;
+	struct liftoff_layer *layer;
+	size_t i;
+	int layer_idx, cursor, ret;
+
+	device = output->device;
+
+	scene = output_get_scene(output, hash);
+	if (scene == NULL) {
+		return -ENOENT;
+	}
+	if (!scene_is_applicable(output, scene)) {
+		output_remove_scene(output, scene);
+		return -EINVAL;
+	}
+
+	i = 0;
+	liftoff_list_for_each(plane, &device->planes, link) {
+		layer_idx = scene->plane_layers[i];
+		i++;
+		if (layer_idx < 0) {
+			continue;
+		}
+		layer = output_get_layer_at(output, layer_idx);
+		plane_map_layer(plane, layer);
+	}
+
+	cursor = drmModeAtomicGetCursor(req);
+
+	ret = apply_current(output, req);
+	if (ret == 0) {
+		ret = device_test_commit(device, req, flags);
+	}
+	if (ret != 0) {
+		/* Something else changed, e.g. another output's bandwidth
+		 * usage: this allocation isn't worth remembering */
+		liftoff_log(LIFTOFF_DEBUG, "Cached plane allocation for scene "
+			    "%016"PRIx64" failed: %s", hash, strerror(-ret));
+		drmModeAtomicSetCursor(req, cursor);
+		unset_output_mappings(output);
+		output_remove_scene(output, scene);
+	}
+	return ret;
+}
+
 static void
 mark_layers_clean(struct liftoff_output *output)
 {
 	struct liftoff_layer *layer;
 
+	if (output->layers_changed) {
+		output->uncommitted_layers_changed = true;
+	}
 	output->layers_changed = false;
 
 	liftoff_list_for_each(layer, &output->layers, link) {
 		layer_mark_clean(layer);
 	}
+
+	output_save_intersections(output);
+
+	/* FBs which are no longer attached to any layer may be removed */
+	device_evict_fb_infos(output->device);
+}
+
+static uint64_t
+get_time_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "clock_gettime");
+		return 0;
+	}
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
 static void
-update_layers_priority(struct liftoff_device *device)
+update_layers_priority(struct liftoff_output *output)
 {
-	struct liftoff_output *output;
 	struct liftoff_layer *layer;
+	uint64_t now;
+
+	now = output->presentation_time;
+	if (now == 0) {
+		now = get_time_nsec();
+	}
+	output->presentation_time = 0;
 
-	device->page_flip_counter++;
-	bool period_elapsed =
-		device->page_flip_counter >= LIFTOFF_PRIORITY_PERIOD;
-	if (period_elapsed) {
-		device->page_flip_counter = 0;
+	liftoff_list_for_each(layer, &output->layers, link) {
+		layer_update_priority(layer, now);
+	}
+}
+
+static bool
+layer_is_occluded_by(struct liftoff_layer *layer, struct liftoff_layer *other)
+{
+	struct liftoff_layer_property *zpos_prop, *other_zpos_prop;
+	struct liftoff_rect rect, opaque;
+
+	zpos_prop = layer_get_property(layer, "zpos");
+	other_zpos_prop = layer_get_property(other, "zpos");
+	if (zpos_prop == NULL || other_zpos_prop == NULL ||
+	    other_zpos_prop->value <= zpos_prop->value) {
+		return false;
+	}
+
+	if (!layer_is_visible(other) || !layer_get_opaque_rect(other, &opaque)) {
+		return false;
+	}
+
+	layer_get_rect(layer, &rect);
+	return rect.x >= opaque.x && rect.y >= opaque.y &&
+	       rect.x + rect.width <= opaque.x + opaque.width &&
+	       rect.y + rect.height <= opaque.y + opaque.height;
+}
+
+static bool
+layer_is_offscreen(struct liftoff_layer *layer)
+{
+	struct liftoff_output *output = layer->output;
+	struct liftoff_rect rect;
+
+	if (output->width == 0 || output->height == 0) {
+		return false;
 	}
 
-	liftoff_list_for_each(output, &device->outputs, link) {
-		liftoff_list_for_each(layer, &output->layers, link) {
-			layer_update_priority(layer, period_elapsed);
+	layer_get_rect(layer, &rect);
+	return rect.x >= output->width || rect.y >= output->height ||
+	       rect.x + rect.width <= 0 || rect.y + rect.height <= 0;
+}
+
+/* Hides layers outside of the CRTC and layers entirely covered by an opaque
+ * layer above them. Composition layers are never hidden. */
+static void
+update_layers_visibility(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer, *other;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		layer->prev_hidden = layer->hidden;
+		layer->hidden = false;
+	}
+
+	/* Skipping layers which are already hidden is fine: whatever they
+	 * cover is off-screen or covered by the layer hiding them too */
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer_is_composition(layer) || !layer_is_visible(layer)) {
+			continue;
+		}
+
+		if (layer_is_offscreen(layer)) {
+			layer->hidden = true;
+			continue;
+		}
+
+		liftoff_list_for_each(other, &output->layers, link) {
+			if (other != layer && layer_is_occluded_by(layer, other)) {
+				layer->hidden = true;
+				break;
+			}
+		}
+	}
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer->hidden != layer->prev_hidden) {
+			liftoff_log(LIFTOFF_DEBUG, "Layer %p is %s", (void *)layer,
+				    layer->hidden ? "now hidden" :
+				    "not hidden anymore");
+			output->layers_changed = true;
 		}
 	}
 }
 
+static void
+mark_layers_alloc_priority(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		layer->alloc_priority = layer->priority;
+	}
+}
+
 static void
 log_reuse(struct liftoff_output *output)
 {
@@ -641,26 +1586,42 @@ log_no_reuse(struct liftoff_output *output)
 	}
 }
 
-static size_t
-non_composition_layers_length(struct liftoff_output *output)
+static struct liftoff_layer **
+sort_layers_by_priority(struct liftoff_output *output, size_t *layers_len)
 {
-	struct liftoff_layer *layer;
-	size_t n;
+	struct liftoff_layer **layers, *layer;
+	size_t i, j, n;
 
-	n = 0;
+	n = liftoff_list_length(&output->layers);
+	layers = malloc(n * sizeof(*layers));
+	if (layers == NULL && n > 0) {
+		return NULL;
+	}
+
+	/* Insertion sort: stable, and the number of layers is small. Layers
+	 * updated more often are tried first, so that they win ties. */
+	i = 0;
 	liftoff_list_for_each(layer, &output->layers, link) {
-		if (layer_is_visible(layer) &&
-		    output->composition_layer != layer) {
-			n++;
+		j = i;
+		while (j > 0 && layers[j - 1]->priority < layer->priority) {
+			layers[j] = layers[j - 1];
+			j--;
 		}
+		layers[j] = layer;
+		i++;
 	}
 
-	return n;
+	*layers_len = n;
+	return layers;
 }
 
+/* Builds the plane allocation and fills the request, but leaves the layers
+ * dirty until output_apply_finish. A group of outputs may apply them again
+ * with retry set if the allocation doesn't suit the group: the layers haven't
+ * changed since the previous pass of the same frame. */
 int
-liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
-		     uint32_t flags)
+output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
+	     uint32_t flags, bool retry)
 {
 	struct liftoff_device *device;
 	struct liftoff_plane *plane;
@@ -668,16 +1629,36 @@ liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 	struct alloc_result result = {0};
 	struct alloc_step step = {0};
 	size_t i, candidate_planes;
-	int ret;
+	uint64_t scene_hash;
+	bool uses_planes = false;
+	int cursor, ret;
 
 	device = output->device;
 
-	update_layers_priority(device);
+	device_cache_load(device);
+	device_collect_blobs(device);
+	if (!retry) {
+		update_layers_priority(output);
+		update_layers_visibility(output);
+		output_update_composition_targets(output);
+	}
+	output->apply_realloc = false;
+	output->apply_add_scene = false;
+
+	/* Leave the request untouched on error */
+	cursor = drmModeAtomicGetCursor(req);
 
 	ret = reuse_previous_alloc(output, req, flags);
+	/* The next liftoff_output_commit_done call will be about the request
+	 * we're filling */
+	output->commit_succeeded = false;
 	if (ret == 0) {
 		log_reuse(output);
-		return 0;
+		ret = output_update_composition(output, req, retry);
+		if (ret != 0) {
+			drmModeAtomicSetCursor(req, cursor);
+		}
+		return ret;
 	}
 	log_no_reuse(output);
 
@@ -685,11 +1666,28 @@ liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 	output_log_layers(output);
 
 	/* Unset all existing plane and layer mappings. */
-	liftoff_list_for_each(plane, &device->planes, link) {
-		if (plane->layer != NULL && plane->layer->output == output) {
-			plane->layer->plane = NULL;
-			plane->layer = NULL;
+	unset_output_mappings(output);
+
+	result.layers = sort_layers_by_priority(output, &result.layers_len);
+	if (result.layers == NULL && !liftoff_list_empty(&output->layers)) {
+		liftoff_log_errno(LIFTOFF_ERROR, "malloc");
+		return -ENOMEM;
+	}
+
+	scene_hash = output_scene_hash(output);
+	if (reuse_cached_scene(output, scene_hash, req, flags) == 0) {
+		liftoff_log(LIFTOFF_DEBUG, "Reusing cached plane allocation "
+			    "for scene %016"PRIx64" on output %p", scene_hash,
+			    (void *)output);
+		output->scene_hash = scene_hash;
+		free(result.layers);
+		ret = output_update_composition(output, req, retry);
+		if (ret != 0) {
+			drmModeAtomicSetCursor(req, cursor);
+			return ret;
 		}
+		output->apply_realloc = true;
+		return 0;
 	}
 
 	/* Disable all planes we might use. Do it before building mappings to
@@ -701,10 +1699,10 @@ liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 			candidate_planes++;
 			liftoff_log(LIFTOFF_DEBUG,
 				    "Disabling plane %"PRIu32, plane->id);
-			ret = plane_apply(plane, NULL, req);
+			ret = plane_apply(plane, NULL, 0, req);
 			assert(ret != -EINVAL);
 			if (ret != 0) {
-				return ret;
+				goto out;
 			}
 		}
 	}
@@ -714,10 +1712,13 @@ liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 	result.planes_len = liftoff_list_length(&device->planes);
 
 	step.alloc = malloc(result.planes_len * sizeof(*step.alloc));
+	step.reserved = calloc(result.planes_len, sizeof(*step.reserved));
 	result.best = malloc(result.planes_len * sizeof(*result.best));
-	if (step.alloc == NULL || result.best == NULL) {
+	if (step.alloc == NULL || step.reserved == NULL ||
+	    result.best == NULL) {
 		liftoff_log_errno(LIFTOFF_ERROR, "malloc");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto out;
 	}
 
 	/* For each plane, try to find a layer. Don't do it the other
@@ -727,17 +1728,15 @@ liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 
 	result.best_score = -1;
 	memset(result.best, 0, result.planes_len * sizeof(*result.best));
-	result.has_composition_layer = output->composition_layer != NULL;
-	result.non_composition_layers_len =
-		non_composition_layers_length(output);
 	step.plane_link = device->planes.next;
 	step.plane_idx = 0;
 	step.score = 0;
 	step.last_layer_zpos = INT_MAX;
-	step.composited = false;
+	step.primary_enabled = false;
+	step.overlays = 0;
 	ret = output_choose_layers(output, &result, &step);
 	if (ret != 0) {
-		return ret;
+		goto out;
 	}
 
 	liftoff_log(LIFTOFF_DEBUG,
@@ -758,23 +1757,64 @@ liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 			    (void *)layer, plane->id);
 
 		assert(plane->layer == NULL);
-		assert(layer->plane == NULL);
-		plane->layer = layer;
-		layer->plane = plane;
+		plane_map_layer(plane, layer);
+		uses_planes = true;
 	}
 	if (i == 0) {
 		liftoff_log(LIFTOFF_DEBUG, "  (No layer has a plane)");
 	}
 
-	ret = apply_current(device, req);
+	ret = apply_current(output, req);
 	if (ret != 0) {
-		return ret;
+		goto out;
 	}
 
+	output->scene_hash = scene_hash;
+
+	ret = output_update_composition(output, req, retry);
+	if (ret != 0) {
+		goto out;
+	}
+	output->apply_realloc = true;
+	/* Don't bother remembering allocations which don't use any plane:
+	 * re-validating them wouldn't save any test commit */
+	output->apply_add_scene = uses_planes;
+
+out:
+	if (ret != 0) {
+		drmModeAtomicSetCursor(req, cursor);
+	}
 	free(step.alloc);
+	free(step.reserved);
 	free(result.best);
+	free(result.layers);
+	return ret;
+}
 
+/* Commits the state of the last output_apply pass to the layers */
+void
+output_apply_finish(struct liftoff_output *output)
+{
+	if (output->apply_add_scene) {
+		output_add_scene(output, output->scene_hash);
+	}
+	output->composition_reset = false;
 	mark_layers_clean(output);
+	if (output->apply_realloc) {
+		mark_layers_alloc_priority(output);
+	}
+}
+
+int
+liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
+		     uint32_t flags)
+{
+	int ret;
 
+	ret = output_apply(output, req, flags, false);
+	if (ret != 0) {
+		return ret;
+	}
+	output_apply_finish(output);
 	return 0;
 }
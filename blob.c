@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+/* Property blob cache
+ *
+ * Blob properties (damage clips, color LUTs, CTM...) often keep the same
+ * contents for many frames. Blobs created by libliftoff are shared between
+ * all users of the same contents, so that setting unchanged contents doesn't
+ * require a new blob.
+ *
+ * A blob is in use while a layer property references it, or while a plane's
+ * pending or committed state does. Unused blobs are kept around, in case
+ * recent contents show up again, and destroyed once more than
+ * LIFTOFF_IDLE_BLOBS_MAX of them have piled up.
+ */
+
+struct liftoff_blob {
+	struct liftoff_list link; /* liftoff_device.blobs */
+	uint32_t id;
+	uint64_t hash;
+	void *data;
+	size_t size;
+	int refs; /* layer properties referencing the blob */
+};
+
+static uint64_t
+hash_data(const void *data, size_t size)
+{
+	const unsigned char *bytes = data;
+	uint64_t hash;
+	size_t i;
+
+	/* FNV-1a */
+	hash = LIFTOFF_HASH_INIT;
+	for (i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+static void
+blob_destroy(struct liftoff_device *device, struct liftoff_blob *blob)
+{
+	int ret;
+
+	ret = drmModeDestroyPropertyBlob(device->drm_fd, blob->id);
+	if (ret != 0) {
+		liftoff_log(LIFTOFF_ERROR, "drmModeDestroyPropertyBlob: %s",
+			    strerror(-ret));
+	}
+	liftoff_list_remove(&blob->link);
+	free(blob->data);
+	free(blob);
+}
+
+/* Returns a blob with the given contents, NULL on error with errno set */
+struct liftoff_blob *
+device_get_blob(struct liftoff_device *device, const void *data, size_t size)
+{
+	struct liftoff_blob *blob;
+	uint64_t hash;
+	int ret;
+
+	hash = hash_data(data, size);
+	liftoff_list_for_each(blob, &device->blobs, link) {
+		if (blob->hash == hash && blob->size == size &&
+		    memcmp(blob->data, data, size) == 0) {
+			/* Keep the list sorted by last use */
+			liftoff_list_remove(&blob->link);
+			liftoff_list_insert(&device->blobs, &blob->link);
+			return blob;
+		}
+	}
+
+	blob = calloc(1, sizeof(*blob));
+	if (blob == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
+		return NULL;
+	}
+
+	blob->data = malloc(size);
+	if (blob->data == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "malloc");
+		free(blob);
+		return NULL;
+	}
+	memcpy(blob->data, data, size);
+	blob->size = size;
+	blob->hash = hash;
+
+	ret = drmModeCreatePropertyBlob(device->drm_fd, data, size, &blob->id);
+	if (ret != 0) {
+		liftoff_log(LIFTOFF_ERROR, "drmModeCreatePropertyBlob: %s",
+			    strerror(-ret));
+		free(blob->data);
+		free(blob);
+		errno = -ret;
+		return NULL;
+	}
+
+	liftoff_list_insert(&device->blobs, &blob->link);
+	return blob;
+}
+
+uint32_t
+blob_get_id(struct liftoff_blob *blob)
+{
+	return blob->id;
+}
+
+const void *
+blob_get_data(struct liftoff_blob *blob, size_t *size)
+{
+	*size = blob->size;
+	return blob->data;
+}
+
+void
+blob_ref(struct liftoff_blob *blob)
+{
+	blob->refs++;
+}
+
+void
+blob_unref(struct liftoff_blob *blob)
+{
+	blob->refs--;
+}
+
+static bool
+device_blob_in_use(struct liftoff_device *device, struct liftoff_blob *blob)
+{
+	struct liftoff_plane *plane;
+	struct liftoff_plane_property *prop;
+	size_t i;
+
+	if (blob->refs > 0) {
+		return true;
+	}
+
+	liftoff_list_for_each(plane, &device->planes, link) {
+		for (i = 0; i < plane->props_len; i++) {
+			prop = &plane->props[i];
+			/* Other values may collide with blob IDs */
+			if (prop->info == NULL ||
+			    !(prop->info->flags & DRM_MODE_PROP_BLOB)) {
+				continue;
+			}
+			if ((prop->pending_known &&
+			     prop->pending_value == blob->id) ||
+			    (prop->committed_known &&
+			     prop->committed_value == blob->id)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Destroys the least recently used blobs which aren't in use anymore. Called
+ * before filling a new request: the previous ones have been committed or
+ * dropped by then. */
+void
+device_collect_blobs(struct liftoff_device *device)
+{
+	struct liftoff_blob *blob, *tmp;
+	size_t idle;
+
+	idle = 0;
+	liftoff_list_for_each_safe(blob, tmp, &device->blobs, link) {
+		if (device_blob_in_use(device, blob)) {
+			continue;
+		}
+		idle++;
+		if (idle > LIFTOFF_IDLE_BLOBS_MAX) {
+			blob_destroy(device, blob);
+		}
+	}
+}
+
+void
+device_blobs_finish(struct liftoff_device *device)
+{
+	struct liftoff_blob *blob, *tmp;
+
+	liftoff_list_for_each_safe(blob, tmp, &device->blobs, link) {
+		blob_destroy(device, blob);
+	}
+}
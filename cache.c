@@ -0,0 +1,374 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* flock */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include "private.h"
+
+#define CACHE_MAGIC "LIFTOFFC"
+#define CACHE_VERSION 2
+
+/* On-disk layout: a header followed by LIFTOFF_CACHE_RECORDS_MAX records.
+ *
+ * Each record holds the scaling test outcomes of a plane for a format and
+ * modifier, see struct liftoff_scaling_limits. These are the only facts the
+ * allocator can attribute to a single plane and layer: the formats and sizes
+ * a plane accepts are known from IN_FORMATS, SIZE_HINTS and the cursor caps
+ * at startup, and a test commit failing with several planes enabled doesn't
+ * tell which pair of planes conflicts. */
+struct liftoff_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t records_len;
+	uint64_t topology_hash;
+	char driver_name[32];
+	int32_t driver_major, driver_minor, driver_patchlevel;
+	uint32_t pad;
+};
+
+struct liftoff_cache_record {
+	uint32_t plane_id; /* zero if unused */
+	uint32_t format;
+	uint64_t modifier;
+	uint64_t pass_downscale, pass_upscale;
+	uint64_t fail_downscale, fail_upscale;
+};
+
+struct liftoff_cache {
+	int fd;
+	void *data;
+	size_t size;
+	bool loaded;
+	/* expected header, see device_cache_load */
+	struct liftoff_cache_header header;
+
+	char driver_name[32];
+	int driver_major, driver_minor, driver_patchlevel;
+};
+
+uint64_t
+hash_u64(uint64_t hash, uint64_t value)
+{
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < sizeof(value); i++) {
+		hash ^= (value >> (8 * i)) & 0xFF;
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+uint64_t
+hash_str(uint64_t hash, const char *str)
+{
+	for (; *str != '\0'; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+static uint64_t
+device_topology_hash(struct liftoff_device *device)
+{
+	struct liftoff_plane *plane;
+	uint64_t hash;
+
+	hash = LIFTOFF_HASH_INIT;
+	liftoff_list_for_each(plane, &device->planes, link) {
+		hash = hash_u64(hash, plane->id);
+		hash = hash_u64(hash, plane->type);
+		hash = hash_u64(hash, plane->possible_crtcs);
+		hash = hash_u64(hash, (uint64_t)plane->zpos);
+	}
+	return hash;
+}
+
+int
+liftoff_device_set_cache_file(struct liftoff_device *device, const char *path)
+{
+	struct liftoff_cache *cache;
+	drmVersion *version;
+
+	device_cache_finish(device);
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
+		return -ENOMEM;
+	}
+
+	version = drmGetVersion(device->drm_fd);
+	if (version == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "drmGetVersion");
+		free(cache);
+		return -errno;
+	}
+	strncpy(cache->driver_name, version->name,
+		sizeof(cache->driver_name) - 1);
+	cache->driver_major = version->version_major;
+	cache->driver_minor = version->version_minor;
+	cache->driver_patchlevel = version->version_patchlevel;
+	drmFreeVersion(version);
+
+	cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (cache->fd < 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "open");
+		free(cache);
+		return -errno;
+	}
+
+	/* The file is loaded on the next apply, once all planes have been
+	 * registered */
+	device->cache = cache;
+	return 0;
+}
+
+static void
+device_cache_unload(struct liftoff_device *device)
+{
+	struct liftoff_cache *cache = device->cache;
+
+	if (cache->data != NULL) {
+		munmap(cache->data, cache->size);
+		cache->data = NULL;
+	}
+	cache->loaded = false;
+}
+
+void
+device_cache_finish(struct liftoff_device *device)
+{
+	if (device->cache == NULL) {
+		return;
+	}
+
+	device_cache_unload(device);
+	close(device->cache->fd);
+	free(device->cache);
+	device->cache = NULL;
+}
+
+void
+device_cache_invalidate(struct liftoff_device *device)
+{
+	if (device->cache != NULL && device->cache->loaded) {
+		device_cache_unload(device);
+	}
+}
+
+/* Several processes may share the cache file */
+static bool
+cache_lock(struct liftoff_cache *cache)
+{
+	if (flock(cache->fd, LOCK_EX) != 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "flock");
+		return false;
+	}
+	return true;
+}
+
+static void
+cache_unlock(struct liftoff_cache *cache)
+{
+	if (flock(cache->fd, LOCK_UN) != 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "flock");
+	}
+}
+
+static struct liftoff_cache_record *
+cache_get_records(struct liftoff_cache *cache)
+{
+	struct liftoff_cache_header *header = cache->data;
+
+	return (struct liftoff_cache_record *)(header + 1);
+}
+
+static struct liftoff_plane *
+device_get_plane(struct liftoff_device *device, uint32_t plane_id)
+{
+	struct liftoff_plane *plane;
+
+	liftoff_list_for_each(plane, &device->planes, link) {
+		if (plane->id == plane_id) {
+			return plane;
+		}
+	}
+	return NULL;
+}
+
+/* Facts learned by this process take precedence */
+static void
+merge_limit(uint64_t *limit, uint64_t value)
+{
+	if (*limit == 0) {
+		*limit = value;
+	}
+}
+
+/* Must be called with the cache locked */
+static void
+cache_write_record(struct liftoff_cache *cache, struct liftoff_plane *plane,
+		   const struct liftoff_scaling_limits *limits)
+{
+	struct liftoff_cache_record *records, *record;
+	size_t i;
+
+	records = cache_get_records(cache);
+	record = NULL;
+	for (i = 0; i < LIFTOFF_CACHE_RECORDS_MAX; i++) {
+		if (records[i].plane_id == plane->id &&
+		    records[i].format == limits->format &&
+		    records[i].modifier == limits->modifier) {
+			record = &records[i];
+			break;
+		}
+		if (record == NULL && records[i].plane_id == 0) {
+			record = &records[i];
+		}
+	}
+	if (record == NULL) {
+		liftoff_log(LIFTOFF_DEBUG, "Plane cache is full");
+		return;
+	}
+
+	record->plane_id = plane->id;
+	record->format = limits->format;
+	record->modifier = limits->modifier;
+	record->pass_downscale = limits->pass_downscale;
+	record->pass_upscale = limits->pass_upscale;
+	record->fail_downscale = limits->fail_downscale;
+	record->fail_upscale = limits->fail_upscale;
+}
+
+void
+device_cache_load(struct liftoff_device *device)
+{
+	struct liftoff_cache *cache = device->cache;
+	struct liftoff_cache_header want = {0}, *header;
+	struct liftoff_cache_record *records, *record;
+	struct liftoff_scaling_limits *limits;
+	struct liftoff_plane *plane;
+	struct stat st;
+	size_t i, loaded;
+	bool valid;
+
+	if (cache == NULL || cache->loaded) {
+		return;
+	}
+	/* Don't retry on every apply if something goes wrong */
+	cache->loaded = true;
+
+	memcpy(want.magic, CACHE_MAGIC, sizeof(want.magic));
+	want.version = CACHE_VERSION;
+	want.records_len = LIFTOFF_CACHE_RECORDS_MAX;
+	want.topology_hash = device_topology_hash(device);
+	memcpy(want.driver_name, cache->driver_name, sizeof(want.driver_name));
+	want.driver_major = cache->driver_major;
+	want.driver_minor = cache->driver_minor;
+	want.driver_patchlevel = cache->driver_patchlevel;
+
+	cache->header = want;
+	cache->size = sizeof(want) +
+		      LIFTOFF_CACHE_RECORDS_MAX * sizeof(*records);
+
+	if (!cache_lock(cache)) {
+		return;
+	}
+
+	if (fstat(cache->fd, &st) != 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "fstat");
+		goto out;
+	}
+	valid = (size_t)st.st_size == cache->size;
+	if (!valid && ftruncate(cache->fd, cache->size) != 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "ftruncate");
+		goto out;
+	}
+
+	cache->data = mmap(NULL, cache->size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, cache->fd, 0);
+	if (cache->data == MAP_FAILED) {
+		liftoff_log_errno(LIFTOFF_ERROR, "mmap");
+		cache->data = NULL;
+		goto out;
+	}
+
+	header = cache->data;
+	records = cache_get_records(cache);
+	valid = valid && memcmp(header, &want, sizeof(want)) == 0;
+	if (!valid) {
+		/* Written for another driver or another set of planes, start
+		 * from scratch */
+		liftoff_log(LIFTOFF_DEBUG, "Resetting plane cache");
+		memset(cache->data, 0, cache->size);
+		memcpy(header, &want, sizeof(want));
+	}
+
+	loaded = 0;
+	for (i = 0; i < LIFTOFF_CACHE_RECORDS_MAX; i++) {
+		record = &records[i];
+		if (record->plane_id == 0) {
+			continue;
+		}
+		plane = device_get_plane(device, record->plane_id);
+		if (plane == NULL) {
+			continue; /* shouldn't happen, the topology matches */
+		}
+
+		limits = plane_caps_get_scaling(&plane->caps, record->format,
+						record->modifier, true);
+		if (limits == NULL) {
+			continue;
+		}
+		merge_limit(&limits->pass_downscale, record->pass_downscale);
+		merge_limit(&limits->pass_upscale, record->pass_upscale);
+		merge_limit(&limits->fail_downscale, record->fail_downscale);
+		merge_limit(&limits->fail_upscale, record->fail_upscale);
+		loaded++;
+	}
+
+	/* Write back what was learned before the cache got loaded */
+	liftoff_list_for_each(plane, &device->planes, link) {
+		for (i = 0; i < plane->caps.scaling_len; i++) {
+			cache_write_record(cache, plane,
+					   &plane->caps.scaling[i]);
+		}
+	}
+
+	liftoff_log(LIFTOFF_DEBUG, "Loaded plane cache (%zu records, %s)",
+		    loaded, valid ? "valid" : "reset");
+
+out:
+	cache_unlock(cache);
+}
+
+void
+device_cache_store(struct liftoff_device *device, struct liftoff_plane *plane,
+		   const struct liftoff_scaling_limits *limits)
+{
+	struct liftoff_cache *cache = device->cache;
+
+	if (cache == NULL || cache->data == NULL || !cache_lock(cache)) {
+		return;
+	}
+
+	/* Another process may have reset the file for its own driver or
+	 * planes in the meantime */
+	if (memcmp(cache->data, &cache->header, sizeof(cache->header)) == 0) {
+		cache_write_record(cache, plane, limits);
+	} else {
+		liftoff_log(LIFTOFF_DEBUG, "Plane cache was reset by another "
+			    "process, not storing");
+	}
+
+	cache_unlock(cache);
+}
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include "private.h"
+
+#define SCALE_ONE (UINT64_C(1) << 16) /* 16.16 fixed point */
+
+void
+plane_caps_init(struct liftoff_plane_caps *caps, int drm_fd, uint32_t type)
+{
+	uint64_t width, height;
+
+	memset(caps, 0, sizeof(*caps));
+
+	if (type != DRM_PLANE_TYPE_CURSOR) {
+		return;
+	}
+
+	/* The kernel returns a default value if the driver doesn't provide
+	 * any, which is what legacy cursor users rely on too. It may be
+	 * smaller than what the plane supports, so predictions based on it
+	 * are re-verified from time to time. */
+	if (drmGetCap(drm_fd, DRM_CAP_CURSOR_WIDTH, &width) == 0 &&
+	    drmGetCap(drm_fd, DRM_CAP_CURSOR_HEIGHT, &height) == 0) {
+		caps->max_width = width;
+		caps->max_height = height;
+	}
+}
+
+void
+plane_caps_finish(struct liftoff_plane_caps *caps)
+{
+	free(caps->scaling);
+}
+
+int
+plane_caps_parse_size_hints(struct liftoff_plane_caps *caps, int drm_fd,
+			    uint32_t blob_id)
+{
+	drmModePropertyBlobRes *blob;
+	const uint16_t *hints;
+	size_t i, hints_len;
+	uint32_t max_width, max_height;
+
+	if (blob_id == 0) {
+		return 0;
+	}
+
+	blob = drmModeGetPropertyBlob(drm_fd, blob_id);
+	if (blob == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "drmModeGetPropertyBlob");
+		return -errno;
+	}
+
+	/* The blob is an array of struct drm_plane_size_hint, ie. pairs of
+	 * 16-bit width and height */
+	hints = blob->data;
+	hints_len = blob->length / (2 * sizeof(uint16_t));
+
+	max_width = max_height = 0;
+	for (i = 0; i < hints_len; i++) {
+		if (hints[2 * i] > max_width) {
+			max_width = hints[2 * i];
+		}
+		if (hints[2 * i + 1] > max_height) {
+			max_height = hints[2 * i + 1];
+		}
+	}
+
+	/* Size hints take precedence over the cursor caps */
+	if (max_width > 0 && max_height > 0) {
+		caps->max_width = max_width;
+		caps->max_height = max_height;
+	}
+
+	drmModeFreePropertyBlob(blob);
+	return 0;
+}
+
+/* Computes the layer's downscaling and upscaling factors in 16.16 fixed point.
+ * Returns false if the layer doesn't scale or if its geometry is unknown. */
+static bool
+layer_get_scale(struct liftoff_layer *layer, uint64_t *downscale,
+		uint64_t *upscale)
+{
+	struct liftoff_layer_property *src_w, *src_h, *crtc_w, *crtc_h, *rotation;
+	uint64_t src_width, src_height, scale_x, scale_y, tmp;
+
+	src_w = layer_get_property(layer, "SRC_W");
+	src_h = layer_get_property(layer, "SRC_H");
+	crtc_w = layer_get_property(layer, "CRTC_W");
+	crtc_h = layer_get_property(layer, "CRTC_H");
+	if (src_w == NULL || src_h == NULL || crtc_w == NULL || crtc_h == NULL ||
+	    src_w->value == 0 || src_h->value == 0 ||
+	    crtc_w->value == 0 || crtc_h->value == 0) {
+		return false;
+	}
+
+	/* SRC_* is already in 16.16 fixed point */
+	src_width = src_w->value;
+	src_height = src_h->value;
+	rotation = layer_get_property(layer, "rotation");
+	if (rotation != NULL &&
+	    (rotation->value & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270))) {
+		tmp = src_width;
+		src_width = src_height;
+		src_height = tmp;
+	}
+
+	scale_x = src_width / crtc_w->value;
+	scale_y = src_height / crtc_h->value;
+	if (scale_x == SCALE_ONE && scale_y == SCALE_ONE) {
+		return false;
+	}
+
+	*downscale = scale_x > scale_y ? scale_x : scale_y;
+	if (*downscale < SCALE_ONE) {
+		*downscale = 0;
+	}
+
+	scale_x = (crtc_w->value << 32) / src_width;
+	scale_y = (crtc_h->value << 32) / src_height;
+	*upscale = scale_x > scale_y ? scale_x : scale_y;
+	if (*upscale < SCALE_ONE) {
+		*upscale = 0;
+	}
+
+	return true;
+}
+
+static bool
+layer_fits_plane_size(struct liftoff_layer *layer,
+		      struct liftoff_plane_caps *caps)
+{
+	struct liftoff_layer_property *crtc_w, *crtc_h;
+	uint64_t width, height;
+
+	if (caps->max_width == 0 || caps->max_height == 0) {
+		return true;
+	}
+
+	/* Rotated layers are neither clipped nor split */
+	if (!layer_get_plane_size(layer, &width, &height)) {
+		crtc_w = layer_get_property(layer, "CRTC_W");
+		crtc_h = layer_get_property(layer, "CRTC_H");
+		width = crtc_w != NULL ? crtc_w->value : 0;
+		height = crtc_h != NULL ? crtc_h->value : 0;
+	}
+	return width <= caps->max_width && height <= caps->max_height;
+}
+
+/* Limits may be wrong, e.g. the kernel's default cursor size, or depend on
+ * the rest of the configuration, e.g. memory bandwidth. Returns true if a
+ * prediction should be re-checked with a test commit this time. */
+static bool
+plane_caps_should_verify(struct liftoff_plane *plane)
+{
+	struct liftoff_plane_caps *caps = &plane->caps;
+
+	caps->skipped_tests++;
+	if (caps->skipped_tests < LIFTOFF_CAPS_VERIFY_INTERVAL) {
+		return false;
+	}
+
+	caps->skipped_tests = 0;
+	liftoff_log(LIFTOFF_DEBUG, "Verifying the limits of plane %"PRIu32,
+		    plane->id);
+	return true;
+}
+
+/* Returns the scaling limits for FBs of the given format and modifier, NULL if
+ * there are none and `create` is false or on allocation failure */
+struct liftoff_scaling_limits *
+plane_caps_get_scaling(struct liftoff_plane_caps *caps, uint32_t format,
+		       uint64_t modifier, bool create)
+{
+	struct liftoff_scaling_limits *scaling, *limits;
+	size_t i;
+
+	for (i = 0; i < caps->scaling_len; i++) {
+		limits = &caps->scaling[i];
+		if (limits->format == format && limits->modifier == modifier) {
+			return limits;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	scaling = realloc(caps->scaling,
+			  (caps->scaling_len + 1) * sizeof(*scaling));
+	if (scaling == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+		return NULL;
+	}
+	caps->scaling = scaling;
+
+	limits = &caps->scaling[caps->scaling_len];
+	caps->scaling_len++;
+	memset(limits, 0, sizeof(*limits));
+	limits->format = format;
+	limits->modifier = modifier;
+	return limits;
+}
+
+/* Scaling limits usually depend on the FB format, e.g. for YUV formats */
+static struct liftoff_scaling_limits *
+layer_get_scaling_limits(struct liftoff_plane *plane,
+			 struct liftoff_layer *layer, bool create)
+{
+	struct liftoff_layer_property *fb_id_prop;
+	struct liftoff_fb_info info = {0};
+
+	fb_id_prop = layer_get_property(layer, "FB_ID");
+	if (fb_id_prop == NULL ||
+	    !device_get_fb_info(layer->output->device, fb_id_prop->value,
+				&info) ||
+	    !info.valid) {
+		info.format = 0;
+		info.modifier = DRM_FORMAT_MOD_INVALID;
+	}
+
+	return plane_caps_get_scaling(&plane->caps, info.format, info.modifier,
+				      create);
+}
+
+bool
+plane_caps_predict_failure(struct liftoff_plane *plane,
+			   struct liftoff_layer *layer)
+{
+	struct liftoff_plane_caps *caps = &plane->caps;
+	struct liftoff_scaling_limits *limits;
+	uint64_t downscale, upscale;
+	bool predicted;
+
+	if (!layer_fits_plane_size(layer, caps)) {
+		if (plane_caps_should_verify(plane)) {
+			return false;
+		}
+		liftoff_log(LIFTOFF_DEBUG, "Layer %p doesn't fit in plane "
+			    "%"PRIu32" (max %"PRIu32"x%"PRIu32")",
+			    (void *)layer, plane->id, caps->max_width,
+			    caps->max_height);
+		return true;
+	}
+
+	if (!layer_get_scale(layer, &downscale, &upscale)) {
+		return false;
+	}
+
+	if (caps->scaling_unsupported) {
+		liftoff_log(LIFTOFF_DEBUG, "Layer %p needs scaling, plane "
+			    "%"PRIu32" can't scale", (void *)layer, plane->id);
+		return true;
+	}
+
+	limits = layer_get_scaling_limits(plane, layer, false);
+	if (limits == NULL) {
+		return false;
+	}
+
+	predicted = (limits->fail_downscale != 0 &&
+		     downscale >= limits->fail_downscale) ||
+		    (limits->fail_upscale != 0 &&
+		     upscale >= limits->fail_upscale);
+	if (!predicted) {
+		return false;
+	}
+
+	if (plane_caps_should_verify(plane)) {
+		return false;
+	}
+
+	liftoff_log(LIFTOFF_DEBUG, "Layer %p exceeds the scaling limits of "
+		    "plane %"PRIu32, (void *)layer, plane->id);
+	return true;
+}
+
+void
+plane_caps_record_success(struct liftoff_plane *plane,
+			  struct liftoff_layer *layer)
+{
+	struct liftoff_scaling_limits *limits;
+	uint64_t downscale, upscale;
+	bool changed;
+
+	if (!layer_fits_plane_size(layer, &plane->caps)) {
+		liftoff_log(LIFTOFF_DEBUG, "Plane %"PRIu32" accepted a layer "
+			    "larger than its size limits, forgetting them",
+			    plane->id);
+		plane->caps.max_width = plane->caps.max_height = 0;
+	}
+
+	if (!layer_get_scale(layer, &downscale, &upscale)) {
+		return;
+	}
+
+	limits = layer_get_scaling_limits(plane, layer, true);
+	if (limits == NULL) {
+		return;
+	}
+
+	changed = false;
+	if (downscale > limits->pass_downscale) {
+		limits->pass_downscale = downscale;
+		changed = true;
+	}
+	if (upscale > limits->pass_upscale) {
+		limits->pass_upscale = upscale;
+		changed = true;
+	}
+
+	/* The limits we learned are wrong, forget them */
+	if (limits->fail_downscale != 0 &&
+	    downscale >= limits->fail_downscale) {
+		limits->fail_downscale = 0;
+		changed = true;
+	}
+	if (limits->fail_upscale != 0 && upscale >= limits->fail_upscale) {
+		limits->fail_upscale = 0;
+		changed = true;
+	}
+
+	if (changed) {
+		device_cache_store(layer->output->device, plane, limits);
+	}
+}
+
+/* Checks whether a failed test commit of the layer would lower the learned
+ * limits, ie. whether it's worth finding out if scaling caused it */
+bool
+plane_caps_would_learn_failure(struct liftoff_plane *plane,
+			       struct liftoff_layer *layer)
+{
+	struct liftoff_scaling_limits *limits;
+	uint64_t downscale, upscale;
+
+	if (plane->caps.scaling_unsupported ||
+	    !layer_get_scale(layer, &downscale, &upscale)) {
+		return false;
+	}
+
+	limits = layer_get_scaling_limits(plane, layer, false);
+	if (limits == NULL) {
+		return true;
+	}
+
+	/* This much scaling already passed, something else failed */
+	if (downscale <= limits->pass_downscale &&
+	    upscale <= limits->pass_upscale) {
+		return false;
+	}
+
+	return (downscale != 0 && (limits->fail_downscale == 0 ||
+				   downscale < limits->fail_downscale)) ||
+	       (upscale != 0 && (limits->fail_upscale == 0 ||
+				 upscale < limits->fail_upscale));
+}
+
+/* Records a failed test commit of the layer, which is known to be caused by
+ * scaling: the same layer unscaled passed */
+void
+plane_caps_record_scaling_failure(struct liftoff_plane *plane,
+				  struct liftoff_layer *layer)
+{
+	struct liftoff_scaling_limits *limits;
+	uint64_t downscale, upscale;
+
+	if (!layer_get_scale(layer, &downscale, &upscale)) {
+		return;
+	}
+
+	limits = layer_get_scaling_limits(plane, layer, true);
+	if (limits == NULL) {
+		return;
+	}
+
+	liftoff_log(LIFTOFF_DEBUG, "Learned scaling limits of plane %"PRIu32
+		    " from layer %p", plane->id, (void *)layer);
+	/* Only the direction(s) beyond what's known to pass can be blamed */
+	if (downscale > limits->pass_downscale &&
+	    (limits->fail_downscale == 0 ||
+	     downscale < limits->fail_downscale)) {
+		limits->fail_downscale = downscale;
+	}
+	if (upscale > limits->pass_upscale &&
+	    (limits->fail_upscale == 0 || upscale < limits->fail_upscale)) {
+		limits->fail_upscale = upscale;
+	}
+	device_cache_store(layer->output->device, plane, limits);
+}
@@ -0,0 +1,619 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "private.h"
+
+static bool
+is_geometry_prop(const char *name)
+{
+	return strncmp(name, "CRTC_", 5) == 0 ||
+	       strncmp(name, "SRC_", 4) == 0 ||
+	       strcmp(name, "rotation") == 0;
+}
+
+static uint32_t
+layer_get_prop_changes(struct liftoff_layer *layer)
+{
+	struct liftoff_layer_property *prop;
+	uint32_t changes;
+	size_t i;
+
+	/* A new property may change how the layer looks */
+	changes = layer->changed ? LIFTOFF_COMPOSITION_CHANGE_CONTENT : 0;
+
+	for (i = 0; i < layer->props_len; i++) {
+		prop = &layer->props[i];
+		if (prop->value == prop->prev_value) {
+			continue;
+		}
+		if (is_geometry_prop(prop->name)) {
+			changes |= LIFTOFF_COMPOSITION_CHANGE_GEOMETRY;
+		} else if (strcmp(prop->name, "IN_FENCE_FD") != 0) {
+			changes |= LIFTOFF_COMPOSITION_CHANGE_CONTENT;
+		}
+	}
+
+	return changes;
+}
+
+/* Whether the layer is displayed through a hole in the composition layer */
+static bool
+layer_is_underlay_of(struct liftoff_layer *layer,
+		     struct liftoff_layer *composition_layer)
+{
+	struct liftoff_layer_property *zpos_prop, *composition_zpos_prop;
+
+	if (layer->plane == NULL || layer == composition_layer ||
+	    !layer_is_composition(composition_layer) ||
+	    composition_layer->plane == NULL ||
+	    layer->plane->zpos >= composition_layer->plane->zpos) {
+		return false;
+	}
+
+	if (composition_layer == layer->output->composition_layer) {
+		return true;
+	}
+
+	/* Additional composition layers are only drawn over the layers with a
+	 * lower zpos */
+	zpos_prop = layer_get_property(layer, "zpos");
+	composition_zpos_prop = layer_get_property(composition_layer, "zpos");
+	return zpos_prop != NULL && composition_zpos_prop != NULL &&
+	       zpos_prop->value > composition_zpos_prop->value &&
+	       layer_intersects(layer, composition_layer);
+}
+
+bool
+liftoff_layer_is_underlay(struct liftoff_layer *layer)
+{
+	struct liftoff_layer *other;
+
+	liftoff_list_for_each(other, &layer->output->layers, link) {
+		if (layer_is_underlay_of(layer, other)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+struct liftoff_layer *
+liftoff_layer_get_composition_layer(struct liftoff_layer *layer)
+{
+	if (!liftoff_layer_needs_composition(layer)) {
+		return NULL;
+	}
+	return layer->target;
+}
+
+uint32_t
+liftoff_layer_get_composition_changes(struct liftoff_layer *layer)
+{
+	return layer->composition_changes;
+}
+
+bool
+liftoff_output_composition_changed(struct liftoff_output *output)
+{
+	return output->composition_changed;
+}
+
+static bool
+rect_is_empty(const struct liftoff_rect *rect)
+{
+	return rect->width <= 0 || rect->height <= 0;
+}
+
+static int64_t
+rect_area(const struct liftoff_rect *rect)
+{
+	return (int64_t)rect->width * rect->height;
+}
+
+static bool
+rects_intersect(const struct liftoff_rect *a, const struct liftoff_rect *b)
+{
+	return a->x < b->x + b->width && a->y < b->y + b->height &&
+	       a->x + a->width > b->x && a->y + a->height > b->y;
+}
+
+static bool
+rect_contains(const struct liftoff_rect *rect, const struct liftoff_rect *other)
+{
+	return other->x >= rect->x && other->y >= rect->y &&
+	       other->x + other->width <= rect->x + rect->width &&
+	       other->y + other->height <= rect->y + rect->height;
+}
+
+static void
+rect_clip(struct liftoff_rect *rect, const struct liftoff_rect *clip)
+{
+	int x1, y1, x2, y2;
+
+	x1 = rect->x > clip->x ? rect->x : clip->x;
+	y1 = rect->y > clip->y ? rect->y : clip->y;
+	x2 = rect->x + rect->width < clip->x + clip->width ?
+	     rect->x + rect->width : clip->x + clip->width;
+	y2 = rect->y + rect->height < clip->y + clip->height ?
+	     rect->y + rect->height : clip->y + clip->height;
+
+	rect->x = x1;
+	rect->y = y1;
+	rect->width = x2 - x1;
+	rect->height = y2 - y1;
+}
+
+/* Bounding box of both rectangles */
+static void
+rect_extend(struct liftoff_rect *rect, const struct liftoff_rect *other)
+{
+	int x1, y1, x2, y2;
+
+	x1 = rect->x < other->x ? rect->x : other->x;
+	y1 = rect->y < other->y ? rect->y : other->y;
+	x2 = rect->x + rect->width > other->x + other->width ?
+	     rect->x + rect->width : other->x + other->width;
+	y2 = rect->y + rect->height > other->y + other->height ?
+	     rect->y + rect->height : other->y + other->height;
+
+	rect->x = x1;
+	rect->y = y1;
+	rect->width = x2 - x1;
+	rect->height = y2 - y1;
+}
+
+/* Adds a rectangle to a list of at most max_rects non-overlapping ones. Boxes
+ * are merged into their bounding box when they overlap, or when the list is
+ * full, in which case the merge adding the smallest area is picked. */
+static size_t
+region_add(struct liftoff_rect *rects, size_t rects_len, size_t max_rects,
+	   struct liftoff_rect rect)
+{
+	struct liftoff_rect merged;
+	size_t i, best;
+	int64_t cost, best_cost;
+
+	while (true) {
+		best = rects_len;
+		for (i = 0; i < rects_len; i++) {
+			if (rects_intersect(&rects[i], &rect)) {
+				best = i;
+				break;
+			}
+		}
+
+		if (best == rects_len && rects_len < max_rects) {
+			rects[rects_len] = rect;
+			return rects_len + 1;
+		}
+
+		if (best == rects_len) {
+			best_cost = INT64_MAX;
+			for (i = 0; i < rects_len; i++) {
+				merged = rects[i];
+				rect_extend(&merged, &rect);
+				cost = rect_area(&merged) -
+				       rect_area(&rects[i]) - rect_area(&rect);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best = i;
+				}
+			}
+		}
+
+		/* Merge and start over, the bounding box may overlap with
+		 * other rectangles */
+		rect_extend(&rect, &rects[best]);
+		rects_len--;
+		rects[best] = rects[rects_len];
+	}
+}
+
+size_t
+liftoff_output_get_composition_region(struct liftoff_output *output,
+				      struct liftoff_rect *rects,
+				      size_t max_rects)
+{
+	struct liftoff_layer *layer;
+	struct liftoff_rect rect, clip, mode;
+	size_t rects_len;
+
+	if (max_rects == 0) {
+		return 0;
+	}
+
+	mode = (struct liftoff_rect){
+		.width = output->width,
+		.height = output->height,
+	};
+
+	rects_len = 0;
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer_is_composition(layer) ||
+		    !liftoff_layer_needs_composition(layer)) {
+			continue;
+		}
+
+		layer_get_rect(layer, &rect);
+		if (layer->target != NULL) {
+			layer_get_rect(layer->target, &clip);
+			rect_clip(&rect, &clip);
+		}
+		if (!rect_is_empty(&mode)) {
+			rect_clip(&rect, &mode);
+		}
+		if (rect_is_empty(&rect)) {
+			continue;
+		}
+
+		rects_len = region_add(rects, rects_len, max_rects, rect);
+	}
+
+	return rects_len;
+}
+
+void
+liftoff_output_set_composition_damage(struct liftoff_output *output,
+				      bool enabled)
+{
+	output->composition_damage = enabled;
+}
+
+/* Damage clips are in FB coordinates: only handle the case where the
+ * composition layer maps its FB to the CRTC with a translation */
+static bool
+layer_get_fb_offset(struct liftoff_layer *layer, int *dx, int *dy)
+{
+	struct liftoff_layer_property *prop;
+	struct liftoff_rect rect;
+	uint64_t src_x, src_y, src_w, src_h;
+
+	prop = layer_get_property(layer, "rotation");
+	if (prop != NULL && prop->value != DRM_MODE_ROTATE_0) {
+		return false;
+	}
+
+	prop = layer_get_property(layer, "SRC_X");
+	src_x = prop != NULL ? prop->value : 0;
+	prop = layer_get_property(layer, "SRC_Y");
+	src_y = prop != NULL ? prop->value : 0;
+	prop = layer_get_property(layer, "SRC_W");
+	src_w = prop != NULL ? prop->value : 0;
+	prop = layer_get_property(layer, "SRC_H");
+	src_h = prop != NULL ? prop->value : 0;
+
+	layer_get_rect(layer, &rect);
+	if (src_w != (uint64_t)rect.width << 16 ||
+	    src_h != (uint64_t)rect.height << 16 ||
+	    (src_x & 0xFFFF) != 0 || (src_y & 0xFFFF) != 0) {
+		return false;
+	}
+
+	*dx = (int)(src_x >> 16) - rect.x;
+	*dy = (int)(src_y >> 16) - rect.y;
+	return true;
+}
+
+static bool
+layer_geometry_changed(struct liftoff_layer *layer)
+{
+	return (layer_get_prop_changes(layer) &
+		LIFTOFF_COMPOSITION_CHANGE_GEOMETRY) != 0;
+}
+
+/* Composited or underlay as of the apply before the last one */
+static bool
+layer_was_drawn(struct liftoff_layer *layer)
+{
+	return layer->prev_composited || layer->prev_underlay;
+}
+
+/* Adds the layer's FB_DAMAGE_CLIPS to the damage. Returns false if they don't
+ * describe everything that changed, e.g. because other properties changed or
+ * because the clips were set without liftoff_layer_set_property_blob. */
+static bool
+layer_add_damage_clips(struct liftoff_layer *layer,
+		       const struct liftoff_rect *clip,
+		       struct liftoff_rect *rects, size_t *rects_len)
+{
+	struct liftoff_layer_property *prop, *clips_prop;
+	const struct drm_mode_rect *clips;
+	struct liftoff_rect layer_rect, rect;
+	size_t i, size, clips_len;
+	int dx, dy;
+
+	if (layer->changed || !layer_was_drawn(layer) ||
+	    (layer->composition_changes &
+	     ~LIFTOFF_COMPOSITION_CHANGE_CONTENT) != 0) {
+		return false;
+	}
+
+	/* Only the FB and its damage may have changed */
+	clips_prop = NULL;
+	for (i = 0; i < layer->props_len; i++) {
+		prop = &layer->props[i];
+		if (strcmp(prop->name, "FB_DAMAGE_CLIPS") == 0) {
+			clips_prop = prop;
+		} else if (prop->value != prop->prev_value &&
+			   strcmp(prop->name, "FB_ID") != 0 &&
+			   strcmp(prop->name, "IN_FENCE_FD") != 0) {
+			return false;
+		}
+	}
+	if (clips_prop == NULL || clips_prop->value == 0 ||
+	    clips_prop->blob == NULL) {
+		return false;
+	}
+
+	/* No clips means the whole FB is damaged */
+	clips = blob_get_data(clips_prop->blob, &size);
+	clips_len = size / sizeof(clips[0]);
+	if (clips_len == 0 || !layer_get_fb_offset(layer, &dx, &dy)) {
+		return false;
+	}
+
+	layer_get_rect(layer, &layer_rect);
+	for (i = 0; i < clips_len; i++) {
+		rect.x = clips[i].x1 - dx;
+		rect.y = clips[i].y1 - dy;
+		rect.width = clips[i].x2 - clips[i].x1;
+		rect.height = clips[i].y2 - clips[i].y1;
+		rect_clip(&rect, &layer_rect);
+		rect_clip(&rect, clip);
+		if (!rect_is_empty(&rect)) {
+			*rects_len = region_add(rects, *rects_len,
+						LIFTOFF_DAMAGE_MAX_RECTS, rect);
+		}
+	}
+
+	return true;
+}
+
+/* Computes the damage of a composition layer, returns false if it's fully
+ * damaged */
+static bool
+output_get_damage(struct liftoff_output *output,
+		  struct liftoff_layer *composition_layer, bool reset,
+		  struct liftoff_rect *rects, size_t *rects_len)
+{
+	struct liftoff_layer *layer;
+	struct liftoff_rect clip, rect;
+
+	/* The damage is relative to what the plane currently displays */
+	if (reset || composition_layer->changed ||
+	    composition_layer->plane->committed_layer != composition_layer ||
+	    layer_geometry_changed(composition_layer)) {
+		return false;
+	}
+
+	layer_get_rect(composition_layer, &clip);
+
+	*rects_len = 0;
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer_is_composition(layer) ||
+		    layer->composition_changes == 0) {
+			continue;
+		}
+
+		if (layer->composited && layer->target == composition_layer &&
+		    layer_add_damage_clips(layer, &clip, rects, rects_len)) {
+			continue;
+		}
+
+		/* Underlays are drawn as holes in the composition layer */
+		if ((layer->composited && layer->target == composition_layer) ||
+		    layer_is_underlay_of(layer, composition_layer)) {
+			layer_get_rect(layer, &rect);
+			rect_clip(&rect, &clip);
+			if (!rect_is_empty(&rect)) {
+				*rects_len = region_add(rects, *rects_len,
+							LIFTOFF_DAMAGE_MAX_RECTS,
+							rect);
+			}
+		}
+
+		/* Uncover the area where the layer used to be. This may
+		 * include areas drawn to other composition layers, which is
+		 * harmless. */
+		if (layer_was_drawn(layer) &&
+		    (layer->composition_changes &
+		     (LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP |
+		      LIFTOFF_COMPOSITION_CHANGE_GEOMETRY)) != 0) {
+			layer_get_prev_rect(layer, &rect);
+			rect_clip(&rect, &clip);
+			if (!rect_is_empty(&rect)) {
+				*rects_len = region_add(rects, *rects_len,
+							LIFTOFF_DAMAGE_MAX_RECTS,
+							rect);
+			}
+		}
+	}
+
+	return true;
+}
+
+static int
+composition_layer_apply_damage(struct liftoff_layer *composition_layer,
+			       drmModeAtomicReq *req, bool reset)
+{
+	struct liftoff_output *output;
+	struct liftoff_plane *plane;
+	struct liftoff_rect rects[LIFTOFF_DAMAGE_MAX_RECTS];
+	struct drm_mode_rect clips[LIFTOFF_DAMAGE_MAX_RECTS];
+	struct liftoff_blob *blob;
+	size_t i, rects_len;
+	int dx, dy;
+
+	output = composition_layer->output;
+	plane = composition_layer->plane;
+	if (plane == NULL || !plane_has_property(plane, "FB_DAMAGE_CLIPS")) {
+		return 0;
+	}
+
+	if (!layer_get_fb_offset(composition_layer, &dx, &dy) ||
+	    !output_get_damage(output, composition_layer, reset, rects,
+			       &rects_len)) {
+		/* No damage clips means the whole FB is damaged */
+		return plane_set_damage_clips(plane, req, 0);
+	}
+
+	for (i = 0; i < rects_len; i++) {
+		clips[i].x1 = rects[i].x + dx;
+		clips[i].y1 = rects[i].y + dy;
+		clips[i].x2 = rects[i].x + rects[i].width + dx;
+		clips[i].y2 = rects[i].y + rects[i].height + dy;
+	}
+	if (rects_len == 0) {
+		/* An empty clip: nothing needs to be fetched */
+		clips[0] = (struct drm_mode_rect){0};
+		rects_len = 1;
+	}
+
+	/* The blob is kept alive by the plane state, see blob.c */
+	blob = device_get_blob(output->device, clips,
+			       rects_len * sizeof(clips[0]));
+	if (blob == NULL) {
+		return -errno;
+	}
+
+	return plane_set_damage_clips(plane, req, blob_get_id(blob));
+}
+
+static int
+output_apply_damage(struct liftoff_output *output, drmModeAtomicReq *req,
+		    bool reset)
+{
+	struct liftoff_layer *layer;
+	int ret;
+
+	if (!output->composition_damage) {
+		return 0;
+	}
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (!layer_is_composition(layer)) {
+			continue;
+		}
+		ret = composition_layer_apply_damage(layer, req, reset);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Picks the composition layer to draw the layer to, if it needs composition */
+static struct liftoff_layer *
+layer_find_target(struct liftoff_layer *layer)
+{
+	struct liftoff_output *output;
+	struct liftoff_layer *other, *target;
+	struct liftoff_layer_property *zpos_prop, *other_zpos_prop;
+	struct liftoff_rect rect, other_rect;
+	uint64_t target_zpos;
+
+	output = layer->output;
+	zpos_prop = layer_get_property(layer, "zpos");
+	if (zpos_prop == NULL) {
+		return output->composition_layer;
+	}
+
+	layer_get_rect(layer, &rect);
+
+	target = NULL;
+	target_zpos = 0;
+	liftoff_list_for_each(other, &output->layers, link) {
+		if (!other->extra_composition ||
+		    other == output->composition_layer ||
+		    !layer_is_visible(other)) {
+			continue;
+		}
+
+		other_zpos_prop = layer_get_property(other, "zpos");
+		if (other_zpos_prop == NULL ||
+		    other_zpos_prop->value >= zpos_prop->value ||
+		    (target != NULL && other_zpos_prop->value <= target_zpos)) {
+			continue;
+		}
+
+		layer_get_rect(other, &other_rect);
+		if (!rect_contains(&other_rect, &rect)) {
+			continue;
+		}
+
+		target = other;
+		target_zpos = other_zpos_prop->value;
+	}
+
+	return target != NULL ? target : output->composition_layer;
+}
+
+/* Called at the start of each apply. A layer moving to another composition
+ * layer may make the previous allocation invalid. */
+void
+output_update_composition_targets(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer, *target;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		target = NULL;
+		if (!layer_is_composition(layer)) {
+			target = layer_find_target(layer);
+		}
+
+		layer->prev_target = layer->target;
+		layer->target = target;
+		if (target != layer->prev_target) {
+			output->layers_changed = true;
+		}
+	}
+}
+
+/* Called at the end of each successful apply, before layers are marked
+ * clean. Retries of the same frame are still compared to the previous one. */
+int
+output_update_composition(struct liftoff_output *output, drmModeAtomicReq *req,
+			  bool retry)
+{
+	struct liftoff_layer *layer;
+	bool composited, underlay, reset;
+
+	reset = output->composition_reset;
+	output->composition_changed = reset;
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		composited = liftoff_layer_needs_composition(layer);
+		underlay = liftoff_layer_is_underlay(layer);
+
+		if (!retry) {
+			layer->prev_composited = layer->composited;
+			layer->prev_underlay = layer->underlay;
+		}
+		layer->composited = composited;
+		layer->underlay = underlay;
+
+		layer->composition_changes = 0;
+		if (composited != layer->prev_composited ||
+		    underlay != layer->prev_underlay ||
+		    (composited && layer->target != layer->prev_target)) {
+			layer->composition_changes |=
+				LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP;
+		}
+		if (composited || layer->prev_composited) {
+			layer->composition_changes |=
+				layer_get_prop_changes(layer);
+		} else if (underlay || layer->prev_underlay) {
+			/* Only the hole's position matters */
+			layer->composition_changes |=
+				layer_get_prop_changes(layer) &
+				LIFTOFF_COMPOSITION_CHANGE_GEOMETRY;
+		}
+
+		if (layer->composition_changes != 0) {
+			output->composition_changed = true;
+		}
+	}
+
+	return output_apply_damage(output, req, reset);
+}
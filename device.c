@@ -1,7 +1,9 @@
+#include <drm_fourcc.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <xf86drm.h>
 #include "log.h"
 #include "private.h"
 
@@ -19,6 +21,9 @@ liftoff_device_create(int drm_fd)
 
 	liftoff_list_init(&device->planes);
 	liftoff_list_init(&device->outputs);
+	liftoff_list_init(&device->blobs);
+
+	device->max_overlay_planes = -1;
 
 	device->drm_fd = dup(drm_fd);
 	if (device->drm_fd < 0) {
@@ -47,6 +52,8 @@ liftoff_device_create(int drm_fd)
 
 	drmModeFreeResources(drm_res);
 
+	device_init_profile(device);
+
 	return device;
 }
 
@@ -54,16 +61,26 @@ void
 liftoff_device_destroy(struct liftoff_device *device)
 {
 	struct liftoff_plane *plane, *tmp;
+	size_t i;
 
 	if (device == NULL) {
 		return;
 	}
 
+	device_cache_finish(device);
+	device_blobs_finish(device);
 	close(device->drm_fd);
 	liftoff_list_for_each_safe(plane, tmp, &device->planes, link) {
 		liftoff_plane_destroy(plane);
 	}
 	free(device->crtcs);
+	realloc_policy_finish(device->realloc_policies,
+			      device->realloc_policies_len);
+	free(device->fb_infos);
+	for (i = 0; i < device->prop_infos_len; i++) {
+		prop_info_destroy(device->prop_infos[i]);
+	}
+	free(device->prop_infos);
 	free(device);
 }
 
@@ -89,6 +106,200 @@ liftoff_device_register_all_planes(struct liftoff_device *device)
 	return 0;
 }
 
+int
+liftoff_device_set_realloc_policy(struct liftoff_device *device,
+				  const char *name,
+				  enum liftoff_realloc_policy_type type,
+				  uint64_t value)
+{
+	return realloc_policy_set(&device->realloc_policies,
+				  &device->realloc_policies_len,
+				  name, type, value);
+}
+
+static void
+close_fb_handles(struct liftoff_device *device, drmModeFB2 *fb)
+{
+	struct drm_gem_close args;
+	size_t i, j;
+	bool closed;
+
+	for (i = 0; i < sizeof(fb->handles) / sizeof(fb->handles[0]); i++) {
+		if (fb->handles[i] == 0) {
+			continue;
+		}
+
+		/* Multiple planes of the same FB may share a handle */
+		closed = false;
+		for (j = 0; j < i; j++) {
+			if (fb->handles[j] == fb->handles[i]) {
+				closed = true;
+				break;
+			}
+		}
+		if (closed) {
+			continue;
+		}
+
+		memset(&args, 0, sizeof(args));
+		args.handle = fb->handles[i];
+		if (drmIoctl(device->drm_fd, DRM_IOCTL_GEM_CLOSE, &args) != 0) {
+			liftoff_log_errno(LIFTOFF_ERROR, "drmIoctl(GEM_CLOSE)");
+		}
+	}
+}
+
+static struct liftoff_fb_info *
+device_add_fb_info(struct liftoff_device *device, uint32_t fb_id)
+{
+	struct liftoff_fb_info *fb_infos, *info;
+	size_t cap;
+	drmModeFB2 *fb;
+
+	if (device->fb_infos_len == device->fb_infos_cap) {
+		cap = device->fb_infos_cap == 0 ? 8 : 2 * device->fb_infos_cap;
+		fb_infos = realloc(device->fb_infos, cap * sizeof(*fb_infos));
+		if (fb_infos == NULL) {
+			liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+			return NULL;
+		}
+		device->fb_infos = fb_infos;
+		device->fb_infos_cap = cap;
+	}
+
+	info = &device->fb_infos[device->fb_infos_len];
+	memset(info, 0, sizeof(*info));
+	info->id = fb_id;
+
+	/* Failures are cached too, so that we don't retry every frame */
+	fb = drmModeGetFB2(device->drm_fd, fb_id);
+	if (fb == NULL) {
+		liftoff_log_errno(LIFTOFF_DEBUG, "drmModeGetFB2");
+	} else {
+		info->valid = true;
+		info->width = fb->width;
+		info->height = fb->height;
+		info->format = fb->pixel_format;
+		if (fb->flags & DRM_MODE_FB_MODIFIERS) {
+			info->modifier = fb->modifier;
+		} else {
+			info->modifier = DRM_FORMAT_MOD_INVALID;
+		}
+		close_fb_handles(device, fb);
+		drmModeFreeFB2(fb);
+	}
+
+	device->fb_infos_len++;
+	return info;
+}
+
+bool
+device_get_fb_info(struct liftoff_device *device, uint32_t fb_id,
+		   struct liftoff_fb_info *info)
+{
+	struct liftoff_fb_info *cached;
+	size_t i;
+
+	if (fb_id == 0) {
+		return false;
+	}
+
+	cached = NULL;
+	for (i = 0; i < device->fb_infos_len; i++) {
+		if (device->fb_infos[i].id == fb_id) {
+			cached = &device->fb_infos[i];
+			break;
+		}
+	}
+
+	if (cached == NULL) {
+		cached = device_add_fb_info(device, fb_id);
+		if (cached == NULL) {
+			return false;
+		}
+	}
+
+	*info = *cached;
+	return info->valid;
+}
+
+static bool
+device_fb_is_referenced(struct liftoff_device *device, uint32_t fb_id)
+{
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	struct liftoff_layer_property *prop;
+
+	liftoff_list_for_each(output, &device->outputs, link) {
+		liftoff_list_for_each(layer, &output->layers, link) {
+			prop = layer_get_property(layer, "FB_ID");
+			if (prop != NULL && (prop->value == fb_id ||
+					     prop->prev_value == fb_id)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void
+device_evict_fb_infos(struct liftoff_device *device)
+{
+	size_t i;
+
+	i = 0;
+	while (i < device->fb_infos_len) {
+		if (device_fb_is_referenced(device, device->fb_infos[i].id)) {
+			i++;
+			continue;
+		}
+		device->fb_infos_len--;
+		device->fb_infos[i] = device->fb_infos[device->fb_infos_len];
+	}
+}
+
+void
+liftoff_device_set_max_overlay_planes(struct liftoff_device *device, int max)
+{
+	device->max_overlay_planes = max < 0 ? -1 : max;
+}
+
+void
+liftoff_device_set_primary_plane_required(struct liftoff_device *device,
+					  bool required)
+{
+	device->primary_plane_required = required;
+}
+
+void
+liftoff_device_invalidate_fb(struct liftoff_device *device, uint32_t fb_id)
+{
+	size_t i;
+
+	for (i = 0; i < device->fb_infos_len; i++) {
+		if (device->fb_infos[i].id == fb_id) {
+			device->fb_infos_len--;
+			device->fb_infos[i] =
+				device->fb_infos[device->fb_infos_len];
+			return;
+		}
+	}
+}
+
+void
+liftoff_device_invalidate_state(struct liftoff_device *device)
+{
+	struct liftoff_plane *plane;
+	size_t i;
+
+	liftoff_list_for_each(plane, &device->planes, link) {
+		for (i = 0; i < plane->props_len; i++) {
+			plane->props[i].committed_known = false;
+		}
+	}
+}
+
 int
 device_test_commit(struct liftoff_device *device, drmModeAtomicReq *req,
 		   uint32_t flags)
@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+/* Output groups
+ *
+ * A tiled display is driven by several CRTCs, each scanning out a tile of the
+ * display. A group layer has a regular layer on each tile output, positioned
+ * relative to the tile. Layer clipping crops the part of the layer which
+ * falls on the tile, and tiles the layer doesn't cover cull it.
+ *
+ * Offloading a layer on some tiles only would require users to composite it
+ * on the others, drawing it twice in different ways. Instead, group layers
+ * are offloaded on all of their tiles or on none: if any tile composites the
+ * layer, the whole group is re-applied with the layer composited everywhere.
+ * Since layers are only ever added to the composited set, this converges in at
+ * most one retry per layer.
+ */
+
+struct liftoff_output_group *
+liftoff_output_group_create(void)
+{
+	struct liftoff_output_group *group;
+
+	group = calloc(1, sizeof(*group));
+	if (group == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
+		return NULL;
+	}
+	liftoff_list_init(&group->layers);
+	return group;
+}
+
+void
+liftoff_output_group_destroy(struct liftoff_output_group *group)
+{
+	struct liftoff_group_layer *layer, *tmp;
+
+	if (group == NULL) {
+		return;
+	}
+
+	liftoff_list_for_each_safe(layer, tmp, &group->layers, link) {
+		liftoff_group_layer_destroy(layer);
+	}
+	free(group->tiles);
+	free(group);
+}
+
+int
+liftoff_output_group_add_tile(struct liftoff_output_group *group,
+			      struct liftoff_output *output, int x, int y)
+{
+	struct liftoff_tile *tiles;
+	size_t i;
+
+	if (!liftoff_list_empty(&group->layers)) {
+		return -EBUSY;
+	}
+
+	for (i = 0; i < group->tiles_len; i++) {
+		if (group->tiles[i].output == output) {
+			return -EINVAL;
+		}
+	}
+
+	tiles = realloc(group->tiles, (group->tiles_len + 1) * sizeof(*tiles));
+	if (tiles == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+		return -ENOMEM;
+	}
+	group->tiles = tiles;
+
+	group->tiles[group->tiles_len] = (struct liftoff_tile){
+		.output = output,
+		.x = x,
+		.y = y,
+	};
+	group->tiles_len++;
+
+	liftoff_output_set_layer_clipping(output, true);
+	return 0;
+}
+
+struct liftoff_group_layer *
+liftoff_group_layer_create(struct liftoff_output_group *group)
+{
+	struct liftoff_group_layer *layer;
+	size_t i;
+
+	layer = calloc(1, sizeof(*layer));
+	if (layer == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
+		return NULL;
+	}
+	layer->tiles = calloc(group->tiles_len, sizeof(layer->tiles[0]));
+	if (layer->tiles == NULL && group->tiles_len > 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
+		free(layer);
+		return NULL;
+	}
+	layer->group = group;
+
+	for (i = 0; i < group->tiles_len; i++) {
+		layer->tiles[i] = liftoff_layer_create(group->tiles[i].output);
+		if (layer->tiles[i] == NULL) {
+			while (i-- > 0) {
+				liftoff_layer_destroy(layer->tiles[i]);
+			}
+			free(layer->tiles);
+			free(layer);
+			return NULL;
+		}
+	}
+
+	liftoff_list_insert(group->layers.prev, &layer->link);
+	return layer;
+}
+
+void
+liftoff_group_layer_destroy(struct liftoff_group_layer *layer)
+{
+	size_t i;
+
+	if (layer == NULL) {
+		return;
+	}
+
+	for (i = 0; i < layer->group->tiles_len; i++) {
+		liftoff_layer_destroy(layer->tiles[i]);
+	}
+	liftoff_list_remove(&layer->link);
+	free(layer->tiles);
+	free(layer);
+}
+
+static void
+group_layer_set_composited(struct liftoff_group_layer *layer, bool composited)
+{
+	struct liftoff_layer *tile_layer;
+	size_t i;
+
+	for (i = 0; i < layer->group->tiles_len; i++) {
+		tile_layer = layer->tiles[i];
+		if (tile_layer->group_composited != composited) {
+			tile_layer->group_composited = composited;
+			tile_layer->changed = true;
+		}
+	}
+}
+
+static bool
+is_buffer_property(const char *name)
+{
+	return strcmp(name, "FB_ID") == 0 ||
+	       strcmp(name, "IN_FENCE_FD") == 0 ||
+	       strcmp(name, "FB_DAMAGE_CLIPS") == 0;
+}
+
+int
+liftoff_group_layer_set_property(struct liftoff_group_layer *layer,
+				 const char *name, uint64_t value)
+{
+	struct liftoff_tile *tile;
+	struct liftoff_layer_property *prop;
+	uint64_t tile_value;
+	size_t i;
+	bool changed;
+	int ret;
+
+	changed = false;
+
+	for (i = 0; i < layer->group->tiles_len; i++) {
+		tile = &layer->group->tiles[i];
+		tile_value = value;
+		if (strcmp(name, "CRTC_X") == 0) {
+			tile_value = (uint64_t)((int64_t)(int32_t)value -
+						tile->x);
+		} else if (strcmp(name, "CRTC_Y") == 0) {
+			tile_value = (uint64_t)((int64_t)(int32_t)value -
+						tile->y);
+		}
+
+		prop = layer_get_property(layer->tiles[i], name);
+		if (prop == NULL || prop->value != tile_value) {
+			changed = true;
+		}
+
+		ret = liftoff_layer_set_property(layer->tiles[i], name,
+						 tile_value);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	/* The layer may fit on all of its tiles now */
+	if (changed && !is_buffer_property(name)) {
+		group_layer_set_composited(layer, false);
+	}
+
+	return 0;
+}
+
+bool
+liftoff_group_layer_needs_composition(struct liftoff_group_layer *layer)
+{
+	size_t i;
+
+	for (i = 0; i < layer->group->tiles_len; i++) {
+		if (liftoff_layer_needs_composition(layer->tiles[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+struct liftoff_layer *
+liftoff_group_layer_get_tile(struct liftoff_group_layer *layer,
+			     struct liftoff_output *output)
+{
+	size_t i;
+
+	for (i = 0; i < layer->group->tiles_len; i++) {
+		if (layer->group->tiles[i].output == output) {
+			return layer->tiles[i];
+		}
+	}
+	return NULL;
+}
+
+/* Offloaded on some tiles, composited on others */
+static bool
+group_layer_is_split(struct liftoff_group_layer *layer)
+{
+	struct liftoff_layer *tile_layer;
+	bool offloaded, composited;
+	size_t i;
+
+	offloaded = composited = false;
+	for (i = 0; i < layer->group->tiles_len; i++) {
+		tile_layer = layer->tiles[i];
+		if (tile_layer->plane != NULL) {
+			offloaded = true;
+		} else if (liftoff_layer_needs_composition(tile_layer)) {
+			composited = true;
+		}
+	}
+
+	return offloaded && composited;
+}
+
+int
+liftoff_output_group_apply(struct liftoff_output_group *group,
+			   drmModeAtomicReq *req, uint32_t flags)
+{
+	struct liftoff_group_layer *layer;
+	size_t i;
+	int cursor, ret;
+	bool retry;
+
+	cursor = drmModeAtomicGetCursor(req);
+
+	/* Layers are only marked clean after the final pass, so that changes
+	 * are still reported relative to the previous frame */
+	retry = false;
+	while (true) {
+		for (i = 0; i < group->tiles_len; i++) {
+			ret = output_apply(group->tiles[i].output, req, flags,
+					   retry);
+			if (ret != 0) {
+				drmModeAtomicSetCursor(req, cursor);
+				return ret;
+			}
+		}
+
+		retry = false;
+		liftoff_list_for_each(layer, &group->layers, link) {
+			if (group_layer_is_split(layer)) {
+				liftoff_log(LIFTOFF_DEBUG, "Group layer %p "
+					    "isn't offloaded on all tiles, "
+					    "compositing it", (void *)layer);
+				group_layer_set_composited(layer, true);
+				retry = true;
+			}
+		}
+		if (!retry) {
+			break;
+		}
+
+		drmModeAtomicSetCursor(req, cursor);
+	}
+
+	for (i = 0; i < group->tiles_len; i++) {
+		output_apply_finish(group->tiles[i].output);
+	}
+	return 0;
+}
+
+void
+liftoff_output_group_commit_done(struct liftoff_output_group *group,
+				 int result)
+{
+	size_t i;
+
+	for (i = 0; i < group->tiles_len; i++) {
+		liftoff_output_commit_done(group->tiles[i].output, result);
+	}
+}
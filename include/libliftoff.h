@@ -11,6 +11,16 @@ struct liftoff_device;
 struct liftoff_output;
 struct liftoff_layer;
 struct liftoff_plane;
+struct liftoff_output_group;
+struct liftoff_group_layer;
+
+/**
+ * A rectangle, in CRTC coordinates.
+ */
+struct liftoff_rect {
+	int x, y;
+	int width, height;
+};
 
 /**
  * Initialize libliftoff for a DRM node.
@@ -62,6 +72,112 @@ liftoff_plane_destroy(struct liftoff_plane *plane);
 uint32_t
 liftoff_plane_get_id(struct liftoff_plane *plane);
 
+/**
+ * Set whether the plane supports scaling.
+ *
+ * By default, this is guessed from the driver. Layers which need scaling are
+ * never put on planes which don't support it.
+ */
+void
+liftoff_plane_set_scaling_supported(struct liftoff_plane *plane, bool supported);
+
+/**
+ * Whether a change to a layer property requires a new plane allocation.
+ */
+enum liftoff_realloc_policy_type {
+	/* Changes never require a new plane allocation */
+	LIFTOFF_REALLOC_NEVER,
+	/* Changes always require a new plane allocation */
+	LIFTOFF_REALLOC_ALWAYS,
+	/* Changes from or to a specific value require a new plane allocation */
+	LIFTOFF_REALLOC_ON_VALUE,
+};
+
+/**
+ * Set the reallocation policy for a layer property on all outputs.
+ *
+ * By default, libliftoff only keeps the previous plane allocation when a few
+ * well-known properties change (e.g. FB_ID, IN_FENCE_FD). Any change to other
+ * properties results in a new plane allocation, which requires many atomic
+ * test commits. Users who know that a property never affects plane
+ * compatibility on their hardware can use this function to avoid this.
+ *
+ * For LIFTOFF_REALLOC_ON_VALUE, `value` is added to the list of values which
+ * require a new plane allocation when the property changes from or to them.
+ * This function can be called multiple times to add more values. For other
+ * policy types, `value` is ignored and any previously added value is removed.
+ *
+ * Policies set on an output via liftoff_output_set_realloc_policy take
+ * precedence.
+ *
+ * Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_device_set_realloc_policy(struct liftoff_device *device,
+				  const char *name,
+				  enum liftoff_realloc_policy_type type,
+				  uint64_t value);
+
+/**
+ * Set the maximum number of overlay planes enabled at once on an output.
+ *
+ * By default, there is no limit. A negative value means there is no limit.
+ */
+void
+liftoff_device_set_max_overlay_planes(struct liftoff_device *device, int max);
+
+/**
+ * Set whether the primary plane needs to be enabled to enable other planes.
+ *
+ * Some drivers (e.g. amdgpu) need the primary plane to light up a CRTC. By
+ * default, this is guessed from the driver.
+ */
+void
+liftoff_device_set_primary_plane_required(struct liftoff_device *device,
+					  bool required);
+
+/**
+ * Persist learned plane limitations to a file.
+ *
+ * libliftoff learns which scaling factors each plane accepts for each FB format
+ * and modifier from test commits. When a cache file is set, these are stored in
+ * the file and re-used the next time the same driver and planes are used, for
+ * instance after a compositor restart. The file is created if it doesn't
+ * exist, and reset if it was written for a different driver or set of planes.
+ *
+ * The file is loaded during the next liftoff_output_apply call, so planes
+ * registered before that call are taken into account. It is re-loaded when
+ * planes are registered or destroyed. Several processes may share the same
+ * file: accesses are serialized with flock(2).
+ *
+ * Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_device_set_cache_file(struct liftoff_device *device, const char *path);
+
+/**
+ * Forget cached information about an FB.
+ *
+ * libliftoff caches the format, modifier and size of the FBs attached to
+ * layers to figure out whether the previous plane allocation can be re-used
+ * when FB_ID changes. The kernel may re-use the ID of a removed FB for a new
+ * one, so users should call this function when removing an FB.
+ */
+void
+liftoff_device_invalidate_fb(struct liftoff_device *device, uint32_t fb_id);
+
+/**
+ * Forget the plane state committed to the kernel.
+ *
+ * Once commits are reported via liftoff_output_commit_done, libliftoff only
+ * adds plane properties which differ from the committed state to requests.
+ * Users should call this function when the planes may have been changed
+ * behind libliftoff's back, for instance after another DRM master has been
+ * active during a VT switch. The next requests will contain all properties.
+ */
+void
+liftoff_device_invalidate_state(struct liftoff_device *device);
+
 /**
  * Build a layer to plane mapping and append the plane configuration to `req`.
  *
@@ -76,6 +192,27 @@ int
 liftoff_output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
 		     uint32_t flags);
 
+/**
+ * Notify libliftoff of the result of an atomic commit.
+ *
+ * `result` is the return value of the drmModeAtomicCommit call which
+ * submitted the request filled by the last liftoff_output_apply call on this
+ * output.
+ *
+ * libliftoff keeps track of the last successfully committed configuration.
+ * The next requests only contain the plane properties which differ from it,
+ * except FB_ID, CRTC_ID, IN_FENCE_FD and FB_DAMAGE_CLIPS which are always set
+ * on enabled planes. If the commit failed, the layers are mapped back to the
+ * planes they had in that configuration (see liftoff_layer_get_plane), and the
+ * next liftoff_output_apply call re-uses this plane allocation with a single
+ * atomic test commit if possible.
+ *
+ * Users must call this function if trusted re-use is enabled, see
+ * liftoff_output_set_trusted_reuse.
+ */
+void
+liftoff_output_commit_done(struct liftoff_output *output, int result);
+
 /**
  * Make the device manage a CRTC's planes.
  *
@@ -97,12 +234,70 @@ liftoff_output_destroy(struct liftoff_output *output);
  *
  * Users should be able to blend layers that haven't been mapped to a plane to
  * this layer. The composition layer won't be used if all other layers have been
- * mapped to a plane. There is at most one composition layer per output.
+ * mapped to a plane. It can only be mapped to the primary plane.
+ *
+ * This is the bottommost composition layer: additional ones can be added with
+ * liftoff_output_add_composition_layer.
  */
 void
 liftoff_output_set_composition_layer(struct liftoff_output *output,
 				     struct liftoff_layer *layer);
 
+/**
+ * Add a composition layer above the one set with
+ * liftoff_output_set_composition_layer.
+ *
+ * Additional composition layers allow some layers to be mapped to planes even
+ * if composited layers are both below and above them, e.g. a video with
+ * subtitles on top. They need a zpos property and are mapped to non-primary
+ * planes. Their FB format needs an alpha channel.
+ *
+ * A layer needing composition is drawn to the topmost composition layer with a
+ * lower zpos which fully contains it, or to the one set with
+ * liftoff_output_set_composition_layer if there is none (see
+ * liftoff_layer_get_composition_layer). A composition layer is only used if a
+ * layer drawn to it needs composition.
+ */
+void
+liftoff_output_add_composition_layer(struct liftoff_output *output,
+				     struct liftoff_layer *layer);
+
+/**
+ * Remove a composition layer added with liftoff_output_add_composition_layer.
+ */
+void
+liftoff_output_remove_composition_layer(struct liftoff_output *output,
+					struct liftoff_layer *layer);
+
+/**
+ * Skip atomic test commits when only buffers change.
+ *
+ * By default, libliftoff performs an atomic test commit on each
+ * liftoff_output_apply call, even if the previous plane allocation is re-used.
+ * When trusted re-use is enabled, this test commit is skipped if the previous
+ * request was successfully committed and only FB_ID (from a non-zero value to
+ * another), IN_FENCE_FD or FB_DAMAGE_CLIPS changed since then.
+ *
+ * The atomic commit performed by the user may then fail. Users must report the
+ * result of each commit via liftoff_output_commit_done, so that libliftoff can
+ * compute a new plane allocation on the next liftoff_output_apply call.
+ */
+void
+liftoff_output_set_trusted_reuse(struct liftoff_output *output, bool trusted);
+
+/**
+ * Set the reallocation policy for a layer property on this output.
+ *
+ * See liftoff_device_set_realloc_policy.
+ *
+ * Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_output_set_realloc_policy(struct liftoff_output *output,
+				  const char *name,
+				  enum liftoff_realloc_policy_type type,
+				  uint64_t value);
+
 /**
  * Check whether this output needs composition.
  *
@@ -113,6 +308,154 @@ liftoff_output_set_composition_layer(struct liftoff_output *output,
 bool
 liftoff_output_needs_composition(struct liftoff_output *output);
 
+/**
+ * Check whether this output needs a new commit.
+ *
+ * An output is dirty unless the last liftoff_output_apply call's request has
+ * been reported as successfully committed via liftoff_output_commit_done and
+ * no layer has changed since then. When the output isn't dirty, users can
+ * skip both liftoff_output_apply and the atomic commit, e.g. to let the panel
+ * self-refresh.
+ *
+ * Outputs are always dirty if commits aren't reported.
+ */
+bool
+liftoff_output_is_dirty(struct liftoff_output *output);
+
+/**
+ * Check whether composition needs to be re-done.
+ *
+ * Returns false if the layers which need composition and their properties
+ * are the same as during the previous liftoff_output_apply call, in which
+ * case users can re-use the previous composition result.
+ */
+bool
+liftoff_output_composition_changed(struct liftoff_output *output);
+
+/**
+ * Retrieve the region which needs composition.
+ *
+ * The region is the union of the layers which need composition after the last
+ * liftoff_output_apply call, clipped to their composition layer and to the size
+ * set via liftoff_output_set_size, if any. It is described by at most
+ * `max_rects` non-overlapping rectangles written to `rects`, which may cover a
+ * slightly larger area to honor this limit.
+ *
+ * The number of rectangles written is returned, zero if no layer needs
+ * composition.
+ */
+size_t
+liftoff_output_get_composition_region(struct liftoff_output *output,
+				      struct liftoff_rect *rects,
+				      size_t max_rects);
+
+/**
+ * Let libliftoff manage FB_DAMAGE_CLIPS for composition layers.
+ *
+ * When enabled, liftoff_output_apply sets the FB_DAMAGE_CLIPS property of the
+ * planes displaying composition layers to the area covered by composited
+ * layers which changed since the previous liftoff_output_apply call (see
+ * liftoff_layer_get_composition_changes). Drivers can then only fetch the
+ * damaged part of the composition buffer, e.g. for panel self-refresh.
+ *
+ * When only the FB of a composited layer changed and its FB_DAMAGE_CLIPS were
+ * set via liftoff_layer_set_property_blob, only these clips are damaged.
+ * Otherwise, the whole layer is.
+ *
+ * The damage is relative to the last committed state of the plane, so users
+ * must report commits with liftoff_output_commit_done. Without it, the whole
+ * composition buffer is damaged on every frame.
+ *
+ * Users must not set FB_DAMAGE_CLIPS on composition layers, and must only
+ * draw composited layers to the composition buffers. Damage blobs are managed
+ * like the ones created by liftoff_layer_set_property_blob.
+ *
+ * Disabled by default.
+ */
+void
+liftoff_output_set_composition_damage(struct liftoff_output *output,
+				      bool enabled);
+
+/**
+ * Set the size of the mode used by this output's CRTC.
+ *
+ * Layers entirely outside of the mode aren't visible: they aren't mapped to a
+ * plane and don't need composition. Zero unsets the size.
+ */
+void
+liftoff_output_set_size(struct liftoff_output *output, int width, int height);
+
+/**
+ * Clip layers partly outside of the mode.
+ *
+ * Many drivers reject planes extending past the mode. When enabled, the
+ * CRTC_* and SRC_* properties of layers partly outside of the mode set via
+ * liftoff_output_set_size are clipped before being passed to KMS. Layers are
+ * only clipped if they have all of these properties and aren't rotated.
+ *
+ * Disabled by default.
+ */
+void
+liftoff_output_set_layer_clipping(struct liftoff_output *output, bool enabled);
+
+/**
+ * Split layers wider than the given width across several planes.
+ *
+ * Some display engines can't scan out planes as wide as the modes they
+ * support. When a split width is set, wider layers can be mapped to several
+ * overlay planes, each displaying an adjacent vertical slice of the layer at
+ * most this wide. liftoff_layer_get_plane returns the plane displaying the
+ * leftmost slice. Only non-rotated layers with all CRTC_* and SRC_* properties
+ * set are split.
+ *
+ * Zero disables splitting, which is the default.
+ */
+void
+liftoff_output_set_split_width(struct liftoff_output *output, uint32_t width);
+
+/**
+ * Allow putting layers on planes below the composition layer.
+ *
+ * Some hardware only has scaling-capable planes below the primary plane. When
+ * underlays are enabled, fully opaque layers (see
+ * liftoff_layer_set_opaque_region) can be mapped to such planes even if
+ * composited layers are above them: users make the composition layer
+ * transparent over layers for which liftoff_layer_is_underlay returns true.
+ * The composition layer's FB format needs an alpha channel.
+ *
+ * Disabled by default.
+ */
+void
+liftoff_output_set_underlays(struct liftoff_output *output, bool enabled);
+
+/**
+ * Consider layers with an FB format without an alpha channel fully opaque.
+ *
+ * When enabled, layers with an opaque alpha and an FB format such as
+ * XRGB8888 or NV12 hide the layers they cover, as if their opaque region was
+ * set to the whole layer (see liftoff_layer_set_opaque_region).
+ *
+ * Disabled by default.
+ */
+void
+liftoff_output_set_implicit_opaque_regions(struct liftoff_output *output,
+					   bool enabled);
+
+/**
+ * Set the presentation time of the next frame.
+ *
+ * `time_nsec` is a CLOCK_MONOTONIC timestamp in nanoseconds, typically computed
+ * from the page-flip event of the previous frame. libliftoff uses it to measure
+ * how often each layer is updated: layers updated more often are more likely
+ * to be mapped to a plane.
+ *
+ * The timestamp applies to the next liftoff_output_apply call. If it isn't
+ * set, libliftoff samples CLOCK_MONOTONIC when liftoff_output_apply is called.
+ */
+void
+liftoff_output_set_presentation_time(struct liftoff_output *output,
+				     uint64_t time_nsec);
+
 /**
  * Create a new layer on an output.
  *
@@ -144,6 +487,38 @@ int
 liftoff_layer_set_property(struct liftoff_layer *layer, const char *name,
 			   uint64_t value);
 
+/**
+ * Set a blob property on this layer from the blob's contents.
+ *
+ * libliftoff creates the KMS property blob and manages its lifetime. Blobs are
+ * shared between all properties with the same contents, so setting unchanged
+ * contents doesn't create a new blob. A blob is destroyed once no layer
+ * property, pending request or committed plane state references it anymore,
+ * and a few unused blobs are kept around for re-use.
+ *
+ * Setting a zero size sets the property to zero. Setting the property via
+ * liftoff_layer_set_property releases the blob.
+ *
+ * Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_layer_set_property_blob(struct liftoff_layer *layer, const char *name,
+				const void *data, size_t size);
+
+/**
+ * Set the opaque region of this layer, in CRTC coordinates.
+ *
+ * Layers entirely covered by the opaque region of a layer above them aren't
+ * visible: they aren't mapped to a plane and don't need composition. Only
+ * layers with a zpos property are considered, and the opaque region is ignored
+ * if the layer's alpha isn't opaque. NULL unsets the opaque region.
+ *
+ * See also liftoff_output_set_implicit_opaque_regions.
+ */
+void
+liftoff_layer_set_opaque_region(struct liftoff_layer *layer,
+				const struct liftoff_rect *rect);
+
 /**
  * Force composition on this layer.
  *
@@ -165,6 +540,53 @@ liftoff_layer_set_fb_composited(struct liftoff_layer *layer);
 bool
 liftoff_layer_needs_composition(struct liftoff_layer *layer);
 
+/**
+ * Retrieve the composition layer this layer needs to be drawn to.
+ *
+ * NULL is returned if the layer doesn't need composition or if the output has
+ * no composition layer.
+ */
+struct liftoff_layer *
+liftoff_layer_get_composition_layer(struct liftoff_layer *layer);
+
+/**
+ * Changes which require composition to be re-done.
+ */
+enum liftoff_composition_change {
+	/* The layer started or stopped needing composition or being an
+	 * underlay, or moved to another composition layer */
+	LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP = 1 << 0,
+	/* CRTC_*, SRC_* or rotation changed */
+	LIFTOFF_COMPOSITION_CHANGE_GEOMETRY = 1 << 1,
+	/* FB_ID, FB_DAMAGE_CLIPS or any other property changed */
+	LIFTOFF_COMPOSITION_CHANGE_CONTENT = 1 << 2,
+};
+
+/**
+ * Retrieve the changes affecting composition for this layer.
+ *
+ * A bitmask of enum liftoff_composition_change is returned, describing the
+ * changes between the two last liftoff_output_apply calls. Changes are only
+ * reported for layers which needed composition or were underlays after either
+ * call. Only geometry changes are reported for underlays.
+ *
+ * libliftoff only knows about layer properties: users need to set FB_ID or
+ * FB_DAMAGE_CLIPS when the contents of a layer change.
+ */
+uint32_t
+liftoff_layer_get_composition_changes(struct liftoff_layer *layer);
+
+/**
+ * Check whether this layer is mapped to a plane below a composition layer it's
+ * supposed to be above.
+ *
+ * Users need to clear the layer's rectangle to transparent in the composition
+ * layers mapped to a plane above it, except those with a higher zpos, so that
+ * underlays show through. See liftoff_output_set_underlays.
+ */
+bool
+liftoff_layer_is_underlay(struct liftoff_layer *layer);
+
 /**
  * Retrieve the plane mapped to this layer.
  *
@@ -173,6 +595,104 @@ liftoff_layer_needs_composition(struct liftoff_layer *layer);
 struct liftoff_plane *
 liftoff_layer_get_plane(struct liftoff_layer *layer);
 
+/**
+ * Create a group of outputs driving the tiles of a single display.
+ *
+ * Some displays are made of several tiles, each driven by its own CRTC. Layers
+ * attached to the group use the coordinates of the whole display and are
+ * offloaded to a plane on each tile they cover.
+ */
+struct liftoff_output_group *
+liftoff_output_group_create(void);
+
+/**
+ * Destroy an output group.
+ *
+ * The group's layers are destroyed too. The tile outputs aren't destroyed, and
+ * must outlive the group.
+ */
+void
+liftoff_output_group_destroy(struct liftoff_output_group *group);
+
+/**
+ * Add a tile to the group.
+ *
+ * `x` and `y` are the position of the tile in the display. Layer clipping is
+ * enabled on the output (see liftoff_output_set_layer_clipping), users need
+ * to set the size of the tile via liftoff_output_set_size.
+ *
+ * Tiles need to be added before any layer is created: -EBUSY is returned
+ * otherwise. Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_output_group_add_tile(struct liftoff_output_group *group,
+			      struct liftoff_output *output, int x, int y);
+
+/**
+ * Build a layer to plane mapping for each tile of the group and append the
+ * plane configurations to `req`.
+ *
+ * A layer is either offloaded on all of the tiles it covers or on none: if a
+ * tile fails to offload it, the layer needs composition on all of them. This
+ * lasts until a property other than FB_ID, IN_FENCE_FD or FB_DAMAGE_CLIPS is
+ * set on the layer.
+ *
+ * Callers are expected to commit `req` afterwards and to report the result via
+ * liftoff_output_group_commit_done. See liftoff_output_apply.
+ *
+ * Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_output_group_apply(struct liftoff_output_group *group,
+			   drmModeAtomicReq *req, uint32_t flags);
+
+/**
+ * Notify libliftoff of the result of an atomic commit, for each tile of the
+ * group. See liftoff_output_commit_done.
+ */
+void
+liftoff_output_group_commit_done(struct liftoff_output_group *group,
+				 int result);
+
+/**
+ * Create a new layer on a group, with one layer per tile.
+ */
+struct liftoff_group_layer *
+liftoff_group_layer_create(struct liftoff_output_group *group);
+
+/**
+ * Destroy a group layer and its per-tile layers.
+ */
+void
+liftoff_group_layer_destroy(struct liftoff_group_layer *layer);
+
+/**
+ * Set a property on the group layer.
+ *
+ * CRTC_X and CRTC_Y are in display coordinates, they are translated to the
+ * coordinates of each tile. Other properties are set as is on each tile.
+ *
+ * Zero is returned on success, negative errno on error.
+ */
+int
+liftoff_group_layer_set_property(struct liftoff_group_layer *layer,
+				 const char *name, uint64_t value);
+
+/**
+ * Check whether this group layer needs to be composited on at least one tile.
+ */
+bool
+liftoff_group_layer_needs_composition(struct liftoff_group_layer *layer);
+
+/**
+ * Retrieve the layer of a group layer on the given tile output.
+ *
+ * NULL is returned if the output isn't a tile of the group.
+ */
+struct liftoff_layer *
+liftoff_group_layer_get_tile(struct liftoff_group_layer *layer,
+			     struct liftoff_output *output);
+
 enum liftoff_log_priority {
 	LIFTOFF_SILENT,
 	LIFTOFF_ERROR,
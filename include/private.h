@@ -5,9 +5,36 @@
 #include "list.h"
 #include "log.h"
 
-/* Layer priority is assigned depending on the number of updates during a
- * given number of page-flips */
-#define LIFTOFF_PRIORITY_PERIOD 60
+/* Layer priority is the rate at which a layer is updated, in Hz. Updates are
+ * counted with an exponential decay, this is the time constant of the decay
+ * in nanoseconds. */
+#define LIFTOFF_PRIORITY_DECAY_NSEC 1000000000 /* 1s */
+
+/* A layer without a plane needs to be updated this many times more often than
+ * a layer with a plane to trigger a new plane allocation */
+#define LIFTOFF_PRIORITY_REALLOC_FACTOR 2
+
+/* Number of test commits skipped because of a learned plane limit before the
+ * limit is checked again with a real test commit */
+#define LIFTOFF_CAPS_VERIFY_INTERVAL 32
+
+/* Number of solved plane allocations remembered per output */
+#define LIFTOFF_SCENE_CACHE_SIZE 8
+
+/* Max number of FB_DAMAGE_CLIPS rectangles set on the composition layer */
+#define LIFTOFF_DAMAGE_MAX_RECTS 8
+
+/* Max number of planes a layer can be split across */
+#define LIFTOFF_SPLIT_MAX 4
+
+/* Number of learned scaling outcomes kept in the cache file, see cache.c */
+#define LIFTOFF_CACHE_RECORDS_MAX 256
+
+/* Number of unused property blobs kept for re-use, see blob.c */
+#define LIFTOFF_IDLE_BLOBS_MAX 16
+
+/* FNV-1a offset basis, initial value for hash_* functions */
+#define LIFTOFF_HASH_INIT UINT64_C(0xcbf29ce484222325)
 
 struct liftoff_device {
 	int drm_fd;
@@ -18,10 +45,41 @@ struct liftoff_device {
 	uint32_t *crtcs;
 	size_t crtcs_len;
 
-	int page_flip_counter;
+	struct liftoff_realloc_policy *realloc_policies;
+	size_t realloc_policies_len;
+
+	/* property metadata, filled lazily */
+	struct liftoff_prop_info **prop_infos;
+	size_t prop_infos_len;
+
+	/* seeded from the driver profile, may be overridden by the user */
+	int max_overlay_planes; /* -1 if unlimited */
+	bool primary_plane_required; /* to enable any other plane */
+	uint32_t no_scaling_plane_types; /* bitmask of 1 << DRM_PLANE_TYPE_* */
+
+	/* persistent cache of learned plane limits, NULL if unset */
+	struct liftoff_cache *cache;
+
+	/* FBs referenced by layers, filled lazily */
+	struct liftoff_fb_info *fb_infos;
+	size_t fb_infos_len, fb_infos_cap;
+
+	/* property blobs created by libliftoff, most recently used first */
+	struct liftoff_list blobs; /* liftoff_blob.link */
+
 	int test_commit_counter;
 };
 
+/* A plane allocation found for a given scene */
+struct liftoff_scene {
+	uint64_t hash; /* see output_scene_hash */
+	uint64_t last_used;
+	/* index of the layer in liftoff_output.layers for each plane of the
+	 * device, -1 if the plane isn't used by the output */
+	int *plane_layers;
+	size_t planes_len;
+};
+
 struct liftoff_output {
 	struct liftoff_device *device;
 	uint32_t crtc_id;
@@ -31,10 +89,61 @@ struct liftoff_output {
 	struct liftoff_layer *composition_layer;
 
 	struct liftoff_list layers; /* liftoff_layer.link */
+
+	/* take precedence over liftoff_device.realloc_policies */
+	struct liftoff_realloc_policy *realloc_policies;
+	size_t realloc_policies_len;
+
 	/* layer added or removed, or composition layer changed */
 	bool layers_changed;
+	/* whether each pair of layers intersected during the last apply */
+	bool *layers_intersect;
+	size_t layers_intersect_len;
+
+	/* CLOCK_MONOTONIC, in nanoseconds, zero if unset */
+	uint64_t presentation_time;
+
+	/* skip test commits when only buffers changed */
+	bool trusted_reuse;
+	/* the last apply's request has been successfully committed */
+	bool commit_succeeded;
+
+	/* state as of the last successful commit, for rollbacks */
+	bool has_committed; /* a commit has been reported as successful */
+	bool uncommitted_layers_changed; /* layers_changed since then */
+	bool *committed_intersect;
+	size_t committed_intersect_len;
 
 	int alloc_reused_counter;
+
+	/* composited layer removed or composition layer changed since the
+	 * last apply */
+	bool composition_reset;
+	/* composition needs to be re-done since the previous apply */
+	bool composition_changed;
+	/* manage FB_DAMAGE_CLIPS for the composition layer */
+	bool composition_damage;
+	/* layers with an opaque FB format are opaque */
+	bool implicit_opaque_regions;
+	/* opaque layers may go below the composition layer */
+	bool underlays;
+
+	/* mode size, zero if unknown */
+	int width, height;
+	/* clip layers to the mode before passing them to KMS */
+	bool clip_layers;
+	/* max width of a plane, zero if layers aren't split */
+	uint32_t split_width;
+
+	/* recently solved plane allocations, see scene.c */
+	struct liftoff_scene scenes[LIFTOFF_SCENE_CACHE_SIZE];
+	size_t scenes_len;
+	uint64_t scenes_clock; /* incremented on each lookup, for LRU eviction */
+	uint64_t scene_hash; /* scene of the last computed plane allocation */
+
+	/* pending work for output_apply_finish */
+	bool apply_realloc; /* the plane allocation has been re-computed */
+	bool apply_add_scene; /* scene_hash needs to be cached */
 };
 
 struct liftoff_layer {
@@ -45,53 +154,270 @@ struct liftoff_layer {
 	size_t props_len;
 
 	bool force_composition; /* FB needs to be composited */
+	/* tile of a group layer which couldn't be offloaded on all tiles */
+	bool group_composited;
 
 	struct liftoff_plane *plane;
 
-	int current_priority, pending_priority;
+	double priority; /* update rate, in Hz */
+	double alloc_priority; /* priority during the last plane allocation */
+	uint64_t priority_time; /* last priority update, in nanoseconds */
 	/* prop added or force_composition changed */
 	bool changed;
+
+	/* added with liftoff_output_add_composition_layer */
+	bool extra_composition;
+	/* composition layer to draw to if composited, as of the last apply
+	 * and the one before */
+	struct liftoff_layer *target, *prev_target;
+
+	/* explicit opaque region, in CRTC coordinates */
+	bool has_opaque_region;
+	struct liftoff_rect opaque_region;
+	/* off-screen or hidden by an opaque layer above, as of the last
+	 * apply */
+	bool hidden, prev_hidden;
+
+	/* needed composition or was an underlay, as of the last apply and the
+	 * one before */
+	bool composited, prev_composited;
+	bool underlay, prev_underlay;
+	uint32_t composition_changes; /* enum liftoff_composition_change */
+
+	/* state as of the last successful commit */
+	size_t committed_props_len;
+	bool committed_force_composition;
+};
+
+struct liftoff_tile {
+	struct liftoff_output *output;
+	int x, y; /* position of the tile in the group */
+};
+
+struct liftoff_output_group {
+	struct liftoff_tile *tiles;
+	size_t tiles_len;
+
+	struct liftoff_list layers; /* liftoff_group_layer.link */
+};
+
+struct liftoff_group_layer {
+	struct liftoff_output_group *group;
+	struct liftoff_list link; /* liftoff_output_group.layers */
+
+	struct liftoff_layer **tiles; /* one layer per group tile */
 };
 
 struct liftoff_layer_property {
 	char name[DRM_PROP_NAME_LEN];
 	uint64_t value, prev_value;
+	uint64_t committed_value; /* as of the last successful commit */
+	struct liftoff_blob *blob; /* blob of the value, NULL if not managed */
+};
+
+/* CRTC_* and SRC_* properties of a layer */
+struct liftoff_layer_geometry {
+	int32_t crtc_x, crtc_y;
+	uint32_t crtc_w, crtc_h;
+	uint64_t src_x, src_y, src_w, src_h; /* 16.16 fixed point */
+};
+
+/* Scaling test outcomes of a plane for FBs of a given format and modifier.
+ * Factors are source size / CRTC size for downscaling and the inverse for
+ * upscaling, in 16.16 fixed point, zero if unknown. */
+struct liftoff_scaling_limits {
+	uint32_t format; /* zero if the FB couldn't be queried */
+	uint64_t modifier;
+	/* largest factors which passed a test commit */
+	uint64_t pass_downscale, pass_upscale;
+	/* smallest factors which failed a test commit, only learned from
+	 * layers which passed once unscaled */
+	uint64_t fail_downscale, fail_upscale;
+};
+
+struct liftoff_plane_caps {
+	/* maximum CRTC_W and CRTC_H, zero if unknown */
+	uint32_t max_width, max_height;
+	struct liftoff_scaling_limits *scaling;
+	size_t scaling_len;
+	/* test commits skipped since the limits were last verified */
+	int skipped_tests;
+	/* the plane can't scale at all */
+	bool scaling_unsupported;
 };
 
 struct liftoff_plane {
+	struct liftoff_device *device;
 	uint32_t id;
 	uint32_t possible_crtcs;
 	uint32_t type;
 	int zpos; /* greater values mean closer to the eye */
-	/* TODO: formats */
+	/* sorted by format then modifier, empty if unknown */
+	struct liftoff_plane_format *formats;
+	size_t formats_len;
+	/* false if the modifiers are unknown (no IN_FORMATS) */
+	bool formats_have_modifiers;
+	struct liftoff_plane_caps caps;
 	struct liftoff_list link; /* liftoff_device.planes */
 
 	struct liftoff_plane_property *props;
 	size_t props_len;
 
 	struct liftoff_layer *layer;
+	/* slice of the layer displayed by this plane, see layer_get_slices_len */
+	size_t slice;
+	/* as of the last request filled by pending_output, see apply_current */
+	struct liftoff_output *pending_output;
+	struct liftoff_layer *pending_layer;
+	/* as of the last successful commit */
+	struct liftoff_layer *committed_layer;
 };
 
 struct liftoff_plane_property {
 	char name[DRM_PROP_NAME_LEN];
 	uint32_t id;
+	struct liftoff_prop_info *info; /* owned by liftoff_device */
+
+	/* value in the last request filled for the plane, and in the kernel
+	 * as of the last successful commit; unknown values are always set */
+	uint64_t pending_value, committed_value;
+	bool pending_known, committed_known;
 };
 
-struct liftoff_rect {
-	int x, y;
-	int width, height;
+/* Property metadata, shared by all objects with this property */
+struct liftoff_prop_info {
+	uint32_t id;
+	char name[DRM_PROP_NAME_LEN];
+	uint32_t flags; /* DRM_MODE_PROP_* */
+
+	/* DRM_MODE_PROP_RANGE and DRM_MODE_PROP_SIGNED_RANGE */
+	uint64_t min, max;
+	/* DRM_MODE_PROP_ENUM */
+	uint64_t *enum_values;
+	size_t enum_values_len;
+	/* DRM_MODE_PROP_BITMASK */
+	uint64_t bitmask;
+};
+
+struct liftoff_plane_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+struct liftoff_driver_profile {
+	const char *driver; /* as returned by drmGetVersion */
+	bool primary_plane_required;
+	uint32_t no_scaling_plane_types; /* bitmask of 1 << DRM_PLANE_TYPE_* */
+};
+
+struct liftoff_realloc_policy {
+	char name[DRM_PROP_NAME_LEN];
+	enum liftoff_realloc_policy_type type;
+	uint64_t *values; /* for LIFTOFF_REALLOC_ON_VALUE */
+	size_t values_len;
 };
 
+struct liftoff_fb_info {
+	uint32_t id;
+	bool valid; /* false if the FB couldn't be queried */
+	uint32_t width, height;
+	uint32_t format;
+	uint64_t modifier; /* DRM_FORMAT_MOD_INVALID if implicit */
+};
+
+void
+device_init_profile(struct liftoff_device *device);
+
+bool
+device_plane_type_can_scale(struct liftoff_device *device, uint32_t type);
+
+void
+device_cache_load(struct liftoff_device *device);
+
+void
+device_cache_invalidate(struct liftoff_device *device);
+
+void
+device_cache_finish(struct liftoff_device *device);
+
+void
+device_cache_store(struct liftoff_device *device, struct liftoff_plane *plane,
+		   const struct liftoff_scaling_limits *limits);
+
+struct liftoff_blob *
+device_get_blob(struct liftoff_device *device, const void *data, size_t size);
+
+uint32_t
+blob_get_id(struct liftoff_blob *blob);
+
+const void *
+blob_get_data(struct liftoff_blob *blob, size_t *size);
+
+void
+blob_ref(struct liftoff_blob *blob);
+
+void
+blob_unref(struct liftoff_blob *blob);
+
+void
+device_collect_blobs(struct liftoff_device *device);
+
+void
+device_blobs_finish(struct liftoff_device *device);
+
+uint64_t
+hash_u64(uint64_t hash, uint64_t value);
+
+uint64_t
+hash_str(uint64_t hash, const char *str);
+
 int
 device_test_commit(struct liftoff_device *device, drmModeAtomicReq *req,
 		   uint32_t flags);
 
+bool
+device_get_fb_info(struct liftoff_device *device, uint32_t fb_id,
+		   struct liftoff_fb_info *info);
+
+void
+device_evict_fb_infos(struct liftoff_device *device);
+
+struct liftoff_prop_info *
+device_get_prop_info(struct liftoff_device *device, uint32_t prop_id);
+
+void
+prop_info_destroy(struct liftoff_prop_info *info);
+
+bool
+prop_info_is_valid(const struct liftoff_prop_info *info, uint64_t value);
+
 struct liftoff_layer_property *
 layer_get_property(struct liftoff_layer *layer, const char *name);
 
 void
 layer_get_rect(struct liftoff_layer *layer, struct liftoff_rect *rect);
 
+void
+layer_get_prev_rect(struct liftoff_layer *layer, struct liftoff_rect *rect);
+
+bool
+layer_get_opaque_rect(struct liftoff_layer *layer, struct liftoff_rect *rect);
+
+size_t
+layer_get_slices_len(struct liftoff_layer *layer);
+
+bool
+layer_get_plane_size(struct liftoff_layer *layer, uint64_t *width,
+		     uint64_t *height);
+
+bool
+layer_get_slice_geometry(struct liftoff_layer *layer, size_t slice,
+			 struct liftoff_layer_geometry *geom);
+
+bool
+layer_get_unscaled_geometry(struct liftoff_layer *layer,
+			    struct liftoff_layer_geometry *geom);
+
 bool
 layer_intersects(struct liftoff_layer *a, struct liftoff_layer *b);
 
@@ -99,7 +425,16 @@ void
 layer_mark_clean(struct liftoff_layer *layer);
 
 void
-layer_update_priority(struct liftoff_layer *layer, bool make_current);
+layer_mark_committed(struct liftoff_layer *layer);
+
+void
+layer_rollback(struct liftoff_layer *layer);
+
+bool
+layer_is_dirty(struct liftoff_layer *layer);
+
+void
+layer_update_priority(struct liftoff_layer *layer, uint64_t now);
 
 bool
 layer_has_fb(struct liftoff_layer *layer);
@@ -107,11 +442,114 @@ layer_has_fb(struct liftoff_layer *layer);
 bool
 layer_is_visible(struct liftoff_layer *layer);
 
+bool
+layer_is_composition(struct liftoff_layer *layer);
+
+bool
+plane_supports_fb(struct liftoff_plane *plane,
+		  const struct liftoff_fb_info *fb_info);
+
 int
 plane_apply(struct liftoff_plane *plane, struct liftoff_layer *layer,
-	    drmModeAtomicReq *req);
+	    size_t slice, drmModeAtomicReq *req);
+
+int
+plane_apply_unscaled(struct liftoff_plane *plane, struct liftoff_layer *layer,
+		     drmModeAtomicReq *req);
+
+void
+plane_map_layer(struct liftoff_plane *plane, struct liftoff_layer *layer);
+
+void
+plane_mark_committed(struct liftoff_plane *plane);
+
+bool
+plane_has_property(struct liftoff_plane *plane, const char *name);
+
+int
+plane_set_damage_clips(struct liftoff_plane *plane, drmModeAtomicReq *req,
+		       uint32_t blob_id);
+
+void
+plane_caps_init(struct liftoff_plane_caps *caps, int drm_fd, uint32_t type);
+
+void
+plane_caps_finish(struct liftoff_plane_caps *caps);
+
+int
+plane_caps_parse_size_hints(struct liftoff_plane_caps *caps, int drm_fd,
+			    uint32_t blob_id);
+
+struct liftoff_scaling_limits *
+plane_caps_get_scaling(struct liftoff_plane_caps *caps, uint32_t format,
+		       uint64_t modifier, bool create);
+
+bool
+plane_caps_predict_failure(struct liftoff_plane *plane,
+			   struct liftoff_layer *layer);
+
+void
+plane_caps_record_success(struct liftoff_plane *plane,
+			  struct liftoff_layer *layer);
+
+bool
+plane_caps_would_learn_failure(struct liftoff_plane *plane,
+			       struct liftoff_layer *layer);
+
+void
+plane_caps_record_scaling_failure(struct liftoff_plane *plane,
+				  struct liftoff_layer *layer);
+
+int
+output_apply(struct liftoff_output *output, drmModeAtomicReq *req,
+	     uint32_t flags, bool retry);
+
+void
+output_apply_finish(struct liftoff_output *output);
 
 void
 output_log_layers(struct liftoff_output *output);
 
+void
+output_update_composition_targets(struct liftoff_output *output);
+
+int
+output_update_composition(struct liftoff_output *output, drmModeAtomicReq *req,
+			  bool retry);
+
+uint64_t
+output_scene_hash(struct liftoff_output *output);
+
+struct liftoff_scene *
+output_get_scene(struct liftoff_output *output, uint64_t hash);
+
+void
+output_add_scene(struct liftoff_output *output, uint64_t hash);
+
+void
+output_remove_scene(struct liftoff_output *output, struct liftoff_scene *scene);
+
+void
+output_scenes_finish(struct liftoff_output *output);
+
+struct liftoff_realloc_policy *
+output_get_realloc_policy(struct liftoff_output *output, const char *name);
+
+struct liftoff_realloc_policy *
+realloc_policy_get(struct liftoff_realloc_policy *policies, size_t policies_len,
+		   const char *name);
+
+int
+realloc_policy_set(struct liftoff_realloc_policy **policies_ptr,
+		   size_t *policies_len_ptr, const char *name,
+		   enum liftoff_realloc_policy_type type, uint64_t value);
+
+void
+realloc_policy_finish(struct liftoff_realloc_policy *policies,
+		      size_t policies_len);
+
+bool
+realloc_policy_needs_realloc(struct liftoff_realloc_policy *policy,
+			     uint64_t prev_value, uint64_t value);
+
 #endif
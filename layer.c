@@ -1,4 +1,6 @@
+#include <drm_fourcc.h>
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include "private.h"
@@ -22,17 +24,49 @@ liftoff_layer_create(struct liftoff_output *output)
 void
 liftoff_layer_destroy(struct liftoff_layer *layer)
 {
+	struct liftoff_plane *plane;
+	struct liftoff_layer *other;
+	size_t i;
+
 	if (layer == NULL) {
 		return;
 	}
 
 	layer->output->layers_changed = true;
-	if (layer->plane != NULL) {
-		layer->plane->layer = NULL;
+	if (layer->composited) {
+		layer->output->composition_reset = true;
+	}
+	liftoff_list_for_each(plane, &layer->output->device->planes, link) {
+		/* Split layers are mapped to several planes */
+		if (plane->layer == layer) {
+			plane->layer = NULL;
+		}
+		if (plane->pending_layer == layer) {
+			plane->pending_layer = NULL;
+		}
+		if (plane->committed_layer == layer) {
+			plane->committed_layer = NULL;
+		}
 	}
 	if (layer->output->composition_layer == layer) {
 		layer->output->composition_layer = NULL;
 	}
+	if (layer_is_composition(layer)) {
+		layer->output->composition_reset = true;
+		liftoff_list_for_each(other, &layer->output->layers, link) {
+			if (other->target == layer) {
+				other->target = NULL;
+			}
+			if (other->prev_target == layer) {
+				other->prev_target = NULL;
+			}
+		}
+	}
+	for (i = 0; i < layer->props_len; i++) {
+		if (layer->props[i].blob != NULL) {
+			blob_unref(layer->props[i].blob);
+		}
+	}
 	free(layer->props);
 	liftoff_list_remove(&layer->link);
 	free(layer);
@@ -83,6 +117,10 @@ liftoff_layer_set_property(struct liftoff_layer *layer, const char *name,
 	}
 
 	prop->value = value;
+	if (prop->blob != NULL) {
+		blob_unref(prop->blob);
+		prop->blob = NULL;
+	}
 
 	if (strcmp(name, "FB_ID") == 0 && layer->force_composition) {
 		layer->force_composition = false;
@@ -92,6 +130,36 @@ liftoff_layer_set_property(struct liftoff_layer *layer, const char *name,
 	return 0;
 }
 
+int
+liftoff_layer_set_property_blob(struct liftoff_layer *layer, const char *name,
+				const void *data, size_t size)
+{
+	struct liftoff_blob *blob;
+	struct liftoff_layer_property *prop;
+	int ret;
+
+	if (size == 0) {
+		return liftoff_layer_set_property(layer, name, 0);
+	}
+
+	blob = device_get_blob(layer->output->device, data, size);
+	if (blob == NULL) {
+		return -errno;
+	}
+
+	/* Take the reference first, the property may hold the same blob */
+	blob_ref(blob);
+	ret = liftoff_layer_set_property(layer, name, blob_get_id(blob));
+	if (ret != 0) {
+		blob_unref(blob);
+		return ret;
+	}
+
+	prop = layer_get_property(layer, name);
+	prop->blob = blob;
+	return 0;
+}
+
 void
 liftoff_layer_set_fb_composited(struct liftoff_layer *layer)
 {
@@ -105,6 +173,25 @@ liftoff_layer_set_fb_composited(struct liftoff_layer *layer)
 	layer->changed = true;
 }
 
+void
+liftoff_layer_set_opaque_region(struct liftoff_layer *layer,
+				const struct liftoff_rect *rect)
+{
+	struct liftoff_rect prev = layer->opaque_region;
+	bool had_opaque_region = layer->has_opaque_region;
+
+	layer->has_opaque_region = rect != NULL;
+	if (rect != NULL) {
+		layer->opaque_region = *rect;
+	}
+
+	/* Opacity affects occlusion culling and underlays */
+	if (had_opaque_region != layer->has_opaque_region ||
+	    (rect != NULL && memcmp(&prev, rect, sizeof(prev)) != 0)) {
+		layer->output->layers_changed = true;
+	}
+}
+
 struct liftoff_plane *
 liftoff_layer_get_plane(struct liftoff_layer *layer)
 {
@@ -114,7 +201,8 @@ liftoff_layer_get_plane(struct liftoff_layer *layer)
 bool
 liftoff_layer_needs_composition(struct liftoff_layer *layer)
 {
-	if (!layer_is_visible(layer)) {
+	/* Unused additional composition layers are simply disabled */
+	if (!layer_is_visible(layer) || layer->extra_composition) {
 		return false;
 	}
 	return layer->plane == NULL;
@@ -136,6 +224,291 @@ layer_get_rect(struct liftoff_layer *layer, struct liftoff_rect *rect)
 	rect->height = h_prop != NULL ? h_prop->value : 0;
 }
 
+/* Rectangle as of the last apply */
+void
+layer_get_prev_rect(struct liftoff_layer *layer, struct liftoff_rect *rect)
+{
+	struct liftoff_layer_property *x_prop, *y_prop, *w_prop, *h_prop;
+
+	x_prop = layer_get_property(layer, "CRTC_X");
+	y_prop = layer_get_property(layer, "CRTC_Y");
+	w_prop = layer_get_property(layer, "CRTC_W");
+	h_prop = layer_get_property(layer, "CRTC_H");
+
+	rect->x = x_prop != NULL ? x_prop->prev_value : 0;
+	rect->y = y_prop != NULL ? y_prop->prev_value : 0;
+	rect->width = w_prop != NULL ? w_prop->prev_value : 0;
+	rect->height = h_prop != NULL ? h_prop->prev_value : 0;
+}
+
+static bool
+format_is_opaque(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_BGRX8888:
+	case DRM_FORMAT_XRGB2101010:
+	case DRM_FORMAT_XBGR2101010:
+	case DRM_FORMAT_XRGB16161616F:
+	case DRM_FORMAT_XBGR16161616F:
+	case DRM_FORMAT_RGB888:
+	case DRM_FORMAT_BGR888:
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_BGR565:
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+	case DRM_FORMAT_NV16:
+	case DRM_FORMAT_P010:
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_UYVY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Returns false if no part of the layer is known to be opaque */
+bool
+layer_get_opaque_rect(struct liftoff_layer *layer, struct liftoff_rect *rect)
+{
+	struct liftoff_layer_property *alpha_prop, *fb_id_prop;
+	struct liftoff_fb_info fb_info;
+	struct liftoff_rect layer_rect;
+
+	alpha_prop = layer_get_property(layer, "alpha");
+	if (alpha_prop != NULL && alpha_prop->value != 0xFFFF) {
+		return false;
+	}
+
+	layer_get_rect(layer, &layer_rect);
+
+	fb_id_prop = layer_get_property(layer, "FB_ID");
+	if (layer->output->implicit_opaque_regions &&
+	    fb_id_prop != NULL && fb_id_prop->value != 0 &&
+	    device_get_fb_info(layer->output->device, fb_id_prop->value,
+			       &fb_info) &&
+	    format_is_opaque(fb_info.format)) {
+		*rect = layer_rect;
+		return true;
+	}
+
+	if (!layer->has_opaque_region) {
+		return false;
+	}
+
+	/* The opaque region can't extend past the layer */
+	*rect = layer->opaque_region;
+	if (rect->x < layer_rect.x) {
+		rect->width -= layer_rect.x - rect->x;
+		rect->x = layer_rect.x;
+	}
+	if (rect->y < layer_rect.y) {
+		rect->height -= layer_rect.y - rect->y;
+		rect->y = layer_rect.y;
+	}
+	if (rect->x + rect->width > layer_rect.x + layer_rect.width) {
+		rect->width = layer_rect.x + layer_rect.width - rect->x;
+	}
+	if (rect->y + rect->height > layer_rect.y + layer_rect.height) {
+		rect->height = layer_rect.y + layer_rect.height - rect->y;
+	}
+	return rect->width > 0 && rect->height > 0;
+}
+
+/* Reads the layer's geometry. Returns false if the layer is rotated or if some
+ * properties are missing. */
+static bool
+layer_get_geometry(struct liftoff_layer *layer,
+		   struct liftoff_layer_geometry *geom)
+{
+	struct liftoff_layer_property *props[8], *rotation_prop;
+	static const char *names[] = {
+		"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+		"SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	};
+	size_t i;
+
+	rotation_prop = layer_get_property(layer, "rotation");
+	if (rotation_prop != NULL && rotation_prop->value != DRM_MODE_ROTATE_0) {
+		return false;
+	}
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		props[i] = layer_get_property(layer, names[i]);
+		if (props[i] == NULL) {
+			return false;
+		}
+	}
+
+	geom->crtc_x = (int32_t)props[0]->value;
+	geom->crtc_y = (int32_t)props[1]->value;
+	geom->crtc_w = props[2]->value;
+	geom->crtc_h = props[3]->value;
+	geom->src_x = props[4]->value;
+	geom->src_y = props[5]->value;
+	geom->src_w = props[6]->value;
+	geom->src_h = props[7]->value;
+	return true;
+}
+
+/* Clips the geometry to the output's mode. Returns false if the layer doesn't
+ * need to or can't be clipped. */
+static bool
+layer_clip_geometry(struct liftoff_layer *layer,
+		    struct liftoff_layer_geometry *geom)
+{
+	struct liftoff_output *output = layer->output;
+	int64_t left, right, top, bottom;
+
+	if (!output->clip_layers || output->width == 0 || output->height == 0) {
+		return false;
+	}
+
+	left = geom->crtc_x < 0 ? -(int64_t)geom->crtc_x : 0;
+	top = geom->crtc_y < 0 ? -(int64_t)geom->crtc_y : 0;
+	right = (int64_t)geom->crtc_x + geom->crtc_w - output->width;
+	bottom = (int64_t)geom->crtc_y + geom->crtc_h - output->height;
+	right = right > 0 ? right : 0;
+	bottom = bottom > 0 ? bottom : 0;
+
+	if (left == 0 && top == 0 && right == 0 && bottom == 0) {
+		return false;
+	}
+	if (left + right >= geom->crtc_w || top + bottom >= geom->crtc_h) {
+		return false; /* off-screen */
+	}
+
+	/* Crop the source proportionally, to keep the same scaling factor */
+	geom->src_x += left * geom->src_w / geom->crtc_w;
+	geom->src_y += top * geom->src_h / geom->crtc_h;
+	geom->src_w -= (left + right) * geom->src_w / geom->crtc_w;
+	geom->src_h -= (top + bottom) * geom->src_h / geom->crtc_h;
+
+	geom->crtc_x += left;
+	geom->crtc_y += top;
+	geom->crtc_w -= left + right;
+	geom->crtc_h -= top + bottom;
+
+	return true;
+}
+
+static size_t
+geometry_get_slices_len(struct liftoff_output *output,
+			const struct liftoff_layer_geometry *geom)
+{
+	if (output->split_width == 0 || geom->crtc_w <= output->split_width) {
+		return 1;
+	}
+	return (geom->crtc_w + output->split_width - 1) / output->split_width;
+}
+
+/* Returns the number of planes needed to display the layer */
+size_t
+layer_get_slices_len(struct liftoff_layer *layer)
+{
+	struct liftoff_layer_geometry geom;
+
+	if (layer->output->split_width == 0 ||
+	    !layer_get_geometry(layer, &geom)) {
+		return 1;
+	}
+	layer_clip_geometry(layer, &geom);
+	return geometry_get_slices_len(layer->output, &geom);
+}
+
+/* Computes the size of the largest part of the layer displayed by a plane,
+ * once clipped and split. Returns false if the geometry is unknown. */
+bool
+layer_get_plane_size(struct liftoff_layer *layer, uint64_t *width,
+		     uint64_t *height)
+{
+	struct liftoff_layer_geometry geom;
+	size_t slices_len;
+
+	if (!layer_get_geometry(layer, &geom)) {
+		return false;
+	}
+	layer_clip_geometry(layer, &geom);
+
+	/* Slices are as wide as their widest one */
+	slices_len = geometry_get_slices_len(layer->output, &geom);
+	*width = (geom.crtc_w + slices_len - 1) / slices_len;
+	*height = geom.crtc_h;
+	return true;
+}
+
+/* Computes the geometry of the part of the layer displayed by a plane: layers
+ * are clipped to the output's mode, then split into slices of equal width.
+ * Returns false if the geometry is the layer's one. */
+bool
+layer_get_slice_geometry(struct liftoff_layer *layer, size_t slice,
+			 struct liftoff_layer_geometry *geom)
+{
+	bool clipped;
+	size_t slices_len;
+	uint64_t x1, x2, src_x1, src_x2;
+
+	if (!layer_get_geometry(layer, geom)) {
+		return false;
+	}
+
+	clipped = layer_clip_geometry(layer, geom);
+
+	slices_len = geometry_get_slices_len(layer->output, geom);
+	if (slices_len == 1) {
+		return clipped;
+	}
+
+	x1 = (uint64_t)geom->crtc_w * slice / slices_len;
+	x2 = (uint64_t)geom->crtc_w * (slice + 1) / slices_len;
+	src_x1 = x1 * geom->src_w / geom->crtc_w;
+	src_x2 = x2 * geom->src_w / geom->crtc_w;
+
+	geom->src_x += src_x1;
+	geom->src_w = src_x2 - src_x1;
+	geom->crtc_x += (int32_t)x1;
+	geom->crtc_w = x2 - x1;
+
+	return true;
+}
+
+/* Computes an unscaled variant of the layer's geometry, cropped to both the
+ * source and the CRTC rectangles so that it stays within the FB and the mode.
+ * Returns false if the geometry is unknown. */
+bool
+layer_get_unscaled_geometry(struct liftoff_layer *layer,
+			    struct liftoff_layer_geometry *geom)
+{
+	uint64_t width, height;
+
+	if (!layer_get_geometry(layer, geom)) {
+		return false;
+	}
+	layer_clip_geometry(layer, geom);
+
+	width = geom->src_w >> 16;
+	height = geom->src_h >> 16;
+	if (width > geom->crtc_w) {
+		width = geom->crtc_w;
+	}
+	if (height > geom->crtc_h) {
+		height = geom->crtc_h;
+	}
+	if (width == 0 || height == 0) {
+		return false;
+	}
+
+	geom->src_w = width << 16;
+	geom->src_h = height << 16;
+	geom->crtc_w = width;
+	geom->crtc_h = height;
+	return true;
+}
+
 bool
 layer_intersects(struct liftoff_layer *a, struct liftoff_layer *b)
 {
@@ -160,33 +533,97 @@ layer_mark_clean(struct liftoff_layer *layer)
 	}
 }
 
-static void
-log_priority(struct liftoff_layer *layer)
+void
+layer_mark_committed(struct liftoff_layer *layer)
 {
-	if (layer->current_priority == layer->pending_priority) {
-		return;
-	}
+	size_t i;
 
-	liftoff_log(LIFTOFF_DEBUG, "Layer %p priority change: %d -> %d",
-		    (void *)layer, layer->current_priority,
-		    layer->pending_priority);
+	/* The committed request was filled with the values as of the last
+	 * apply */
+	for (i = 0; i < layer->props_len; i++) {
+		layer->props[i].committed_value = layer->props[i].prev_value;
+	}
+	layer->committed_props_len = layer->props_len;
+	layer->committed_force_composition = layer->force_composition;
 }
 
 void
-layer_update_priority(struct liftoff_layer *layer, bool make_current)
+layer_rollback(struct liftoff_layer *layer)
+{
+	size_t i;
+
+	/* Changes are now relative to the committed state. Properties added
+	 * since then come last and didn't have a value. */
+	for (i = 0; i < layer->props_len; i++) {
+		layer->props[i].prev_value = layer->props[i].committed_value;
+	}
+	if (layer->props_len != layer->committed_props_len ||
+	    layer->force_composition != layer->committed_force_composition) {
+		layer->changed = true;
+	}
+}
+
+bool
+layer_is_dirty(struct liftoff_layer *layer)
+{
+	size_t i;
+
+	if (layer->props_len != layer->committed_props_len ||
+	    layer->force_composition != layer->committed_force_composition) {
+		return true;
+	}
+
+	for (i = 0; i < layer->props_len; i++) {
+		if (layer->props[i].value != layer->props[i].committed_value) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+layer_is_updated(struct liftoff_layer *layer)
 {
+	size_t i;
 	struct liftoff_layer_property *prop;
 
-	/* TODO: also bump priority when updating other properties */
-	prop = layer_get_property(layer, "FB_ID");
-	if (prop != NULL && prop->prev_value != prop->value) {
-		layer->pending_priority++;
+	/* Updates to the buffer contents, to the damaged region or to the
+	 * geometry all count towards the layer priority */
+	for (i = 0; i < layer->props_len; i++) {
+		prop = &layer->props[i];
+		if (prop->value == prop->prev_value) {
+			continue;
+		}
+		if (strcmp(prop->name, "FB_ID") == 0 ||
+		    strcmp(prop->name, "FB_DAMAGE_CLIPS") == 0 ||
+		    strncmp(prop->name, "CRTC_", 5) == 0 ||
+		    strncmp(prop->name, "SRC_", 4) == 0) {
+			return true;
+		}
 	}
 
-	if (make_current) {
-		log_priority(layer);
-		layer->current_priority = layer->pending_priority;
-		layer->pending_priority = 0;
+	return false;
+}
+
+void
+layer_update_priority(struct liftoff_layer *layer, uint64_t now)
+{
+	double decay;
+
+	/* The priority is an exponentially decaying count of updates. If a
+	 * layer is updated at a constant rate, the priority converges towards
+	 * this rate in Hz, regardless of the refresh rate of the output. */
+	decay = 1;
+	if (now > layer->priority_time) {
+		decay = exp(-(double)(now - layer->priority_time) /
+			    LIFTOFF_PRIORITY_DECAY_NSEC);
+		layer->priority_time = now;
+	}
+
+	layer->priority *= decay;
+	if (layer_is_updated(layer)) {
+		layer->priority += 1e9 / LIFTOFF_PRIORITY_DECAY_NSEC;
 	}
 }
 
@@ -208,6 +645,9 @@ layer_is_visible(struct liftoff_layer *layer)
 	if (alpha_prop != NULL && alpha_prop->value == 0) {
 		return false; /* fully transparent */
 	}
+	if (layer->hidden) {
+		return false;
+	}
 
 	if (layer->force_composition) {
 		return true;
@@ -215,3 +655,10 @@ layer_is_visible(struct liftoff_layer *layer)
 		return layer_has_fb(layer);
 	}
 }
+
+bool
+layer_is_composition(struct liftoff_layer *layer)
+{
+	return layer == layer->output->composition_layer ||
+	       layer->extra_composition;
+}
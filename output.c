@@ -38,11 +38,23 @@ liftoff_output_create(struct liftoff_device *device, uint32_t crtc_id)
 void
 liftoff_output_destroy(struct liftoff_output *output)
 {
+	struct liftoff_plane *plane;
+
 	if (output == NULL) {
 		return;
 	}
 
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->pending_output == output) {
+			plane->pending_output = NULL;
+		}
+	}
 	liftoff_list_remove(&output->link);
+	output_scenes_finish(output);
+	free(output->layers_intersect);
+	free(output->committed_intersect);
+	realloc_policy_finish(output->realloc_policies,
+			      output->realloc_policies_len);
 	free(output);
 }
 
@@ -53,10 +65,243 @@ liftoff_output_set_composition_layer(struct liftoff_output *output,
 	assert(layer->output == output);
 	if (layer != output->composition_layer) {
 		output->layers_changed = true;
+		output->composition_reset = true;
 	}
 	output->composition_layer = layer;
 }
 
+void
+liftoff_output_add_composition_layer(struct liftoff_output *output,
+				     struct liftoff_layer *layer)
+{
+	assert(layer->output == output);
+	if (!layer->extra_composition) {
+		output->layers_changed = true;
+		output->composition_reset = true;
+	}
+	layer->extra_composition = true;
+}
+
+void
+liftoff_output_remove_composition_layer(struct liftoff_output *output,
+					struct liftoff_layer *layer)
+{
+	assert(layer->output == output);
+	if (layer->extra_composition) {
+		output->layers_changed = true;
+		output->composition_reset = true;
+	}
+	layer->extra_composition = false;
+}
+
+void
+liftoff_output_set_trusted_reuse(struct liftoff_output *output, bool trusted)
+{
+	output->trusted_reuse = trusted;
+}
+
+void
+liftoff_output_set_size(struct liftoff_output *output, int width, int height)
+{
+	if (width != output->width || height != output->height) {
+		output->layers_changed = true;
+	}
+	output->width = width;
+	output->height = height;
+}
+
+void
+liftoff_output_set_layer_clipping(struct liftoff_output *output, bool enabled)
+{
+	if (enabled != output->clip_layers) {
+		output->layers_changed = true;
+	}
+	output->clip_layers = enabled;
+}
+
+void
+liftoff_output_set_split_width(struct liftoff_output *output, uint32_t width)
+{
+	if (width != output->split_width) {
+		output->layers_changed = true;
+	}
+	output->split_width = width;
+}
+
+void
+liftoff_output_set_underlays(struct liftoff_output *output, bool enabled)
+{
+	if (enabled != output->underlays) {
+		output->layers_changed = true;
+	}
+	output->underlays = enabled;
+}
+
+void
+liftoff_output_set_implicit_opaque_regions(struct liftoff_output *output,
+					   bool enabled)
+{
+	if (enabled != output->implicit_opaque_regions) {
+		output->layers_changed = true;
+	}
+	output->implicit_opaque_regions = enabled;
+}
+
+static bool
+copy_intersections(bool **dst, size_t *dst_len, const bool *src,
+		   size_t src_len)
+{
+	bool *data;
+
+	if (*dst_len != src_len) {
+		data = realloc(*dst, src_len * sizeof(bool));
+		if (data == NULL && src_len > 0) {
+			liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+			return false;
+		}
+		*dst = data;
+		*dst_len = src_len;
+	}
+	if (src_len > 0) {
+		memcpy(*dst, src, src_len * sizeof(bool));
+	}
+	return true;
+}
+
+static void
+output_mark_committed(struct liftoff_output *output)
+{
+	struct liftoff_plane *plane;
+	struct liftoff_layer *layer;
+
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->pending_output == output) {
+			plane_mark_committed(plane);
+		}
+	}
+	liftoff_list_for_each(layer, &output->layers, link) {
+		layer_mark_committed(layer);
+	}
+
+	output->uncommitted_layers_changed = false;
+	output->has_committed =
+		copy_intersections(&output->committed_intersect,
+				   &output->committed_intersect_len,
+				   output->layers_intersect,
+				   output->layers_intersect_len);
+}
+
+static bool
+output_rollback(struct liftoff_output *output)
+{
+	struct liftoff_plane *plane;
+	struct liftoff_layer *layer;
+
+	if (!output->has_committed) {
+		return false;
+	}
+	if (!copy_intersections(&output->layers_intersect,
+				&output->layers_intersect_len,
+				output->committed_intersect,
+				output->committed_intersect_len)) {
+		return false;
+	}
+
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->layer != NULL && plane->layer->output == output) {
+			plane->layer->plane = NULL;
+			plane->layer = NULL;
+		}
+	}
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		layer = plane->committed_layer;
+		if (layer == NULL || layer->output != output ||
+		    plane->layer != NULL) {
+			continue;
+		}
+		plane_map_layer(plane, layer);
+	}
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		layer_rollback(layer);
+	}
+	if (output->uncommitted_layers_changed) {
+		output->layers_changed = true;
+	}
+
+	return true;
+}
+
+void
+liftoff_output_commit_done(struct liftoff_output *output, int result)
+{
+	struct liftoff_plane *plane;
+	struct liftoff_scene *scene;
+
+	if (result == 0) {
+		output->commit_succeeded = true;
+		output_mark_committed(output);
+		return;
+	}
+
+	output->commit_succeeded = false;
+
+	/* The kernel state is left untouched */
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->pending_output == output) {
+			plane->pending_output = NULL;
+		}
+	}
+
+	scene = output_get_scene(output, output->scene_hash);
+	if (scene != NULL) {
+		output_remove_scene(output, scene);
+	}
+
+	/* Go back to the last configuration known to work. The next apply
+	 * re-uses it with a single test commit, unless layers changed in the
+	 * meantime. */
+	if (output_rollback(output)) {
+		liftoff_log(LIFTOFF_DEBUG, "Atomic commit failed on output %p "
+			    "(%s), rolled back to the last committed plane "
+			    "allocation", (void *)output, strerror(-result));
+		return;
+	}
+
+	/* The request may have been built without a test commit: don't trust
+	 * the current plane allocation anymore */
+	liftoff_log(LIFTOFF_DEBUG, "Atomic commit failed on output %p (%s), "
+		    "plane allocation will be re-computed", (void *)output,
+		    strerror(-result));
+	output->layers_changed = true;
+}
+
+int
+liftoff_output_set_realloc_policy(struct liftoff_output *output,
+				  const char *name,
+				  enum liftoff_realloc_policy_type type,
+				  uint64_t value)
+{
+	return realloc_policy_set(&output->realloc_policies,
+				  &output->realloc_policies_len,
+				  name, type, value);
+}
+
+struct liftoff_realloc_policy *
+output_get_realloc_policy(struct liftoff_output *output, const char *name)
+{
+	struct liftoff_realloc_policy *policy;
+
+	policy = realloc_policy_get(output->realloc_policies,
+				    output->realloc_policies_len, name);
+	if (policy != NULL) {
+		return policy;
+	}
+
+	return realloc_policy_get(output->device->realloc_policies,
+				  output->device->realloc_policies_len, name);
+}
+
 bool
 liftoff_output_needs_composition(struct liftoff_output *output)
 {
@@ -71,6 +316,32 @@ liftoff_output_needs_composition(struct liftoff_output *output)
 	return false;
 }
 
+bool
+liftoff_output_is_dirty(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer;
+
+	if (!output->commit_succeeded || output->layers_changed ||
+	    output->uncommitted_layers_changed) {
+		return true;
+	}
+
+	liftoff_list_for_each(layer, &output->layers, link) {
+		if (layer_is_dirty(layer)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+liftoff_output_set_presentation_time(struct liftoff_output *output,
+				     uint64_t time_nsec)
+{
+	output->presentation_time = time_nsec;
+}
+
 static double
 fp16_to_double(uint64_t val)
 {
@@ -98,7 +369,7 @@ output_log_layers(struct liftoff_output *output)
 			if (!layer_has_fb(layer)) {
 				continue;
 			}
-			is_composition_layer = output->composition_layer == layer;
+			is_composition_layer = layer_is_composition(layer);
 			liftoff_log(LIFTOFF_DEBUG, "  Layer %p%s:",
 				    (void *)layer, is_composition_layer ?
 						   " (composition layer)" : "");
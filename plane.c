@@ -1,3 +1,4 @@
+#include <drm_fourcc.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -32,6 +33,142 @@ guess_plane_zpos_from_type(struct liftoff_device *device, uint32_t plane_id,
 	return 0;
 }
 
+static int
+compare_plane_formats(const void *a, const void *b)
+{
+	const struct liftoff_plane_format *fmt_a = a, *fmt_b = b;
+
+	if (fmt_a->format != fmt_b->format) {
+		return fmt_a->format < fmt_b->format ? -1 : 1;
+	}
+	if (fmt_a->modifier != fmt_b->modifier) {
+		return fmt_a->modifier < fmt_b->modifier ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Checks that an array of `count` elements at `offset` lies within the blob */
+static bool
+blob_has_array(const drmModePropertyBlobRes *blob, uint32_t offset,
+	       uint32_t count, size_t elem_size)
+{
+	return (uint64_t)offset + (uint64_t)count * elem_size <= blob->length;
+}
+
+static int
+plane_parse_in_formats(struct liftoff_plane *plane, int drm_fd,
+		       uint32_t blob_id)
+{
+	drmModePropertyBlobRes *blob;
+	struct drm_format_modifier_blob *data;
+	struct drm_format_modifier *modifiers;
+	uint32_t *formats;
+	size_t i, j, idx, len;
+	bool valid;
+
+	blob = drmModeGetPropertyBlob(drm_fd, blob_id);
+	if (blob == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "drmModeGetPropertyBlob");
+		return -errno;
+	}
+	if (blob->length < sizeof(*data)) {
+		liftoff_log(LIFTOFF_ERROR, "plane %"PRIu32": invalid IN_FORMATS "
+			    "blob", plane->id);
+		drmModeFreePropertyBlob(blob);
+		return -EINVAL;
+	}
+
+	data = blob->data;
+	if (!blob_has_array(blob, data->formats_offset, data->count_formats,
+			    sizeof(uint32_t)) ||
+	    !blob_has_array(blob, data->modifiers_offset, data->count_modifiers,
+			    sizeof(struct drm_format_modifier))) {
+		liftoff_log(LIFTOFF_ERROR, "plane %"PRIu32": truncated "
+			    "IN_FORMATS blob", plane->id);
+		drmModeFreePropertyBlob(blob);
+		return -EINVAL;
+	}
+	formats = (uint32_t *)((char *)data + data->formats_offset);
+	modifiers = (struct drm_format_modifier *)
+		((char *)data + data->modifiers_offset);
+
+	/* Each modifier has a 64-bit mask of the formats it supports, starting
+	 * at the format index `offset`. The mask may extend past the end of
+	 * the format array, but not its set bits. */
+	len = 0;
+	valid = true;
+	for (i = 0; i < data->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			if (!(modifiers[i].formats & (UINT64_C(1) << j))) {
+				continue;
+			}
+			if ((size_t)modifiers[i].offset + j >=
+			    data->count_formats) {
+				valid = false;
+			}
+			len++;
+		}
+	}
+	if (!valid) {
+		liftoff_log(LIFTOFF_ERROR, "plane %"PRIu32": invalid "
+			    "IN_FORMATS modifier format mask", plane->id);
+		drmModeFreePropertyBlob(blob);
+		return -EINVAL;
+	}
+
+	plane->formats = malloc(len * sizeof(plane->formats[0]));
+	if (plane->formats == NULL && len > 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "malloc");
+		drmModeFreePropertyBlob(blob);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < data->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			if (!(modifiers[i].formats & (UINT64_C(1) << j))) {
+				continue;
+			}
+			idx = modifiers[i].offset + j;
+			plane->formats[plane->formats_len].format = formats[idx];
+			plane->formats[plane->formats_len].modifier =
+				modifiers[i].modifier;
+			plane->formats_len++;
+		}
+	}
+
+	qsort(plane->formats, plane->formats_len, sizeof(plane->formats[0]),
+	      compare_plane_formats);
+	plane->formats_have_modifiers = true;
+
+	drmModeFreePropertyBlob(blob);
+	return 0;
+}
+
+static int
+plane_set_legacy_formats(struct liftoff_plane *plane, drmModePlane *drm_plane)
+{
+	size_t i;
+
+	plane->formats = malloc(drm_plane->count_formats *
+				sizeof(plane->formats[0]));
+	if (plane->formats == NULL && drm_plane->count_formats > 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "malloc");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < drm_plane->count_formats; i++) {
+		plane->formats[i].format = drm_plane->formats[i];
+		plane->formats[i].modifier = DRM_FORMAT_MOD_INVALID;
+	}
+	plane->formats_len = drm_plane->count_formats;
+
+	qsort(plane->formats, plane->formats_len, sizeof(plane->formats[0]),
+	      compare_plane_formats);
+	plane->formats_have_modifiers = false;
+
+	return 0;
+}
+
 struct liftoff_plane *
 liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 {
@@ -39,9 +176,10 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 	drmModePlane *drm_plane;
 	drmModeObjectProperties *drm_props;
 	uint32_t i;
-	drmModePropertyRes *drm_prop;
+	struct liftoff_prop_info *prop_info;
 	struct liftoff_plane_property *prop;
 	uint64_t value;
+	uint32_t size_hints_blob_id = 0;
 	bool has_type = false, has_zpos = false;
 
 	liftoff_list_for_each(plane, &device->planes, link) {
@@ -58,6 +196,7 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
 		return NULL;
 	}
+	plane->device = device;
 
 	drm_plane = drmModeGetPlane(device->drm_fd, id);
 	if (drm_plane == NULL) {
@@ -66,12 +205,12 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 	}
 	plane->id = drm_plane->plane_id;
 	plane->possible_crtcs = drm_plane->possible_crtcs;
-	drmModeFreePlane(drm_plane);
 
 	drm_props = drmModeObjectGetProperties(device->drm_fd, id,
 					       DRM_MODE_OBJECT_PLANE);
 	if (drm_props == NULL) {
 		liftoff_log_errno(LIFTOFF_ERROR, "drmModeObjectGetProperties");
+		drmModeFreePlane(drm_plane);
 		return NULL;
 	}
 	plane->props = calloc(drm_props->count_props,
@@ -79,20 +218,22 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 	if (plane->props == NULL) {
 		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
 		drmModeFreeObjectProperties(drm_props);
+		drmModeFreePlane(drm_plane);
 		return NULL;
 	}
 	for (i = 0; i < drm_props->count_props; i++) {
-		drm_prop = drmModeGetProperty(device->drm_fd,
-					      drm_props->props[i]);
-		if (drm_prop == NULL) {
-			liftoff_log_errno(LIFTOFF_ERROR, "drmModeGetProperty");
+		/* Property IDs are shared between planes, only the values are
+		 * per-plane */
+		prop_info = device_get_prop_info(device, drm_props->props[i]);
+		if (prop_info == NULL) {
 			drmModeFreeObjectProperties(drm_props);
+			drmModeFreePlane(drm_plane);
 			return NULL;
 		}
 		prop = &plane->props[i];
-		memcpy(prop->name, drm_prop->name, sizeof(prop->name));
-		prop->id = drm_prop->prop_id;
-		drmModeFreeProperty(drm_prop);
+		memcpy(prop->name, prop_info->name, sizeof(prop->name));
+		prop->id = prop_info->id;
+		prop->info = prop_info;
 		plane->props_len++;
 
 		value = drm_props->prop_values[i];
@@ -102,14 +243,27 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 		} else if (strcmp(prop->name, "zpos") == 0) {
 			plane->zpos = value;
 			has_zpos = true;
+		} else if (strcmp(prop->name, "IN_FORMATS") == 0) {
+			/* Not fatal: we'll rely on test commits instead */
+			plane_parse_in_formats(plane, device->drm_fd, value);
+		} else if (strcmp(prop->name, "SIZE_HINTS") == 0) {
+			size_hints_blob_id = value;
 		}
 	}
 	drmModeFreeObjectProperties(drm_props);
 
+	/* Without IN_FORMATS, only the list of formats is known */
+	if (!plane->formats_have_modifiers) {
+		plane_set_legacy_formats(plane, drm_plane);
+	}
+	drmModeFreePlane(drm_plane);
+
 	if (!has_type) {
 		liftoff_log(LIFTOFF_ERROR,
 			    "plane %"PRIu32" is missing the 'type' property",
 			    plane->id);
+		free(plane->formats);
+		free(plane->props);
 		free(plane);
 		errno = EINVAL;
 		return NULL;
@@ -118,6 +272,13 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 							 plane->type);
 	}
 
+	plane_caps_init(&plane->caps, device->drm_fd, plane->type);
+	plane->caps.scaling_unsupported =
+		!device_plane_type_can_scale(device, plane->type);
+	/* Not fatal: we'll rely on test commits instead */
+	plane_caps_parse_size_hints(&plane->caps, device->drm_fd,
+				    size_hints_blob_id);
+
 	/* During plane allocation, we will use the plane list order to fill
 	 * planes with FBs. Primary planes need to be filled first, then planes
 	 * far from the primary planes, then planes closer and closer to the
@@ -138,17 +299,26 @@ liftoff_plane_create(struct liftoff_device *device, uint32_t id)
 		}
 	}
 
+	/* The plane topology changed */
+	device_cache_invalidate(device);
+
 	return plane;
 }
 
 void
 liftoff_plane_destroy(struct liftoff_plane *plane)
 {
-	if (plane->layer != NULL) {
+	if (plane->layer != NULL && plane->layer->plane == plane) {
 		plane->layer->plane = NULL;
 	}
 	liftoff_list_remove(&plane->link);
+	plane_caps_finish(&plane->caps);
+
+	/* The plane topology changed */
+	device_cache_invalidate(plane->device);
+
 	free(plane->props);
+	free(plane->formats);
 	free(plane);
 }
 
@@ -158,6 +328,52 @@ liftoff_plane_get_id(struct liftoff_plane *plane)
 	return plane->id;
 }
 
+void
+liftoff_plane_set_scaling_supported(struct liftoff_plane *plane, bool supported)
+{
+	plane->caps.scaling_unsupported = !supported;
+}
+
+bool
+plane_supports_fb(struct liftoff_plane *plane,
+		  const struct liftoff_fb_info *fb_info)
+{
+	size_t lo, hi, mid, i;
+	const struct liftoff_plane_format *fmt;
+
+	if (plane->formats_len == 0) {
+		return true; /* Unknown, let the test commit decide */
+	}
+
+	/* Find the first entry with the FB's format */
+	lo = 0;
+	hi = plane->formats_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (plane->formats[mid].format < fb_info->format) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (i = lo; i < plane->formats_len; i++) {
+		fmt = &plane->formats[i];
+		if (fmt->format != fb_info->format) {
+			break;
+		}
+		/* FBs without an explicit modifier can use any modifier the
+		 * driver picks */
+		if (!plane->formats_have_modifiers ||
+		    fb_info->modifier == DRM_FORMAT_MOD_INVALID ||
+		    fmt->modifier == fb_info->modifier) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static struct liftoff_plane_property *
 plane_get_property(struct liftoff_plane *plane, const char *name)
 {
@@ -173,10 +389,18 @@ plane_get_property(struct liftoff_plane *plane, const char *name)
 
 static int
 plane_set_prop(struct liftoff_plane *plane, drmModeAtomicReq *req,
-	       struct liftoff_plane_property *prop, uint64_t value)
+	       struct liftoff_plane_property *prop, uint64_t value, bool force)
 {
 	int ret;
 
+	prop->pending_value = value;
+	prop->pending_known = true;
+
+	/* KMS applies atomic requests on top of the current state */
+	if (!force && prop->committed_known && prop->committed_value == value) {
+		return 0;
+	}
+
 	ret = drmModeAtomicAddProperty(req, plane->id, prop->id, value);
 	if (ret < 0) {
 		liftoff_log(LIFTOFF_ERROR, "drmModeAtomicAddProperty: %s",
@@ -189,7 +413,7 @@ plane_set_prop(struct liftoff_plane *plane, drmModeAtomicReq *req,
 
 static int
 set_plane_prop_str(struct liftoff_plane *plane, drmModeAtomicReq *req,
-		   const char *name, uint64_t value)
+		   const char *name, uint64_t value, bool force)
 {
 	struct liftoff_plane_property *prop;
 
@@ -201,29 +425,90 @@ set_plane_prop_str(struct liftoff_plane *plane, drmModeAtomicReq *req,
 		return -EINVAL;
 	}
 
-	return plane_set_prop(plane, req, prop, value);
+	return plane_set_prop(plane, req, prop, value, force);
+}
+
+bool
+plane_has_property(struct liftoff_plane *plane, const char *name)
+{
+	return plane_get_property(plane, name) != NULL;
 }
 
 int
-plane_apply(struct liftoff_plane *plane, struct liftoff_layer *layer,
-	    drmModeAtomicReq *req)
+plane_set_damage_clips(struct liftoff_plane *plane, drmModeAtomicReq *req,
+		       uint32_t blob_id)
+{
+	return set_plane_prop_str(plane, req, "FB_DAMAGE_CLIPS", blob_id, true);
+}
+
+static bool
+is_prop_always_set(const char *name)
+{
+	/* FB_ID is set even if unchanged, so that the plane is part of the
+	 * commit (e.g. for page-flip events). The kernel resets IN_FENCE_FD
+	 * and FB_DAMAGE_CLIPS after each commit. */
+	return strcmp(name, "FB_ID") == 0 ||
+	       strcmp(name, "IN_FENCE_FD") == 0 ||
+	       strcmp(name, "FB_DAMAGE_CLIPS") == 0;
+}
+
+static uint64_t
+get_clipped_value(const struct liftoff_layer_geometry *geom, const char *name,
+		  uint64_t value)
+{
+	if (strcmp(name, "CRTC_X") == 0) {
+		return (uint64_t)geom->crtc_x;
+	} else if (strcmp(name, "CRTC_Y") == 0) {
+		return (uint64_t)geom->crtc_y;
+	} else if (strcmp(name, "CRTC_W") == 0) {
+		return geom->crtc_w;
+	} else if (strcmp(name, "CRTC_H") == 0) {
+		return geom->crtc_h;
+	} else if (strcmp(name, "SRC_X") == 0) {
+		return geom->src_x;
+	} else if (strcmp(name, "SRC_Y") == 0) {
+		return geom->src_y;
+	} else if (strcmp(name, "SRC_W") == 0) {
+		return geom->src_w;
+	} else if (strcmp(name, "SRC_H") == 0) {
+		return geom->src_h;
+	}
+	return value;
+}
+
+/* Sets the layer's properties on the plane, with the CRTC_* and SRC_*
+ * properties taken from `geom` if not NULL */
+static int
+plane_apply_geometry(struct liftoff_plane *plane, struct liftoff_layer *layer,
+		     const struct liftoff_layer_geometry *geom,
+		     drmModeAtomicReq *req)
 {
 	int cursor, ret;
 	size_t i;
 	struct liftoff_layer_property *layer_prop;
 	struct liftoff_plane_property *plane_prop;
+	uint64_t value;
 
 	cursor = drmModeAtomicGetCursor(req);
 
+	/* Properties which aren't set keep their current value */
+	for (i = 0; i < plane->props_len; i++) {
+		plane->props[i].pending_value = plane->props[i].committed_value;
+		plane->props[i].pending_known = plane->props[i].committed_known;
+	}
+
 	if (layer == NULL) {
-		ret = set_plane_prop_str(plane, req, "FB_ID", 0);
+		ret = set_plane_prop_str(plane, req, "FB_ID", 0, false);
 		if (ret != 0) {
 			return ret;
 		}
-		return set_plane_prop_str(plane, req, "CRTC_ID", 0);
+		return set_plane_prop_str(plane, req, "CRTC_ID", 0, false);
 	}
 
-	ret = set_plane_prop_str(plane, req, "CRTC_ID", layer->output->crtc_id);
+	/* The request may already disable the plane, see
+	 * liftoff_output_apply */
+	ret = set_plane_prop_str(plane, req, "CRTC_ID", layer->output->crtc_id,
+				 true);
 	if (ret != 0) {
 		return ret;
 	}
@@ -250,7 +535,21 @@ plane_apply(struct liftoff_plane *plane, struct liftoff_layer *layer,
 			return -EINVAL;
 		}
 
-		ret = plane_set_prop(plane, req, plane_prop, layer_prop->value);
+		value = layer_prop->value;
+		if (geom != NULL) {
+			value = get_clipped_value(geom, layer_prop->name, value);
+		}
+
+		if (!prop_info_is_valid(plane_prop->info, value)) {
+			liftoff_log(LIFTOFF_DEBUG,
+				    "plane %"PRIu32" doesn't support %s = "
+				    "%"PRIu64, plane->id, plane_prop->name, value);
+			drmModeAtomicSetCursor(req, cursor);
+			return -EINVAL;
+		}
+
+		ret = plane_set_prop(plane, req, plane_prop, value,
+				     is_prop_always_set(layer_prop->name));
 		if (ret != 0) {
 			drmModeAtomicSetCursor(req, cursor);
 			return ret;
@@ -259,3 +558,63 @@ plane_apply(struct liftoff_plane *plane, struct liftoff_layer *layer,
 
 	return 0;
 }
+
+int
+plane_apply(struct liftoff_plane *plane, struct liftoff_layer *layer,
+	    size_t slice, drmModeAtomicReq *req)
+{
+	struct liftoff_layer_geometry geom;
+	bool clipped;
+
+	clipped = layer != NULL &&
+		  layer_get_slice_geometry(layer, slice, &geom);
+	return plane_apply_geometry(plane, layer, clipped ? &geom : NULL, req);
+}
+
+/* Applies the layer without scaling, see layer_get_unscaled_geometry. Returns
+ * -EINVAL if the layer's geometry is unknown. */
+int
+plane_apply_unscaled(struct liftoff_plane *plane, struct liftoff_layer *layer,
+		     drmModeAtomicReq *req)
+{
+	struct liftoff_layer_geometry geom;
+
+	if (!layer_get_unscaled_geometry(layer, &geom)) {
+		return -EINVAL;
+	}
+	return plane_apply_geometry(plane, layer, &geom, req);
+}
+
+/* Split layers are mapped to several planes, in list order: the layer's plane
+ * is the one displaying the first slice */
+void
+plane_map_layer(struct liftoff_plane *plane, struct liftoff_layer *layer)
+{
+	struct liftoff_plane *other;
+
+	plane->layer = layer;
+	plane->slice = 0;
+	if (layer->plane == NULL) {
+		layer->plane = plane;
+		return;
+	}
+
+	liftoff_list_for_each(other, &layer->output->device->planes, link) {
+		if (other != plane && other->layer == layer) {
+			plane->slice++;
+		}
+	}
+}
+
+void
+plane_mark_committed(struct liftoff_plane *plane)
+{
+	size_t i;
+
+	for (i = 0; i < plane->props_len; i++) {
+		plane->props[i].committed_value = plane->props[i].pending_value;
+		plane->props[i].committed_known = plane->props[i].pending_known;
+	}
+	plane->committed_layer = plane->pending_layer;
+	plane->pending_output = NULL;
+}
@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+struct liftoff_realloc_policy *
+realloc_policy_get(struct liftoff_realloc_policy *policies, size_t policies_len,
+		   const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < policies_len; i++) {
+		if (strcmp(policies[i].name, name) == 0) {
+			return &policies[i];
+		}
+	}
+	return NULL;
+}
+
+int
+realloc_policy_set(struct liftoff_realloc_policy **policies_ptr,
+		   size_t *policies_len_ptr, const char *name,
+		   enum liftoff_realloc_policy_type type, uint64_t value)
+{
+	struct liftoff_realloc_policy *policies, *policy;
+	uint64_t *values;
+
+	switch (type) {
+	case LIFTOFF_REALLOC_NEVER:
+	case LIFTOFF_REALLOC_ALWAYS:
+	case LIFTOFF_REALLOC_ON_VALUE:
+		break;
+	default:
+		liftoff_log(LIFTOFF_ERROR, "invalid reallocation policy %d",
+			    type);
+		return -EINVAL;
+	}
+
+	policy = realloc_policy_get(*policies_ptr, *policies_len_ptr, name);
+	if (policy == NULL) {
+		policies = realloc(*policies_ptr, (*policies_len_ptr + 1)
+				   * sizeof(struct liftoff_realloc_policy));
+		if (policies == NULL) {
+			liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+			return -ENOMEM;
+		}
+		*policies_ptr = policies;
+		(*policies_len_ptr)++;
+
+		policy = &policies[*policies_len_ptr - 1];
+		memset(policy, 0, sizeof(*policy));
+		strncpy(policy->name, name, sizeof(policy->name) - 1);
+	}
+
+	if (type != LIFTOFF_REALLOC_ON_VALUE ||
+	    policy->type != LIFTOFF_REALLOC_ON_VALUE) {
+		free(policy->values);
+		policy->values = NULL;
+		policy->values_len = 0;
+	}
+	policy->type = type;
+
+	if (type != LIFTOFF_REALLOC_ON_VALUE) {
+		return 0;
+	}
+
+	values = realloc(policy->values,
+			 (policy->values_len + 1) * sizeof(uint64_t));
+	if (values == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+		return -ENOMEM;
+	}
+	policy->values = values;
+	policy->values[policy->values_len] = value;
+	policy->values_len++;
+
+	return 0;
+}
+
+void
+realloc_policy_finish(struct liftoff_realloc_policy *policies,
+		      size_t policies_len)
+{
+	size_t i;
+
+	for (i = 0; i < policies_len; i++) {
+		free(policies[i].values);
+	}
+	free(policies);
+}
+
+bool
+realloc_policy_needs_realloc(struct liftoff_realloc_policy *policy,
+			     uint64_t prev_value, uint64_t value)
+{
+	size_t i;
+
+	switch (policy->type) {
+	case LIFTOFF_REALLOC_NEVER:
+		return false;
+	case LIFTOFF_REALLOC_ALWAYS:
+		return true;
+	case LIFTOFF_REALLOC_ON_VALUE:
+		for (i = 0; i < policy->values_len; i++) {
+			if (prev_value == policy->values[i] ||
+			    value == policy->values[i]) {
+				return true;
+			}
+		}
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,69 @@
+#include <string.h>
+#include <xf86drm.h>
+#include "private.h"
+
+#define PLANE_TYPE_BIT(type) (UINT32_C(1) << (type))
+
+/* Known driver constraints. Users can override them with
+ * liftoff_device_set_primary_plane_required and
+ * liftoff_plane_set_scaling_supported. */
+static const struct liftoff_driver_profile driver_profiles[] = {
+	{
+		/* Cursor planes never scale, see intel_check_cursor */
+		.driver = "i915",
+		.primary_plane_required = false,
+		.no_scaling_plane_types = PLANE_TYPE_BIT(DRM_PLANE_TYPE_CURSOR),
+	},
+	{
+		/* The display core rejects CRTCs enabled without their
+		 * primary plane */
+		.driver = "amdgpu",
+		.primary_plane_required = true,
+		.no_scaling_plane_types = 0,
+	},
+};
+
+static const struct liftoff_driver_profile default_profile = {
+	.driver = NULL,
+	.primary_plane_required = false,
+	.no_scaling_plane_types = 0,
+};
+
+void
+device_init_profile(struct liftoff_device *device)
+{
+	const struct liftoff_driver_profile *profile;
+	drmVersion *version;
+	size_t i;
+
+	profile = &default_profile;
+
+	version = drmGetVersion(device->drm_fd);
+	if (version == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "drmGetVersion");
+	} else {
+		for (i = 0; i < sizeof(driver_profiles) /
+				sizeof(driver_profiles[0]); i++) {
+			if (strcmp(version->name, driver_profiles[i].driver) == 0) {
+				profile = &driver_profiles[i];
+				break;
+			}
+		}
+		liftoff_log(LIFTOFF_DEBUG, "Using %s driver profile for %s",
+			    profile->driver != NULL ? profile->driver : "default",
+			    version->name);
+		drmFreeVersion(version);
+	}
+
+	device->primary_plane_required = profile->primary_plane_required;
+	device->no_scaling_plane_types = profile->no_scaling_plane_types;
+}
+
+bool
+device_plane_type_can_scale(struct liftoff_device *device, uint32_t type)
+{
+	if (type >= 32) {
+		return true;
+	}
+	return !(device->no_scaling_plane_types & PLANE_TYPE_BIT(type));
+}
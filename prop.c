@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+static struct liftoff_prop_info *
+prop_info_create(drmModePropertyRes *drm_prop)
+{
+	struct liftoff_prop_info *info;
+	int i;
+
+	info = calloc(1, sizeof(*info));
+	if (info == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "calloc");
+		return NULL;
+	}
+
+	info->id = drm_prop->prop_id;
+	memcpy(info->name, drm_prop->name, sizeof(info->name));
+	info->flags = drm_prop->flags;
+
+	if (drm_property_type_is(drm_prop, DRM_MODE_PROP_RANGE) ||
+	    drm_property_type_is(drm_prop, DRM_MODE_PROP_SIGNED_RANGE)) {
+		if (drm_prop->count_values == 2) {
+			info->min = drm_prop->values[0];
+			info->max = drm_prop->values[1];
+		} else {
+			/* Malformed range, don't validate values */
+			info->flags &= ~(DRM_MODE_PROP_RANGE |
+					 DRM_MODE_PROP_EXTENDED_TYPE);
+		}
+	} else if (drm_property_type_is(drm_prop, DRM_MODE_PROP_ENUM)) {
+		info->enum_values = malloc(drm_prop->count_enums *
+					   sizeof(info->enum_values[0]));
+		if (info->enum_values == NULL && drm_prop->count_enums > 0) {
+			liftoff_log_errno(LIFTOFF_ERROR, "malloc");
+			free(info);
+			return NULL;
+		}
+		for (i = 0; i < drm_prop->count_enums; i++) {
+			info->enum_values[i] = drm_prop->enums[i].value;
+		}
+		info->enum_values_len = drm_prop->count_enums;
+	} else if (drm_property_type_is(drm_prop, DRM_MODE_PROP_BITMASK)) {
+		/* Bitmask enum values are bit indices */
+		for (i = 0; i < drm_prop->count_enums; i++) {
+			if (drm_prop->enums[i].value < 64) {
+				info->bitmask |=
+					UINT64_C(1) << drm_prop->enums[i].value;
+			}
+		}
+	}
+
+	return info;
+}
+
+void
+prop_info_destroy(struct liftoff_prop_info *info)
+{
+	if (info == NULL) {
+		return;
+	}
+	free(info->enum_values);
+	free(info);
+}
+
+bool
+prop_info_is_valid(const struct liftoff_prop_info *info, uint64_t value)
+{
+	size_t i;
+
+	if (info->flags & DRM_MODE_PROP_RANGE) {
+		return value >= info->min && value <= info->max;
+	} else if ((info->flags & DRM_MODE_PROP_EXTENDED_TYPE) ==
+		   DRM_MODE_PROP_SIGNED_RANGE) {
+		return (int64_t)value >= (int64_t)info->min &&
+		       (int64_t)value <= (int64_t)info->max;
+	} else if (info->flags & DRM_MODE_PROP_ENUM) {
+		for (i = 0; i < info->enum_values_len; i++) {
+			if (info->enum_values[i] == value) {
+				return true;
+			}
+		}
+		return false;
+	} else if (info->flags & DRM_MODE_PROP_BITMASK) {
+		return (value & ~info->bitmask) == 0;
+	}
+
+	return true;
+}
+
+struct liftoff_prop_info *
+device_get_prop_info(struct liftoff_device *device, uint32_t prop_id)
+{
+	struct liftoff_prop_info **prop_infos, *info;
+	drmModePropertyRes *drm_prop;
+	size_t i;
+
+	for (i = 0; i < device->prop_infos_len; i++) {
+		if (device->prop_infos[i]->id == prop_id) {
+			return device->prop_infos[i];
+		}
+	}
+
+	drm_prop = drmModeGetProperty(device->drm_fd, prop_id);
+	if (drm_prop == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "drmModeGetProperty");
+		return NULL;
+	}
+	info = prop_info_create(drm_prop);
+	drmModeFreeProperty(drm_prop);
+	if (info == NULL) {
+		return NULL;
+	}
+
+	prop_infos = realloc(device->prop_infos, (device->prop_infos_len + 1) *
+			     sizeof(device->prop_infos[0]));
+	if (prop_infos == NULL) {
+		liftoff_log_errno(LIFTOFF_ERROR, "realloc");
+		prop_info_destroy(info);
+		return NULL;
+	}
+	device->prop_infos = prop_infos;
+	device->prop_infos[device->prop_infos_len] = info;
+	device->prop_infos_len++;
+
+	return info;
+}
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include "private.h"
+
+/* Scene cache
+ *
+ * Users often switch back and forth between a few scenes (e.g. a video played
+ * fullscreen and windowed). Finding a plane allocation for a scene requires
+ * many test commits, so we remember the allocations found for the last few
+ * scenes. When a scene shows up again, its allocation only needs to be
+ * checked with a single test commit.
+ *
+ * Scenes are identified by a hash of everything the allocation depends on:
+ * the planes available to the output and the state of the visible layers.
+ * FB IDs change on every frame, so FBs are identified by their format,
+ * modifier and size instead.
+ */
+
+static uint64_t
+hash_fb(struct liftoff_device *device, uint64_t hash, uint32_t fb_id)
+{
+	struct liftoff_fb_info info;
+
+	if (!device_get_fb_info(device, fb_id, &info)) {
+		return hash_u64(hash, fb_id);
+	}
+
+	hash = hash_u64(hash, info.format);
+	hash = hash_u64(hash, info.modifier);
+	hash = hash_u64(hash, info.width);
+	return hash_u64(hash, info.height);
+}
+
+static uint64_t
+hash_layer(struct liftoff_layer *layer, uint64_t hash)
+{
+	struct liftoff_layer_property *prop;
+	size_t i;
+
+	hash = hash_u64(hash, layer->force_composition);
+	hash = hash_u64(hash, layer->group_composited);
+	hash = hash_u64(hash, layer == layer->output->composition_layer);
+	hash = hash_u64(hash, layer->extra_composition);
+	hash = hash_u64(hash, layer->has_opaque_region);
+	if (layer->has_opaque_region) {
+		hash = hash_u64(hash, (uint64_t)layer->opaque_region.x);
+		hash = hash_u64(hash, (uint64_t)layer->opaque_region.y);
+		hash = hash_u64(hash, (uint64_t)layer->opaque_region.width);
+		hash = hash_u64(hash, (uint64_t)layer->opaque_region.height);
+	}
+
+	for (i = 0; i < layer->props_len; i++) {
+		prop = &layer->props[i];
+
+		/* These don't affect the plane allocation */
+		if (strcmp(prop->name, "IN_FENCE_FD") == 0 ||
+		    strcmp(prop->name, "FB_DAMAGE_CLIPS") == 0) {
+			continue;
+		}
+
+		hash = hash_str(hash, prop->name);
+		if (strcmp(prop->name, "FB_ID") == 0) {
+			hash = hash_fb(layer->output->device, hash,
+				       prop->value);
+		} else {
+			hash = hash_u64(hash, prop->value);
+		}
+	}
+
+	return hash;
+}
+
+static int
+output_get_layer_index(struct liftoff_output *output,
+		       struct liftoff_layer *layer)
+{
+	struct liftoff_layer *other;
+	int i;
+
+	i = 0;
+	liftoff_list_for_each(other, &output->layers, link) {
+		if (other == layer) {
+			return i;
+		}
+		i++;
+	}
+
+	abort(); /* unreachable */
+}
+
+/* Layers are hashed in list order. The order the allocation algorithm tries
+ * them in depends on their priority, which changes continuously: layers with
+ * similar update rates would swap places from frame to frame. Priorities are
+ * checked when a cached scene is re-used instead, see scene_is_applicable. */
+uint64_t
+output_scene_hash(struct liftoff_output *output)
+{
+	struct liftoff_plane *plane;
+	struct liftoff_layer *layer;
+	uint64_t hash;
+
+	hash = LIFTOFF_HASH_INIT;
+
+	/* Constraints which can be changed by the user */
+	hash = hash_u64(hash, (uint64_t)output->device->max_overlay_planes);
+	hash = hash_u64(hash, output->device->primary_plane_required);
+	hash = hash_u64(hash, output->clip_layers);
+	hash = hash_u64(hash, output->split_width);
+	hash = hash_u64(hash, output->underlays);
+	hash = hash_u64(hash, output->implicit_opaque_regions);
+	hash = hash_u64(hash, (uint64_t)output->width);
+	hash = hash_u64(hash, (uint64_t)output->height);
+
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->layer != NULL ||
+		    (plane->possible_crtcs & (1 << output->crtc_index)) == 0) {
+			continue;
+		}
+		hash = hash_u64(hash, plane->id);
+		hash = hash_u64(hash, plane->caps.scaling_unsupported);
+	}
+
+	hash = hash_u64(hash, liftoff_list_length(&output->layers));
+	liftoff_list_for_each(layer, &output->layers, link) {
+		hash = hash_u64(hash, layer_is_visible(layer));
+		if (!layer_is_visible(layer)) {
+			continue;
+		}
+		hash = hash_layer(layer, hash);
+	}
+
+	return hash;
+}
+
+struct liftoff_scene *
+output_get_scene(struct liftoff_output *output, uint64_t hash)
+{
+	struct liftoff_scene *scene;
+	size_t i;
+
+	output->scenes_clock++;
+
+	for (i = 0; i < output->scenes_len; i++) {
+		scene = &output->scenes[i];
+		if (scene->hash == hash) {
+			scene->last_used = output->scenes_clock;
+			return scene;
+		}
+	}
+
+	return NULL;
+}
+
+void
+output_add_scene(struct liftoff_output *output, uint64_t hash)
+{
+	struct liftoff_scene *scene;
+	struct liftoff_plane *plane;
+	size_t i, planes_len;
+	int *plane_layers;
+
+	planes_len = liftoff_list_length(&output->device->planes);
+	plane_layers = malloc(planes_len * sizeof(plane_layers[0]));
+	if (plane_layers == NULL && planes_len > 0) {
+		liftoff_log_errno(LIFTOFF_ERROR, "malloc");
+		return;
+	}
+
+	i = 0;
+	liftoff_list_for_each(plane, &output->device->planes, link) {
+		if (plane->layer != NULL && plane->layer->output == output) {
+			plane_layers[i] = output_get_layer_index(output,
+								 plane->layer);
+		} else {
+			plane_layers[i] = -1;
+		}
+		i++;
+	}
+
+	scene = output_get_scene(output, hash);
+	if (scene == NULL && output->scenes_len < LIFTOFF_SCENE_CACHE_SIZE) {
+		scene = &output->scenes[output->scenes_len];
+		output->scenes_len++;
+	} else {
+		if (scene == NULL) {
+			/* Evict the least recently used scene */
+			scene = &output->scenes[0];
+			for (i = 1; i < output->scenes_len; i++) {
+				if (output->scenes[i].last_used <
+				    scene->last_used) {
+					scene = &output->scenes[i];
+				}
+			}
+		}
+		free(scene->plane_layers);
+	}
+
+	scene->hash = hash;
+	scene->last_used = output->scenes_clock;
+	scene->plane_layers = plane_layers;
+	scene->planes_len = planes_len;
+}
+
+void
+output_remove_scene(struct liftoff_output *output, struct liftoff_scene *scene)
+{
+	size_t i;
+
+	i = scene - output->scenes;
+	free(scene->plane_layers);
+	output->scenes_len--;
+	memmove(&output->scenes[i], &output->scenes[i + 1],
+		(output->scenes_len - i) * sizeof(output->scenes[0]));
+}
+
+void
+output_scenes_finish(struct liftoff_output *output)
+{
+	size_t i;
+
+	for (i = 0; i < output->scenes_len; i++) {
+		free(output->scenes[i].plane_layers);
+	}
+	output->scenes_len = 0;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <drm_fourcc.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -7,22 +8,33 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <xf86drm.h>
 #include "libdrm_mock.h"
 
 #define MAX_PLANES 64
 #define MAX_LAYERS 512
 #define MAX_PLANE_PROPS 64
 #define MAX_REQ_PROPS 1024
+#define MAX_BLOBS 64
 
 uint32_t liftoff_mock_drm_crtc_id = 0xCC000000;
+uint32_t liftoff_mock_drm_second_crtc_id = 0;
 size_t liftoff_mock_commit_count = 0;
 bool liftoff_mock_require_primary_plane = false;
+size_t liftoff_mock_get_property_count = 0;
+const char *liftoff_mock_drm_driver_name = "mock";
+uint64_t liftoff_mock_drm_cursor_width = 0;
+uint64_t liftoff_mock_drm_cursor_height = 0;
+int liftoff_mock_drm_mode_width = 0;
+int liftoff_mock_drm_mode_height = 0;
+uint64_t liftoff_mock_drm_max_plane_width = 0;
 
 struct liftoff_mock_plane {
 	uint32_t id;
 	struct liftoff_layer *compatible_layers[MAX_LAYERS];
 	bool enabled_props[MAX_PLANE_PROPS];
 	uint64_t prop_values[MAX_PLANE_PROPS];
+	uint64_t max_downscale; /* 16.16 fixed point, zero if unlimited */
 };
 
 struct liftoff_mock_prop {
@@ -30,6 +42,12 @@ struct liftoff_mock_prop {
 	uint64_t value;
 };
 
+struct liftoff_mock_fb {
+	struct liftoff_layer *layer;
+	uint32_t format;
+	uint64_t modifier;
+};
+
 struct _drmModeAtomicReq {
 	struct liftoff_mock_prop props[MAX_REQ_PROPS];
 	int cursor;
@@ -37,26 +55,35 @@ struct _drmModeAtomicReq {
 
 static int mock_pipe[2] = {-1, -1};
 static struct liftoff_mock_plane mock_planes[MAX_PLANES];
-static struct liftoff_layer *mock_fbs[MAX_LAYERS];
+static struct liftoff_mock_fb mock_fbs[MAX_LAYERS];
+static drmModePropertyBlobRes mock_blobs[MAX_BLOBS];
 
 enum plane_prop {
 	PLANE_TYPE,
 	PLANE_FB_ID,
 	PLANE_CRTC_ID,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
 };
 
 static const char *basic_plane_props[] = {
 	[PLANE_TYPE] = "type",
 	[PLANE_FB_ID] = "FB_ID",
 	[PLANE_CRTC_ID] = "CRTC_ID",
-	"CRTC_X",
-	"CRTC_Y",
-	"CRTC_W",
-	"CRTC_H",
-	"SRC_X",
-	"SRC_Y",
-	"SRC_W",
-	"SRC_H",
+	[PLANE_CRTC_X] = "CRTC_X",
+	[PLANE_CRTC_Y] = "CRTC_Y",
+	[PLANE_CRTC_W] = "CRTC_W",
+	[PLANE_CRTC_H] = "CRTC_H",
+	[PLANE_SRC_X] = "SRC_X",
+	[PLANE_SRC_Y] = "SRC_Y",
+	[PLANE_SRC_W] = "SRC_W",
+	[PLANE_SRC_H] = "SRC_H",
 };
 
 static const size_t basic_plane_props_len = sizeof(basic_plane_props) /
@@ -186,15 +213,27 @@ liftoff_mock_plane_add_compatible_layer(struct liftoff_mock_plane *plane,
 
 uint32_t
 liftoff_mock_drm_create_fb(struct liftoff_layer *layer)
+{
+	return liftoff_mock_drm_create_fb_with_format(layer,
+						      DRM_FORMAT_XRGB8888,
+						      DRM_FORMAT_MOD_LINEAR);
+}
+
+uint32_t
+liftoff_mock_drm_create_fb_with_format(struct liftoff_layer *layer,
+				       uint32_t format, uint64_t modifier)
 {
 	size_t i;
 
 	i = 0;
-	while (mock_fbs[i] != 0) {
+	while (mock_fbs[i].layer != NULL) {
 		i++;
 	}
+	assert(i < MAX_LAYERS);
 
-	mock_fbs[i] = layer;
+	mock_fbs[i].layer = layer;
+	mock_fbs[i].format = format;
+	mock_fbs[i].modifier = modifier;
 
 	return 0xFB000000 + i;
 }
@@ -218,8 +257,8 @@ mock_atomic_req_get_property(drmModeAtomicReq *req, uint32_t obj_id,
 	return false;
 }
 
-static struct liftoff_layer *
-mock_fb_get_layer(uint32_t fb_id)
+static struct liftoff_mock_fb *
+mock_fb_get(uint32_t fb_id)
 {
 	size_t i;
 
@@ -232,7 +271,22 @@ mock_fb_get_layer(uint32_t fb_id)
 	i = fb_id & 0x00FFFFFF;
 	assert(i < MAX_LAYERS);
 
-	return mock_fbs[i];
+	if (mock_fbs[i].layer == NULL) {
+		return NULL;
+	}
+	return &mock_fbs[i];
+}
+
+static struct liftoff_layer *
+mock_fb_get_layer(uint32_t fb_id)
+{
+	struct liftoff_mock_fb *fb;
+
+	fb = mock_fb_get(fb_id);
+	if (fb == NULL) {
+		return NULL;
+	}
+	return fb->layer;
 }
 
 struct liftoff_layer *
@@ -254,6 +308,13 @@ get_prop_index(uint32_t id)
 	return i;
 }
 
+void
+liftoff_mock_plane_set_max_downscale(struct liftoff_mock_plane *plane,
+				     uint64_t max_downscale)
+{
+	plane->max_downscale = max_downscale;
+}
+
 uint32_t
 liftoff_mock_plane_add_property(struct liftoff_mock_plane *plane,
 				const drmModePropertyRes *prop)
@@ -268,6 +329,94 @@ liftoff_mock_plane_add_property(struct liftoff_mock_plane *plane,
 	return prop_id;
 }
 
+uint64_t
+liftoff_mock_plane_get_property(struct liftoff_mock_plane *plane,
+				uint32_t prop_id)
+{
+	return plane->prop_values[get_prop_index(prop_id)];
+}
+
+static uint32_t
+mock_create_blob(const void *data, size_t size)
+{
+	drmModePropertyBlobRes *blob;
+	size_t i;
+
+	i = 0;
+	while (mock_blobs[i].id != 0) {
+		i++;
+	}
+	assert(i < MAX_BLOBS);
+
+	blob = &mock_blobs[i];
+	blob->id = 0xBB000000 + i;
+	blob->length = size;
+	blob->data = malloc(size);
+	assert(blob->data != NULL);
+	memcpy(blob->data, data, size);
+
+	return blob->id;
+}
+
+void
+liftoff_mock_plane_set_in_formats(struct liftoff_mock_plane *plane,
+				  const uint32_t *formats, size_t formats_len,
+				  const uint64_t *modifiers,
+				  size_t modifiers_len)
+{
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *mods;
+	size_t size, i;
+	char *data;
+
+	/* A single mask is enough for our purposes */
+	assert(formats_len <= 64);
+
+	size = sizeof(*header) + formats_len * sizeof(uint32_t) +
+	       modifiers_len * sizeof(*mods);
+	data = calloc(1, size);
+	assert(data != NULL);
+
+	header = (struct drm_format_modifier_blob *)data;
+	header->version = 1;
+	header->count_formats = formats_len;
+	header->formats_offset = sizeof(*header);
+	header->count_modifiers = modifiers_len;
+	header->modifiers_offset = header->formats_offset +
+				   formats_len * sizeof(uint32_t);
+	memcpy(data + header->formats_offset, formats,
+	       formats_len * sizeof(uint32_t));
+
+	mods = (struct drm_format_modifier *)(data + header->modifiers_offset);
+	for (i = 0; i < modifiers_len; i++) {
+		mods[i].modifier = modifiers[i];
+		mods[i].offset = 0;
+		if (formats_len == 64) {
+			mods[i].formats = UINT64_MAX;
+		} else {
+			mods[i].formats = (UINT64_C(1) << formats_len) - 1;
+		}
+	}
+
+	liftoff_mock_plane_set_in_formats_blob(plane, data, size);
+	free(data);
+}
+
+void
+liftoff_mock_plane_set_in_formats_blob(struct liftoff_mock_plane *plane,
+				       const void *data, size_t size)
+{
+	drmModePropertyRes prop = {0};
+	uint32_t blob_id, prop_id;
+
+	blob_id = mock_create_blob(data, size);
+
+	strncpy(prop.name, "IN_FORMATS", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE;
+	prop_id = liftoff_mock_plane_add_property(plane, &prop);
+	plane->prop_values[get_prop_index(prop_id)] = blob_id;
+}
+
 static void
 apply_atomic_req(drmModeAtomicReq *req)
 {
@@ -287,13 +436,32 @@ apply_atomic_req(drmModeAtomicReq *req)
 	}
 }
 
+static bool
+mock_plane_fits_mode(struct liftoff_mock_plane *plane, drmModeAtomicReq *req)
+{
+	uint64_t x, y, w, h;
+
+	x = plane->prop_values[PLANE_CRTC_X];
+	y = plane->prop_values[PLANE_CRTC_Y];
+	w = plane->prop_values[PLANE_CRTC_W];
+	h = plane->prop_values[PLANE_CRTC_H];
+	mock_atomic_req_get_property(req, plane->id, PLANE_CRTC_X, &x);
+	mock_atomic_req_get_property(req, plane->id, PLANE_CRTC_Y, &y);
+	mock_atomic_req_get_property(req, plane->id, PLANE_CRTC_W, &w);
+	mock_atomic_req_get_property(req, plane->id, PLANE_CRTC_H, &h);
+
+	return (int32_t)x >= 0 && (int32_t)y >= 0 &&
+	       (int32_t)x + (int64_t)w <= liftoff_mock_drm_mode_width &&
+	       (int32_t)y + (int64_t)h <= liftoff_mock_drm_mode_height;
+}
+
 int
 drmModeAtomicCommit(int fd, drmModeAtomicReq *req, uint32_t flags,
 		    void *user_data)
 {
 	size_t i, j;
 	struct liftoff_mock_plane *plane;
-	uint64_t type, fb_id, crtc_id;
+	uint64_t type, fb_id, crtc_id, src_w, crtc_w;
 	bool has_fb, has_crtc, found;
 	bool any_plane_enabled, primary_plane_enabled;
 	struct liftoff_layer *layer;
@@ -331,7 +499,9 @@ drmModeAtomicCommit(int fd, drmModeAtomicReq *req, uint32_t flags,
 		}
 
 		if (has_fb) {
-			if (crtc_id != liftoff_mock_drm_crtc_id) {
+			if (crtc_id != liftoff_mock_drm_crtc_id &&
+			    (liftoff_mock_drm_second_crtc_id == 0 ||
+			     crtc_id != liftoff_mock_drm_second_crtc_id)) {
 				fprintf(stderr, "libdrm_mock: plane %u: "
 					"invalid CRTC_ID\n", plane->id);
 				return -EINVAL;
@@ -355,6 +525,41 @@ drmModeAtomicCommit(int fd, drmModeAtomicReq *req, uint32_t flags,
 					plane->id, (void *)layer);
 				return -EINVAL;
 			}
+			if (plane->max_downscale != 0) {
+				src_w = plane->prop_values[PLANE_SRC_W];
+				crtc_w = plane->prop_values[PLANE_CRTC_W];
+				mock_atomic_req_get_property(req, plane->id,
+							     PLANE_SRC_W, &src_w);
+				mock_atomic_req_get_property(req, plane->id,
+							     PLANE_CRTC_W,
+							     &crtc_w);
+				if (crtc_w == 0 ||
+				    src_w / crtc_w > plane->max_downscale) {
+					fprintf(stderr, "libdrm_mock: plane %u: "
+						"downscaling factor too large\n",
+						plane->id);
+					return -EINVAL;
+				}
+			}
+
+			if (liftoff_mock_drm_max_plane_width != 0) {
+				crtc_w = plane->prop_values[PLANE_CRTC_W];
+				mock_atomic_req_get_property(req, plane->id,
+							     PLANE_CRTC_W,
+							     &crtc_w);
+				if (crtc_w > liftoff_mock_drm_max_plane_width) {
+					fprintf(stderr, "libdrm_mock: plane %u: "
+						"too wide\n", plane->id);
+					return -EINVAL;
+				}
+			}
+
+			if (liftoff_mock_drm_mode_width != 0 &&
+			    !mock_plane_fits_mode(plane, req)) {
+				fprintf(stderr, "libdrm_mock: plane %u: "
+					"extends past the mode\n", plane->id);
+				return -ERANGE;
+			}
 
 			any_plane_enabled = true;
 			if (type == DRM_PLANE_TYPE_PRIMARY) {
@@ -380,13 +585,19 @@ drmModeAtomicCommit(int fd, drmModeAtomicReq *req, uint32_t flags,
 drmModeRes *
 drmModeGetResources(int fd)
 {
+	static uint32_t crtcs[2];
 	drmModeRes *res;
 
 	assert_drm_fd(fd);
 
 	res = calloc(1, sizeof(*res));
+	crtcs[0] = liftoff_mock_drm_crtc_id;
 	res->count_crtcs = 1;
-	res->crtcs = &liftoff_mock_drm_crtc_id;
+	if (liftoff_mock_drm_second_crtc_id != 0) {
+		crtcs[1] = liftoff_mock_drm_second_crtc_id;
+		res->count_crtcs = 2;
+	}
+	res->crtcs = crtcs;
 	return res;
 }
 
@@ -434,6 +645,9 @@ drmModeGetPlane(int fd, uint32_t id)
 	plane = calloc(1, sizeof(*plane));
 	plane->plane_id = id;
 	plane->possible_crtcs = 1 << 0;
+	if (liftoff_mock_drm_second_crtc_id != 0) {
+		plane->possible_crtcs |= 1 << 1;
+	}
 	return plane;
 }
 
@@ -486,6 +700,8 @@ drmModeGetProperty(int fd, uint32_t id)
 {
 	assert_drm_fd(fd);
 
+	liftoff_mock_get_property_count++;
+
 	return &plane_props[get_prop_index(id)];
 }
 
@@ -529,3 +745,155 @@ drmModeAtomicSetCursor(drmModeAtomicReq *req, int cursor)
 {
 	req->cursor = cursor;
 }
+
+drmModeFB2 *
+drmModeGetFB2(int fd, uint32_t fb_id)
+{
+	struct liftoff_mock_fb *mock_fb;
+	drmModeFB2 *fb;
+
+	assert_drm_fd(fd);
+
+	mock_fb = mock_fb_get(fb_id);
+	if (mock_fb == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	fb = calloc(1, sizeof(*fb));
+	fb->fb_id = fb_id;
+	fb->width = 1920;
+	fb->height = 1080;
+	fb->pixel_format = mock_fb->format;
+	fb->modifier = mock_fb->modifier;
+	fb->flags = DRM_MODE_FB_MODIFIERS;
+	/* No GEM handles: we're not DRM master */
+	return fb;
+}
+
+void
+drmModeFreeFB2(drmModeFB2 *fb)
+{
+	free(fb);
+}
+
+int
+drmIoctl(int fd, unsigned long request, void *arg)
+{
+	assert_drm_fd(fd);
+
+	errno = ENOTTY;
+	return -1;
+}
+
+drmModePropertyBlobRes *
+drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	drmModePropertyBlobRes *blob;
+	size_t i;
+
+	assert_drm_fd(fd);
+
+	for (i = 0; i < MAX_BLOBS; i++) {
+		if (mock_blobs[i].id == blob_id) {
+			break;
+		}
+	}
+	if (i == MAX_BLOBS) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	blob = calloc(1, sizeof(*blob));
+	blob->id = blob_id;
+	blob->length = mock_blobs[i].length;
+	blob->data = malloc(blob->length);
+	memcpy(blob->data, mock_blobs[i].data, blob->length);
+	return blob;
+}
+
+void
+drmModeFreePropertyBlob(drmModePropertyBlobRes *blob)
+{
+	if (blob == NULL) {
+		return;
+	}
+	free(blob->data);
+	free(blob);
+}
+
+int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
+			  uint32_t *id)
+{
+	assert_drm_fd(fd);
+
+	if (size == 0) {
+		return -EINVAL;
+	}
+	*id = mock_create_blob(data, size);
+	return 0;
+}
+
+int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	size_t i;
+
+	assert_drm_fd(fd);
+
+	for (i = 0; i < MAX_BLOBS; i++) {
+		if (mock_blobs[i].id == id) {
+			free(mock_blobs[i].data);
+			mock_blobs[i] = (drmModePropertyBlobRes){0};
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+int
+drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	assert_drm_fd(fd);
+
+	switch (capability) {
+	case DRM_CAP_CURSOR_WIDTH:
+		*value = liftoff_mock_drm_cursor_width;
+		break;
+	case DRM_CAP_CURSOR_HEIGHT:
+		*value = liftoff_mock_drm_cursor_height;
+		break;
+	default:
+		*value = 0;
+		break;
+	}
+
+	if (*value == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+drmVersion *
+drmGetVersion(int fd)
+{
+	drmVersion *version;
+
+	assert_drm_fd(fd);
+
+	version = calloc(1, sizeof(*version));
+	version->version_major = 1;
+	version->name_len = strlen(liftoff_mock_drm_driver_name);
+	version->name = calloc(1, version->name_len + 1);
+	memcpy(version->name, liftoff_mock_drm_driver_name, version->name_len);
+	return version;
+}
+
+void
+drmFreeVersion(drmVersion *version)
+{
+	free(version->name);
+	free(version);
+}
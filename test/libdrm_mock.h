@@ -6,7 +6,11 @@
 #include <xf86drmMode.h>
 
 extern uint32_t liftoff_mock_drm_crtc_id;
+/* Exposed by the device if non-zero, all planes can be used with it */
+extern uint32_t liftoff_mock_drm_second_crtc_id;
 extern size_t liftoff_mock_commit_count;
+/* Number of drmModeGetProperty calls */
+extern size_t liftoff_mock_get_property_count;
 
 /**
  * Some drivers require the primary plane to be enabled in order to light up a
@@ -14,6 +18,28 @@ extern size_t liftoff_mock_commit_count;
  */
 extern bool liftoff_mock_require_primary_plane;
 
+/* Driver name returned by drmGetVersion */
+extern const char *liftoff_mock_drm_driver_name;
+
+/**
+ * Values returned by drmGetCap for DRM_CAP_CURSOR_WIDTH and
+ * DRM_CAP_CURSOR_HEIGHT. Zero means drmGetCap fails.
+ */
+extern uint64_t liftoff_mock_drm_cursor_width;
+extern uint64_t liftoff_mock_drm_cursor_height;
+
+/**
+ * Size of the CRTC's mode. If non-zero, commits fail if a plane extends past
+ * the mode, like on many drivers.
+ */
+extern int liftoff_mock_drm_mode_width;
+extern int liftoff_mock_drm_mode_height;
+
+/**
+ * Maximum CRTC_W of a plane. If non-zero, commits fail if a plane is wider.
+ */
+extern uint64_t liftoff_mock_drm_max_plane_width;
+
 struct liftoff_layer;
 
 int
@@ -22,6 +48,14 @@ liftoff_mock_drm_open(void);
 uint32_t
 liftoff_mock_drm_create_fb(struct liftoff_layer *layer);
 
+/**
+ * Create an FB with a specific format and modifier. FBs created with
+ * liftoff_mock_drm_create_fb use XRGB8888 with the linear modifier.
+ */
+uint32_t
+liftoff_mock_drm_create_fb_with_format(struct liftoff_layer *layer,
+				       uint32_t format, uint64_t modifier);
+
 struct liftoff_mock_plane *
 liftoff_mock_drm_create_plane(int type);
 
@@ -38,4 +72,35 @@ uint32_t
 liftoff_mock_plane_add_property(struct liftoff_mock_plane *plane,
 				const drmModePropertyRes *prop);
 
+/* Current value of a property, as of the last commit */
+uint64_t
+liftoff_mock_plane_get_property(struct liftoff_mock_plane *plane,
+				uint32_t prop_id);
+
+/**
+ * Make test commits fail if the plane downscales more than `max_downscale`
+ * horizontally (16.16 fixed point). Zero means unlimited.
+ */
+void
+liftoff_mock_plane_set_max_downscale(struct liftoff_mock_plane *plane,
+				     uint64_t max_downscale);
+
+/**
+ * Add an IN_FORMATS property to the plane. All formats are advertised with all
+ * modifiers.
+ */
+void
+liftoff_mock_plane_set_in_formats(struct liftoff_mock_plane *plane,
+				  const uint32_t *formats, size_t formats_len,
+				  const uint64_t *modifiers,
+				  size_t modifiers_len);
+
+/**
+ * Add an IN_FORMATS property with the given blob contents to the plane, which
+ * may be malformed.
+ */
+void
+liftoff_mock_plane_set_in_formats_blob(struct liftoff_mock_plane *plane,
+				       const void *data, size_t size);
+
 #endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <drm_fourcc.h>
 #include <unistd.h>
 #include <libliftoff.h>
 #include <stdbool.h>
@@ -844,6 +845,452 @@ test_composition_zero_fb(void)
 	close(drm_fd);
 }
 
+static void
+apply_and_commit(int drm_fd, struct liftoff_output *output)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(output, req, 0);
+	assert(ret == 0);
+	ret = drmModeAtomicCommit(drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	drmModeAtomicFree(req);
+}
+
+/* Checks that layers hidden by an opaque layer above don't need a plane nor
+ * composition. */
+static void
+test_occlusion(void)
+{
+	struct liftoff_mock_plane *mock_primary;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *window, *fullscreen;
+	struct liftoff_rect opaque = { .width = 1920, .height = 1080 };
+
+	mock_primary = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	window = add_layer(output, 100, 100, 200, 200);
+	liftoff_layer_set_property(window, "zpos", 1);
+	fullscreen = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_layer_set_property(fullscreen, "zpos", 2);
+
+	/* The window is incompatible with all planes */
+	liftoff_mock_plane_add_compatible_layer(mock_primary, fullscreen);
+
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == fullscreen);
+	assert(liftoff_layer_needs_composition(window));
+
+	liftoff_layer_set_opaque_region(fullscreen, &opaque);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == fullscreen);
+	assert(!liftoff_layer_needs_composition(window));
+	assert(!liftoff_output_needs_composition(output));
+
+	/* Opaque FB formats can hide layers too */
+	liftoff_layer_set_opaque_region(fullscreen, NULL);
+	liftoff_output_set_implicit_opaque_regions(output, true);
+	apply_and_commit(drm_fd, output);
+	assert(!liftoff_layer_needs_composition(window));
+
+	liftoff_layer_set_property(fullscreen, "FB_ID",
+				   liftoff_mock_drm_create_fb_with_format(fullscreen,
+									  DRM_FORMAT_ARGB8888,
+									  DRM_FORMAT_MOD_LINEAR));
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == fullscreen);
+	assert(liftoff_layer_needs_composition(window));
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
+/* Checks that layers partly outside of the mode are clipped, and that layers
+ * outside of the mode are hidden. */
+static void
+test_offscreen(void)
+{
+	struct liftoff_mock_plane *mock_primary, *mock_overlay;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *background, *window;
+
+	liftoff_mock_drm_mode_width = 1920;
+	liftoff_mock_drm_mode_height = 1080;
+
+	mock_primary = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	liftoff_output_set_size(output, 1920, 1080);
+	background = add_layer(output, 0, 0, 1920, 1080);
+	window = add_layer(output, -50, 100, 100, 100);
+
+	liftoff_mock_plane_add_compatible_layer(mock_primary, background);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay, window);
+
+	/* The driver rejects the window partly outside of the mode */
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == background);
+	assert(liftoff_layer_needs_composition(window));
+
+	liftoff_output_set_layer_clipping(output, true);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == background);
+	assert(liftoff_mock_plane_get_layer(mock_overlay) == window);
+
+	liftoff_layer_set_property(window, "CRTC_X", 2000);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_layer_get_plane(window) == NULL);
+	assert(!liftoff_layer_needs_composition(window));
+	assert(!liftoff_output_needs_composition(output));
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
+/* Checks that opaque layers can be put below the composition layer when
+ * composited layers are above them. */
+static void
+test_underlay(void)
+{
+	struct liftoff_mock_plane *mock_primary, *mock_underlay;
+	drmModePropertyRes prop = {0};
+	uint64_t prop_value;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *composition_layer, *video, *ui;
+	struct liftoff_rect opaque = { 200, 200, 800, 600 };
+
+	mock_primary = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_underlay = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+
+	strncpy(prop.name, "zpos", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_IMMUTABLE;
+	prop.count_values = 1;
+	prop.values = &prop_value;
+	prop_value = 0;
+	liftoff_mock_plane_add_property(mock_primary, &prop);
+	prop_value = (uint64_t)-1;
+	liftoff_mock_plane_add_property(mock_underlay, &prop);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	composition_layer = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_layer_set_property(composition_layer, "zpos", 0);
+	video = add_layer(output, 200, 200, 800, 600);
+	liftoff_layer_set_property(video, "zpos", 1);
+	liftoff_layer_set_opaque_region(video, &opaque);
+	/* Incompatible with all planes */
+	ui = add_layer(output, 300, 300, 100, 100);
+	liftoff_layer_set_property(ui, "zpos", 2);
+	liftoff_output_set_composition_layer(output, composition_layer);
+
+	liftoff_mock_plane_add_compatible_layer(mock_primary,
+						composition_layer);
+	liftoff_mock_plane_add_compatible_layer(mock_underlay, video);
+
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == composition_layer);
+	assert(liftoff_layer_needs_composition(video));
+
+	liftoff_output_set_underlays(output, true);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == composition_layer);
+	assert(liftoff_mock_plane_get_layer(mock_underlay) == video);
+	assert(liftoff_layer_is_underlay(video));
+	assert(liftoff_layer_get_composition_changes(video) &
+	       LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP);
+	assert(liftoff_layer_needs_composition(ui));
+
+	/* The hole would hide what's under a translucent layer */
+	liftoff_layer_set_opaque_region(video, NULL);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_underlay) == NULL);
+	assert(!liftoff_layer_is_underlay(video));
+	assert(liftoff_layer_needs_composition(video));
+
+	/* The FB has an opaque format */
+	liftoff_output_set_implicit_opaque_regions(output, true);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_underlay) == video);
+	assert(liftoff_layer_is_underlay(video));
+
+	/* Neither the previous allocation nor the cached scene apply anymore */
+	liftoff_output_set_implicit_opaque_regions(output, false);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_underlay) == NULL);
+	assert(!liftoff_layer_is_underlay(video));
+	assert(liftoff_layer_needs_composition(video));
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
+static struct liftoff_mock_plane *
+create_plane_with_zpos(int type, uint64_t zpos)
+{
+	struct liftoff_mock_plane *mock_plane;
+	drmModePropertyRes prop = {0};
+
+	mock_plane = liftoff_mock_drm_create_plane(type);
+
+	strncpy(prop.name, "zpos", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_IMMUTABLE;
+	prop.count_values = 1;
+	prop.values = &zpos;
+	liftoff_mock_plane_add_property(mock_plane, &prop);
+
+	return mock_plane;
+}
+
+/* Checks that a layer can be put on a plane between two composition layers */
+static void
+test_multiple_composition(void)
+{
+	struct liftoff_mock_plane *mock_primary, *mock_video, *mock_top;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *composition_layer, *background, *video;
+	struct liftoff_layer *top_composition_layer, *subtitles;
+
+	mock_primary = create_plane_with_zpos(DRM_PLANE_TYPE_PRIMARY, 0);
+	mock_video = create_plane_with_zpos(DRM_PLANE_TYPE_OVERLAY, 1);
+	mock_top = create_plane_with_zpos(DRM_PLANE_TYPE_OVERLAY, 2);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	composition_layer = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_layer_set_property(composition_layer, "zpos", 0);
+	/* Incompatible with all planes */
+	background = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_layer_set_property(background, "zpos", 1);
+	video = add_layer(output, 200, 200, 800, 600);
+	liftoff_layer_set_property(video, "zpos", 2);
+	top_composition_layer = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_layer_set_property(top_composition_layer, "zpos", 3);
+	/* Incompatible with all planes */
+	subtitles = add_layer(output, 300, 700, 600, 50);
+	liftoff_layer_set_property(subtitles, "zpos", 4);
+	liftoff_output_set_composition_layer(output, composition_layer);
+
+	liftoff_mock_plane_add_compatible_layer(mock_primary,
+						composition_layer);
+	liftoff_mock_plane_add_compatible_layer(mock_video, video);
+	liftoff_mock_plane_add_compatible_layer(mock_top,
+						top_composition_layer);
+
+	/* The subtitles are composited below the video */
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == composition_layer);
+	assert(liftoff_mock_plane_get_layer(mock_video) == NULL);
+	assert(liftoff_layer_get_composition_layer(video) == composition_layer);
+	assert(liftoff_layer_get_composition_layer(subtitles) ==
+	       composition_layer);
+
+	liftoff_output_add_composition_layer(output, top_composition_layer);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == composition_layer);
+	assert(liftoff_mock_plane_get_layer(mock_video) == video);
+	assert(liftoff_mock_plane_get_layer(mock_top) == top_composition_layer);
+	assert(!liftoff_layer_is_underlay(video));
+	assert(liftoff_layer_get_composition_layer(video) == NULL);
+	assert(liftoff_layer_get_composition_layer(background) ==
+	       composition_layer);
+	assert(liftoff_layer_get_composition_layer(subtitles) ==
+	       top_composition_layer);
+	assert(liftoff_layer_get_composition_changes(subtitles) &
+	       LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP);
+
+	/* Without subtitles, the top composition layer isn't needed */
+	liftoff_layer_set_property(subtitles, "FB_ID", 0);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_video) == video);
+	assert(liftoff_mock_plane_get_layer(mock_top) == NULL);
+	assert(!liftoff_layer_needs_composition(top_composition_layer));
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
+/* Checks that a layer wider than a plane can be split across two planes */
+static void
+test_split(void)
+{
+	struct liftoff_mock_plane *mock_primary, *mock_overlay1, *mock_overlay2;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	liftoff_mock_drm_max_plane_width = 2560;
+
+	mock_primary = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay1 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	mock_overlay2 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 5120, 1440);
+
+	liftoff_mock_plane_add_compatible_layer(mock_primary, layer);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay1, layer);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay2, layer);
+
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_layer_needs_composition(layer));
+
+	liftoff_output_set_split_width(output, 2560);
+	apply_and_commit(drm_fd, output);
+	assert(!liftoff_layer_needs_composition(layer));
+	assert(liftoff_mock_plane_get_layer(mock_primary) == NULL);
+	assert(liftoff_mock_plane_get_layer(mock_overlay1) == layer);
+	assert(liftoff_mock_plane_get_layer(mock_overlay2) == layer);
+
+	/* Fits in a single plane now */
+	liftoff_layer_set_property(layer, "CRTC_W", 2560);
+	liftoff_layer_set_property(layer, "SRC_W", 2560 << 16);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == layer);
+	assert(liftoff_mock_plane_get_layer(mock_overlay1) == NULL);
+	assert(liftoff_mock_plane_get_layer(mock_overlay2) == NULL);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
+/* Checks that slices skip planes which can't display the layer */
+static void
+test_split_skip_plane(void)
+{
+	struct liftoff_mock_plane *mock_overlay1, *mock_overlay2;
+	struct liftoff_mock_plane *mock_overlay3;
+	const uint32_t formats[] = { DRM_FORMAT_NV12 };
+	const uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	liftoff_mock_drm_max_plane_width = 2560;
+
+	liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay1 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	mock_overlay2 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	mock_overlay3 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	liftoff_mock_plane_set_in_formats(mock_overlay2, formats, 1,
+					  modifiers, 1);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	liftoff_output_set_split_width(output, 2560);
+	layer = add_layer(output, 0, 0, 5120, 1440);
+
+	liftoff_mock_plane_add_compatible_layer(mock_overlay1, layer);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay3, layer);
+
+	apply_and_commit(drm_fd, output);
+	assert(!liftoff_layer_needs_composition(layer));
+	assert(liftoff_mock_plane_get_layer(mock_overlay1) == layer);
+	assert(liftoff_mock_plane_get_layer(mock_overlay2) == NULL);
+	assert(liftoff_mock_plane_get_layer(mock_overlay3) == layer);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
+/* Checks that planes in between slices can display other layers */
+static void
+test_split_middle_plane(void)
+{
+	struct liftoff_mock_plane *mock_overlay1, *mock_overlay2;
+	struct liftoff_mock_plane *mock_overlay3;
+	const uint32_t formats[] = { DRM_FORMAT_NV12 };
+	const uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *split, *other;
+	uint32_t fb_id;
+
+	liftoff_mock_drm_max_plane_width = 2560;
+
+	liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay1 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	mock_overlay2 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	mock_overlay3 = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	liftoff_mock_plane_set_in_formats(mock_overlay2, formats, 1,
+					  modifiers, 1);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	liftoff_output_set_split_width(output, 2560);
+	split = add_layer(output, 0, 0, 5120, 1000);
+	other = add_layer(output, 0, 1100, 256, 256);
+	fb_id = liftoff_mock_drm_create_fb_with_format(other, DRM_FORMAT_NV12,
+						       DRM_FORMAT_MOD_LINEAR);
+	liftoff_layer_set_property(other, "FB_ID", fb_id);
+
+	liftoff_mock_plane_add_compatible_layer(mock_overlay1, split);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay2, other);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay3, split);
+
+	apply_and_commit(drm_fd, output);
+	assert(!liftoff_layer_needs_composition(split));
+	assert(!liftoff_layer_needs_composition(other));
+	assert(liftoff_mock_plane_get_layer(mock_overlay1) == split);
+	assert(liftoff_mock_plane_get_layer(mock_overlay2) == other);
+	assert(liftoff_mock_plane_get_layer(mock_overlay3) == split);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -870,6 +1317,27 @@ main(int argc, char *argv[])
 	} else if (strcmp(test_name, "composition-zero-fb-id") == 0) {
 		test_composition_zero_fb();
 		return 0;
+	} else if (strcmp(test_name, "occlusion") == 0) {
+		test_occlusion();
+		return 0;
+	} else if (strcmp(test_name, "offscreen") == 0) {
+		test_offscreen();
+		return 0;
+	} else if (strcmp(test_name, "underlay") == 0) {
+		test_underlay();
+		return 0;
+	} else if (strcmp(test_name, "multiple-composition") == 0) {
+		test_multiple_composition();
+		return 0;
+	} else if (strcmp(test_name, "split") == 0) {
+		test_split();
+		return 0;
+	} else if (strcmp(test_name, "split-skip-plane") == 0) {
+		test_split_skip_plane();
+		return 0;
+	} else if (strcmp(test_name, "split-middle-plane") == 0) {
+		test_split_middle_plane();
+		return 0;
 	}
 
 	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
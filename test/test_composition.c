@@ -0,0 +1,387 @@
+#include <assert.h>
+#include <unistd.h>
+#include <libliftoff.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "libdrm_mock.h"
+
+struct context {
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	/* `composited` and `other_composited` need composition, `layer` is
+	 * mapped to the overlay plane */
+	struct liftoff_layer *composition_layer, *composited, *other_composited,
+			     *layer;
+	struct liftoff_mock_plane *mock_primary;
+	uint32_t damage_clips_prop_id;
+};
+
+struct test_case {
+	const char *name;
+	void (*run)(struct context *ctx);
+};
+
+static struct liftoff_layer *
+add_layer(struct liftoff_output *output, int x, int y, int width, int height)
+{
+	uint32_t fb_id;
+	struct liftoff_layer *layer;
+
+	layer = liftoff_layer_create(output);
+	fb_id = liftoff_mock_drm_create_fb(layer);
+	liftoff_layer_set_property(layer, "FB_ID", fb_id);
+	liftoff_layer_set_property(layer, "CRTC_X", x);
+	liftoff_layer_set_property(layer, "CRTC_Y", y);
+	liftoff_layer_set_property(layer, "CRTC_W", width);
+	liftoff_layer_set_property(layer, "CRTC_H", height);
+	liftoff_layer_set_property(layer, "SRC_X", 0);
+	liftoff_layer_set_property(layer, "SRC_Y", 0);
+	liftoff_layer_set_property(layer, "SRC_W", width << 16);
+	liftoff_layer_set_property(layer, "SRC_H", height << 16);
+
+	return layer;
+}
+
+static void
+apply_and_commit(struct context *ctx)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(ctx->output, req, 0);
+	assert(ret == 0);
+	ret = drmModeAtomicCommit(ctx->drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	liftoff_output_commit_done(ctx->output, ret);
+	drmModeAtomicFree(req);
+}
+
+/* Returns the number of damage clips, -1 if the whole FB is damaged */
+static int
+get_damage_clips(struct context *ctx, struct drm_mode_rect *clips,
+		 size_t max_clips)
+{
+	drmModePropertyBlobRes *blob;
+	uint64_t blob_id;
+	size_t clips_len;
+
+	blob_id = liftoff_mock_plane_get_property(ctx->mock_primary,
+						  ctx->damage_clips_prop_id);
+	if (blob_id == 0) {
+		return -1;
+	}
+
+	blob = drmModeGetPropertyBlob(ctx->drm_fd, blob_id);
+	assert(blob != NULL);
+	clips_len = blob->length / sizeof(clips[0]);
+	assert(clips_len <= max_clips);
+	memcpy(clips, blob->data, blob->length);
+	drmModeFreePropertyBlob(blob);
+
+	return clips_len;
+}
+
+static void
+run_static(struct context *ctx)
+{
+	apply_and_commit(ctx);
+	assert(liftoff_output_composition_changed(ctx->output));
+	assert(liftoff_layer_get_composition_changes(ctx->composited) &
+	       LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP);
+	assert(liftoff_layer_get_composition_changes(ctx->layer) == 0);
+
+	apply_and_commit(ctx);
+	assert(!liftoff_output_composition_changed(ctx->output));
+	assert(liftoff_layer_get_composition_changes(ctx->composited) == 0);
+}
+
+static void
+run_change_content(struct context *ctx)
+{
+	apply_and_commit(ctx);
+
+	/* Layers which don't need composition don't matter */
+	liftoff_layer_set_property(ctx->layer, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->layer));
+	apply_and_commit(ctx);
+	assert(!liftoff_output_composition_changed(ctx->output));
+	assert(liftoff_layer_get_composition_changes(ctx->layer) == 0);
+
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	apply_and_commit(ctx);
+	assert(liftoff_output_composition_changed(ctx->output));
+	assert(liftoff_layer_get_composition_changes(ctx->composited) ==
+	       LIFTOFF_COMPOSITION_CHANGE_CONTENT);
+	assert(liftoff_layer_get_composition_changes(ctx->other_composited) == 0);
+}
+
+static void
+run_change_geometry(struct context *ctx)
+{
+	apply_and_commit(ctx);
+
+	liftoff_layer_set_property(ctx->composited, "CRTC_X", 200);
+	apply_and_commit(ctx);
+	assert(liftoff_output_composition_changed(ctx->output));
+	assert(liftoff_layer_get_composition_changes(ctx->composited) ==
+	       LIFTOFF_COMPOSITION_CHANGE_GEOMETRY);
+}
+
+static void
+run_change_membership(struct context *ctx)
+{
+	apply_and_commit(ctx);
+
+	liftoff_layer_set_property(ctx->composited, "FB_ID", 0);
+	apply_and_commit(ctx);
+	assert(liftoff_output_composition_changed(ctx->output));
+	assert(liftoff_layer_get_composition_changes(ctx->composited) &
+	       LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP);
+
+	apply_and_commit(ctx);
+	assert(!liftoff_output_composition_changed(ctx->output));
+
+	liftoff_layer_destroy(ctx->other_composited);
+	apply_and_commit(ctx);
+	assert(liftoff_output_composition_changed(ctx->output));
+}
+
+static void
+run_region(struct context *ctx)
+{
+	struct liftoff_rect rects[4];
+	size_t rects_len;
+
+	apply_and_commit(ctx);
+
+	rects_len = liftoff_output_get_composition_region(ctx->output, rects,
+							  4);
+	assert(rects_len == 2);
+
+	/* Rectangles are merged to honor the limit */
+	rects_len = liftoff_output_get_composition_region(ctx->output, rects,
+							  1);
+	assert(rects_len == 1);
+	assert(rects[0].x == 0 && rects[0].y == 0);
+	assert(rects[0].width == 600 && rects[0].height == 600);
+
+	/* The region is clipped to the composition layer */
+	liftoff_layer_set_property(ctx->composited, "CRTC_X", -50);
+	liftoff_layer_set_property(ctx->other_composited, "FB_ID", 0);
+	apply_and_commit(ctx);
+
+	rects_len = liftoff_output_get_composition_region(ctx->output, rects,
+							  4);
+	assert(rects_len == 1);
+	assert(rects[0].x == 0 && rects[0].y == 0);
+	assert(rects[0].width == 50 && rects[0].height == 100);
+
+	/* Overlapping layers are merged */
+	liftoff_layer_set_property(ctx->other_composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->other_composited));
+	liftoff_layer_set_property(ctx->other_composited, "CRTC_X", 40);
+	liftoff_layer_set_property(ctx->other_composited, "CRTC_Y", 40);
+	apply_and_commit(ctx);
+
+	rects_len = liftoff_output_get_composition_region(ctx->output, rects,
+							  4);
+	assert(rects_len == 1);
+	assert(rects[0].width == 140 && rects[0].height == 140);
+}
+
+static void
+run_damage(struct context *ctx)
+{
+	struct drm_mode_rect clips[8];
+	int clips_len;
+
+	liftoff_output_set_composition_damage(ctx->output, true);
+
+	/* The plane didn't display the composition layer yet */
+	apply_and_commit(ctx);
+	assert(liftoff_layer_get_plane(ctx->composition_layer) != NULL);
+	assert(get_damage_clips(ctx, clips, 8) == -1);
+
+	/* Nothing changed */
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x1 == clips[0].x2 && clips[0].y1 == clips[0].y2);
+
+	/* Layers which don't need composition don't damage the composition
+	 * layer */
+	liftoff_layer_set_property(ctx->layer, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->layer));
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x1 == 0 && clips[0].y1 == 0);
+	assert(clips[0].x2 == 100 && clips[0].y2 == 100);
+
+	/* Both the old and new positions are damaged */
+	liftoff_layer_set_property(ctx->other_composited, "CRTC_X", 550);
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x1 == 500 && clips[0].y1 == 500);
+	assert(clips[0].x2 == 650 && clips[0].y2 == 600);
+
+	/* Layers leaving composition damage their old position */
+	liftoff_layer_set_property(ctx->composited, "FB_ID", 0);
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x1 == 0 && clips[0].y1 == 0);
+	assert(clips[0].x2 == 100 && clips[0].y2 == 100);
+
+	/* Destroying a composited layer damages everything */
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	liftoff_layer_destroy(ctx->other_composited);
+	apply_and_commit(ctx);
+	assert(get_damage_clips(ctx, clips, 8) == -1);
+}
+
+static void
+run_damage_clips(struct context *ctx)
+{
+	struct drm_mode_rect clips[8], layer_clips[2];
+	int clips_len, ret;
+
+	liftoff_output_set_composition_damage(ctx->output, true);
+	apply_and_commit(ctx);
+
+	/* A new property may change anything */
+	layer_clips[0] = (struct drm_mode_rect){ 10, 10, 20, 20 };
+	ret = liftoff_layer_set_property_blob(ctx->composited,
+					      "FB_DAMAGE_CLIPS", layer_clips,
+					      sizeof(layer_clips[0]));
+	assert(ret == 0);
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x1 == 0 && clips[0].y1 == 0);
+	assert(clips[0].x2 == 100 && clips[0].y2 == 100);
+
+	/* Only the layer's damage clips are damaged */
+	layer_clips[0] = (struct drm_mode_rect){ 30, 40, 50, 60 };
+	layer_clips[1] = (struct drm_mode_rect){ 90, 90, 200, 200 };
+	ret = liftoff_layer_set_property_blob(ctx->composited,
+					      "FB_DAMAGE_CLIPS", layer_clips,
+					      sizeof(layer_clips));
+	assert(ret == 0);
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 2);
+	assert(clips[0].x1 == 30 && clips[0].y1 == 40);
+	assert(clips[0].x2 == 50 && clips[0].y2 == 60);
+	assert(clips[1].x1 == 90 && clips[1].y1 == 90);
+	assert(clips[1].x2 == 100 && clips[1].y2 == 100);
+
+	/* Other changes damage the whole layer */
+	liftoff_layer_set_property(ctx->composited, "alpha", 0x8000);
+	apply_and_commit(ctx);
+	apply_and_commit(ctx);
+	liftoff_layer_set_property(ctx->composited, "alpha", 0xFFFF);
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x1 == 0 && clips[0].y1 == 0);
+	assert(clips[0].x2 == 100 && clips[0].y2 == 100);
+
+	/* So do unset damage clips */
+	liftoff_layer_set_property(ctx->composited, "FB_DAMAGE_CLIPS", 0);
+	liftoff_layer_set_property(ctx->composited, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->composited));
+	apply_and_commit(ctx);
+	clips_len = get_damage_clips(ctx, clips, 8);
+	assert(clips_len == 1);
+	assert(clips[0].x2 == 100 && clips[0].y2 == 100);
+}
+
+static const struct test_case tests[] = {
+	{ .name = "static", .run = run_static },
+	{ .name = "change-content", .run = run_change_content },
+	{ .name = "change-geometry", .run = run_change_geometry },
+	{ .name = "change-membership", .run = run_change_membership },
+	{ .name = "region", .run = run_region },
+	{ .name = "damage", .run = run_damage },
+	{ .name = "damage-clips", .run = run_damage_clips },
+};
+
+static void
+run(const struct test_case *test)
+{
+	struct context ctx = {0};
+	struct liftoff_mock_plane *mock_primary, *mock_overlay;
+	drmModePropertyRes prop;
+
+	mock_primary = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+
+	prop = (drmModePropertyRes){0};
+	strncpy(prop.name, "FB_DAMAGE_CLIPS", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_BLOB;
+	ctx.damage_clips_prop_id =
+		liftoff_mock_plane_add_property(mock_primary, &prop);
+	ctx.mock_primary = mock_primary;
+
+	ctx.drm_fd = liftoff_mock_drm_open();
+	ctx.device = liftoff_device_create(ctx.drm_fd);
+	assert(ctx.device != NULL);
+
+	liftoff_device_register_all_planes(ctx.device);
+
+	ctx.output = liftoff_output_create(ctx.device, liftoff_mock_drm_crtc_id);
+	ctx.composition_layer = add_layer(ctx.output, 0, 0, 1920, 1080);
+	ctx.composited = add_layer(ctx.output, 0, 0, 100, 100);
+	ctx.other_composited = add_layer(ctx.output, 500, 500, 100, 100);
+	ctx.layer = add_layer(ctx.output, 1000, 0, 100, 100);
+	liftoff_output_set_composition_layer(ctx.output,
+					     ctx.composition_layer);
+
+	liftoff_mock_plane_add_compatible_layer(mock_primary,
+						ctx.composition_layer);
+	liftoff_mock_plane_add_compatible_layer(mock_overlay, ctx.layer);
+
+	test->run(&ctx);
+
+	liftoff_device_destroy(ctx.device);
+	close(ctx.drm_fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *test_name;
+
+	liftoff_log_set_priority(LIFTOFF_DEBUG);
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <test-name>\n", argv[0]);
+		return 1;
+	}
+	test_name = argv[1];
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (strcmp(test_name, tests[i].name) == 0) {
+			run(&tests[i]);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "no such test: %s\n", test_name);
+	return 1;
+}
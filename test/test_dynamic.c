@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <drm_fourcc.h>
+#include <errno.h>
 #include <unistd.h>
 #include <libliftoff.h>
 #include <stdbool.h>
@@ -8,6 +10,7 @@
 
 struct context {
 	int drm_fd;
+	struct liftoff_device *device;
 	struct liftoff_output *output;
 	struct liftoff_mock_plane *mock_plane;
 	struct liftoff_layer *layer, *other_layer;
@@ -87,6 +90,28 @@ second_commit(struct context *ctx, bool want_reuse_prev_alloc)
 	drmModeAtomicFree(req);
 }
 
+/* Performs a commit which shouldn't require any TEST_ONLY commit, because the
+ * library trusts the previous plane allocation. */
+static void
+second_commit_trusted(struct context *ctx, bool want_test)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(ctx->output, req, 0);
+	assert(ret == 0);
+	if (want_test) {
+		assert(liftoff_mock_commit_count == ctx->commit_count + 1);
+	} else {
+		assert(liftoff_mock_commit_count == ctx->commit_count);
+	}
+	ret = drmModeAtomicCommit(ctx->drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	liftoff_output_commit_done(ctx->output, ret);
+	drmModeAtomicFree(req);
+}
+
 static void
 run_same(struct context *ctx)
 {
@@ -110,6 +135,40 @@ run_change_fb(struct context *ctx)
 	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
 }
 
+static void
+run_change_fb_format(struct context *ctx)
+{
+	uint32_t fb_id;
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	fb_id = liftoff_mock_drm_create_fb_with_format(ctx->layer,
+						       DRM_FORMAT_ARGB8888,
+						       DRM_FORMAT_MOD_LINEAR);
+	liftoff_layer_set_property(ctx->layer, "FB_ID", fb_id);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_fb_modifier(struct context *ctx)
+{
+	uint32_t fb_id;
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	fb_id = liftoff_mock_drm_create_fb_with_format(ctx->layer,
+						       DRM_FORMAT_XRGB8888,
+						       DRM_FORMAT_MOD_INVALID);
+	liftoff_layer_set_property(ctx->layer, "FB_ID", fb_id);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
 static void
 run_unset_fb(struct context *ctx)
 {
@@ -271,9 +330,324 @@ run_change_fb_damage_clips(struct context *ctx)
 	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
 }
 
+static void
+run_change_position(struct context *ctx)
+{
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	/* The layer still intersects with all other layers */
+	liftoff_layer_set_property(ctx->layer, "CRTC_X", 100);
+	liftoff_layer_set_property(ctx->layer, "CRTC_Y", 100);
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_intersection(struct context *ctx)
+{
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	/* The other layer doesn't intersect with any layer anymore */
+	liftoff_layer_set_property(ctx->other_layer, "CRTC_X", 1920);
+	liftoff_layer_set_property(ctx->other_layer, "CRTC_Y", 1080);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_unknown_prop(struct context *ctx)
+{
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_never_realloc_prop(struct context *ctx)
+{
+	int ret;
+
+	ret = liftoff_device_set_realloc_policy(ctx->device, "COLOR_ENCODING",
+						LIFTOFF_REALLOC_NEVER, 0);
+	assert(ret == 0);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_realloc_on_value_prop(struct context *ctx)
+{
+	int ret;
+
+	/* The output policy takes precedence over the device one */
+	ret = liftoff_device_set_realloc_policy(ctx->device, "COLOR_ENCODING",
+						LIFTOFF_REALLOC_ALWAYS, 0);
+	assert(ret == 0);
+	ret = liftoff_output_set_realloc_policy(ctx->output, "COLOR_ENCODING",
+						LIFTOFF_REALLOC_ON_VALUE, 0);
+	assert(ret == 0);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 2);
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_set_realloc_on_value_prop(struct context *ctx)
+{
+	int ret;
+
+	ret = liftoff_output_set_realloc_policy(ctx->output, "COLOR_ENCODING",
+						LIFTOFF_REALLOC_ON_VALUE, 0);
+	assert(ret == 0);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_fb_trusted(struct context *ctx)
+{
+	liftoff_output_set_trusted_reuse(ctx->output, true);
+
+	first_commit(ctx);
+	liftoff_output_commit_done(ctx->output, 0);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->layer));
+
+	second_commit_trusted(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_change_alpha_trusted(struct context *ctx)
+{
+	liftoff_output_set_trusted_reuse(ctx->output, true);
+	liftoff_layer_set_property(ctx->layer, "alpha", 42);
+
+	first_commit(ctx);
+	liftoff_output_commit_done(ctx->output, 0);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "alpha", 43);
+
+	second_commit_trusted(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_commit_failed_trusted(struct context *ctx)
+{
+	liftoff_output_set_trusted_reuse(ctx->output, true);
+
+	first_commit(ctx);
+	/* The commit isn't reported as successful: the allocation can't be
+	 * trusted */
+	liftoff_output_commit_done(ctx->output, -EINVAL);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_commit_failed_rollback(struct context *ctx)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	liftoff_mock_plane_add_compatible_layer(ctx->mock_plane,
+						ctx->other_layer);
+	liftoff_layer_set_property(ctx->layer, "rotation", DRM_MODE_ROTATE_0);
+
+	first_commit(ctx);
+	liftoff_output_commit_done(ctx->output, 0);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	/* The plane doesn't support rotation: the other layer gets it */
+	liftoff_layer_set_property(ctx->layer, "rotation", DRM_MODE_ROTATE_180);
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(ctx->output, req, 0);
+	assert(ret == 0);
+	assert(liftoff_layer_get_plane(ctx->other_layer) != NULL);
+	drmModeAtomicFree(req);
+
+	/* The commit fails: the last committed allocation is restored */
+	liftoff_output_commit_done(ctx->output, -EINVAL);
+	assert(liftoff_layer_get_plane(ctx->layer) != NULL);
+	assert(liftoff_layer_get_plane(ctx->other_layer) == NULL);
+
+	/* Reverting the change gets us back to the committed state, which can
+	 * be re-used without searching for a new allocation */
+	liftoff_layer_set_property(ctx->layer, "rotation", DRM_MODE_ROTATE_0);
+	ctx->commit_count = liftoff_mock_commit_count;
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_delta_request(struct context *ctx)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	/* Nothing is known about the kernel state yet: the first request
+	 * contains the whole configuration */
+	first_commit(ctx);
+	liftoff_output_commit_done(ctx->output, 0);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->layer));
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(ctx->output, req, 0);
+	assert(ret == 0);
+	/* Only FB_ID and CRTC_ID are set on the enabled plane, and the
+	 * disabled plane is left alone */
+	assert(drmModeAtomicGetCursor(req) == 2);
+	ret = drmModeAtomicCommit(ctx->drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	liftoff_output_commit_done(ctx->output, ret);
+	drmModeAtomicFree(req);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	/* After an invalidation, everything is set again */
+	liftoff_device_invalidate_state(ctx->device);
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(ctx->output, req, 0);
+	assert(ret == 0);
+	assert(drmModeAtomicGetCursor(req) > 2);
+	drmModeAtomicFree(req);
+}
+
+static void
+run_is_dirty(struct context *ctx)
+{
+	assert(liftoff_output_is_dirty(ctx->output));
+
+	first_commit(ctx);
+	/* The commit hasn't been reported yet */
+	assert(liftoff_output_is_dirty(ctx->output));
+	liftoff_output_commit_done(ctx->output, 0);
+	assert(!liftoff_output_is_dirty(ctx->output));
+
+	/* Setting the same value doesn't make the output dirty */
+	liftoff_layer_set_property(ctx->layer, "CRTC_X", 0);
+	assert(!liftoff_output_is_dirty(ctx->output));
+
+	liftoff_layer_set_property(ctx->layer, "FB_ID",
+				   liftoff_mock_drm_create_fb(ctx->layer));
+	assert(liftoff_output_is_dirty(ctx->output));
+	second_commit_trusted(ctx, true);
+	assert(!liftoff_output_is_dirty(ctx->output));
+
+	liftoff_layer_set_property(ctx->layer, "alpha", 42);
+	assert(liftoff_output_is_dirty(ctx->output));
+	ctx->commit_count = liftoff_mock_commit_count;
+	second_commit(ctx, false);
+	liftoff_output_commit_done(ctx->output, -EINVAL);
+	assert(liftoff_output_is_dirty(ctx->output));
+
+	liftoff_layer_destroy(ctx->other_layer);
+	assert(liftoff_output_is_dirty(ctx->output));
+}
+
+static void
+run_revisit_scene(struct context *ctx)
+{
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	/* Both scenes have been seen before: their plane allocation only
+	 * needs to be checked with a single test commit */
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+	ctx->commit_count = liftoff_mock_commit_count;
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+	ctx->commit_count = liftoff_mock_commit_count;
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
+static void
+run_revisit_scene_priority(struct context *ctx)
+{
+	uint32_t fb_id;
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+
+	first_commit(ctx);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 1);
+
+	second_commit(ctx, false);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+
+	/* Updating a layer changes the order of layers with similar
+	 * priorities, the scene is still the same */
+	liftoff_layer_set_property(ctx->layer, "COLOR_ENCODING", 0);
+	fb_id = liftoff_mock_drm_create_fb(ctx->other_layer);
+	liftoff_layer_set_property(ctx->other_layer, "FB_ID", fb_id);
+	ctx->commit_count = liftoff_mock_commit_count;
+
+	second_commit(ctx, true);
+	assert(liftoff_mock_plane_get_layer(ctx->mock_plane) == ctx->layer);
+}
+
 static const struct test_case tests[] = {
 	{ .name = "same", .run = run_same },
 	{ .name = "change-fb", .run = run_change_fb },
+	{ .name = "change-fb-format", .run = run_change_fb_format },
+	{ .name = "change-fb-modifier", .run = run_change_fb_modifier },
 	{ .name = "unset-fb", .run = run_unset_fb },
 	{ .name = "set-fb", .run = run_set_fb },
 	{ .name = "add-layer", .run = run_add_layer },
@@ -286,13 +660,26 @@ static const struct test_case tests[] = {
 	{ .name = "unset-alpha-to-transparent", .run = run_unset_alpha_to_transparent },
 	{ .name = "change-in-fence-fd", .run = run_change_in_fence_fd },
 	{ .name = "change-fb-damage-clips", .run = run_change_fb_damage_clips },
+	{ .name = "change-position", .run = run_change_position },
+	{ .name = "change-intersection", .run = run_change_intersection },
+	{ .name = "change-unknown-prop", .run = run_change_unknown_prop },
+	{ .name = "change-never-realloc-prop", .run = run_change_never_realloc_prop },
+	{ .name = "change-realloc-on-value-prop", .run = run_change_realloc_on_value_prop },
+	{ .name = "set-realloc-on-value-prop", .run = run_set_realloc_on_value_prop },
+	{ .name = "change-fb-trusted", .run = run_change_fb_trusted },
+	{ .name = "change-alpha-trusted", .run = run_change_alpha_trusted },
+	{ .name = "commit-failed-trusted", .run = run_commit_failed_trusted },
+	{ .name = "commit-failed-rollback", .run = run_commit_failed_rollback },
+	{ .name = "delta-request", .run = run_delta_request },
+	{ .name = "is-dirty", .run = run_is_dirty },
+	{ .name = "revisit-scene", .run = run_revisit_scene },
+	{ .name = "revisit-scene-priority", .run = run_revisit_scene_priority },
 };
 
 static void
 run(const struct test_case *test)
 {
 	struct context ctx = {0};
-	struct liftoff_device *device;
 	const char *prop_name;
 	drmModePropertyRes prop;
 
@@ -320,13 +707,18 @@ run(const struct test_case *test)
 	strncpy(prop.name, prop_name, sizeof(prop.name) - 1);
 	liftoff_mock_plane_add_property(ctx.mock_plane, &prop);
 
+	prop_name = "COLOR_ENCODING";
+	prop = (drmModePropertyRes){0};
+	strncpy(prop.name, prop_name, sizeof(prop.name) - 1);
+	liftoff_mock_plane_add_property(ctx.mock_plane, &prop);
+
 	ctx.drm_fd = liftoff_mock_drm_open();
-	device = liftoff_device_create(ctx.drm_fd);
-	assert(device != NULL);
+	ctx.device = liftoff_device_create(ctx.drm_fd);
+	assert(ctx.device != NULL);
 
-	liftoff_device_register_all_planes(device);
+	liftoff_device_register_all_planes(ctx.device);
 
-	ctx.output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	ctx.output = liftoff_output_create(ctx.device, liftoff_mock_drm_crtc_id);
 	ctx.layer = add_layer(ctx.output, 0, 0, 1920, 1080);
 	/* Layers incompatible with all planes */
 	ctx.other_layer = add_layer(ctx.output, 0, 0, 256, 256);
@@ -336,7 +728,7 @@ run(const struct test_case *test)
 
 	test->run(&ctx);
 
-	liftoff_device_destroy(device);
+	liftoff_device_destroy(ctx.device);
 	close(ctx.drm_fd);
 }
 
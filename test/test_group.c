@@ -0,0 +1,388 @@
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libliftoff.h>
+#include <stdio.h>
+#include <string.h>
+#include "libdrm_mock.h"
+
+/* Two 1920x2160 tiles side by side, forming a 3840x2160 display */
+#define TILE_WIDTH 1920
+#define TILE_HEIGHT 2160
+
+struct context {
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *outputs[2];
+	struct liftoff_output_group *group;
+};
+
+static void
+init(struct context *ctx)
+{
+	size_t i;
+	int ret;
+
+	liftoff_mock_drm_second_crtc_id = liftoff_mock_drm_crtc_id + 1;
+	liftoff_mock_drm_mode_width = TILE_WIDTH;
+	liftoff_mock_drm_mode_height = TILE_HEIGHT;
+
+	ctx->drm_fd = liftoff_mock_drm_open();
+	ctx->device = liftoff_device_create(ctx->drm_fd);
+	assert(ctx->device != NULL);
+
+	liftoff_device_register_all_planes(ctx->device);
+
+	ctx->outputs[0] = liftoff_output_create(ctx->device,
+						liftoff_mock_drm_crtc_id);
+	ctx->outputs[1] = liftoff_output_create(ctx->device,
+						liftoff_mock_drm_second_crtc_id);
+	assert(ctx->outputs[0] != NULL && ctx->outputs[1] != NULL);
+
+	ctx->group = liftoff_output_group_create();
+	assert(ctx->group != NULL);
+	for (i = 0; i < 2; i++) {
+		liftoff_output_set_size(ctx->outputs[i], TILE_WIDTH,
+					TILE_HEIGHT);
+		ret = liftoff_output_group_add_tile(ctx->group, ctx->outputs[i],
+						    (int)i * TILE_WIDTH, 0);
+		assert(ret == 0);
+	}
+	ret = liftoff_output_group_add_tile(ctx->group, ctx->outputs[0], 0, 0);
+	assert(ret == -EINVAL);
+}
+
+static void
+finish(struct context *ctx)
+{
+	liftoff_output_group_destroy(ctx->group);
+	liftoff_output_destroy(ctx->outputs[0]);
+	liftoff_output_destroy(ctx->outputs[1]);
+	liftoff_device_destroy(ctx->device);
+	close(ctx->drm_fd);
+}
+
+static struct liftoff_group_layer *
+add_group_layer(struct context *ctx, int x, int y, int width, int height)
+{
+	struct liftoff_group_layer *layer;
+	uint32_t fb_id;
+	int ret;
+
+	layer = liftoff_group_layer_create(ctx->group);
+	assert(layer != NULL);
+
+	/* The mock device judges FBs by the layer they were created for */
+	fb_id = liftoff_mock_drm_create_fb(
+		liftoff_group_layer_get_tile(layer, ctx->outputs[0]));
+	liftoff_group_layer_set_property(layer, "FB_ID", fb_id);
+	liftoff_group_layer_set_property(layer, "CRTC_X", (uint64_t)x);
+	liftoff_group_layer_set_property(layer, "CRTC_Y", (uint64_t)y);
+	liftoff_group_layer_set_property(layer, "CRTC_W", (uint64_t)width);
+	liftoff_group_layer_set_property(layer, "CRTC_H", (uint64_t)height);
+	liftoff_group_layer_set_property(layer, "SRC_X", 0);
+	liftoff_group_layer_set_property(layer, "SRC_Y", 0);
+	liftoff_group_layer_set_property(layer, "SRC_W",
+					 (uint64_t)width << 16);
+	liftoff_group_layer_set_property(layer, "SRC_H",
+					 (uint64_t)height << 16);
+
+	ret = liftoff_output_group_add_tile(ctx->group, ctx->outputs[0], 0, 0);
+	assert(ret == -EBUSY);
+
+	return layer;
+}
+
+static void
+apply_and_commit(struct context *ctx)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_group_apply(ctx->group, req, 0);
+	assert(ret == 0);
+	ret = drmModeAtomicCommit(ctx->drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	liftoff_output_group_commit_done(ctx->group, ret);
+	drmModeAtomicFree(req);
+}
+
+/* A layer spanning both tiles is offloaded to a plane on each CRTC */
+static void
+test_tiles(void)
+{
+	struct context ctx;
+	struct liftoff_mock_plane *mock_planes[2];
+	struct liftoff_group_layer *layer;
+	struct liftoff_layer *tiles[2];
+	size_t i;
+
+	for (i = 0; i < 2; i++) {
+		mock_planes[i] =
+			liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	}
+	init(&ctx);
+
+	layer = add_group_layer(&ctx, 0, 0, 2 * TILE_WIDTH, TILE_HEIGHT);
+	for (i = 0; i < 2; i++) {
+		tiles[i] = liftoff_group_layer_get_tile(layer, ctx.outputs[i]);
+		assert(tiles[i] != NULL);
+		liftoff_mock_plane_add_compatible_layer(mock_planes[i],
+							tiles[0]);
+	}
+
+	apply_and_commit(&ctx);
+	assert(!liftoff_group_layer_needs_composition(layer));
+	for (i = 0; i < 2; i++) {
+		assert(liftoff_layer_get_plane(tiles[i]) != NULL);
+	}
+	assert(liftoff_layer_get_plane(tiles[0]) !=
+	       liftoff_layer_get_plane(tiles[1]));
+
+	/* Only on the second tile now */
+	liftoff_group_layer_set_property(layer, "CRTC_X", TILE_WIDTH);
+	liftoff_group_layer_set_property(layer, "CRTC_W", TILE_WIDTH);
+	liftoff_group_layer_set_property(layer, "SRC_W",
+					 (uint64_t)TILE_WIDTH << 16);
+	apply_and_commit(&ctx);
+	assert(!liftoff_group_layer_needs_composition(layer));
+	assert(liftoff_layer_get_plane(tiles[0]) == NULL);
+	assert(liftoff_layer_get_plane(tiles[1]) != NULL);
+
+	liftoff_group_layer_destroy(layer);
+	finish(&ctx);
+}
+
+/* A layer which can only be offloaded on one of its tiles is composited on
+ * all of them */
+static void
+test_fallback(void)
+{
+	struct context ctx;
+	struct liftoff_mock_plane *mock_plane;
+	struct liftoff_group_layer *layer;
+	struct liftoff_layer *tiles[2];
+	size_t i;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	init(&ctx);
+
+	layer = add_group_layer(&ctx, TILE_WIDTH / 2, 0, TILE_WIDTH,
+				TILE_HEIGHT);
+	for (i = 0; i < 2; i++) {
+		tiles[i] = liftoff_group_layer_get_tile(layer, ctx.outputs[i]);
+	}
+	liftoff_mock_plane_add_compatible_layer(mock_plane, tiles[0]);
+
+	apply_and_commit(&ctx);
+	assert(liftoff_group_layer_needs_composition(layer));
+	for (i = 0; i < 2; i++) {
+		assert(liftoff_layer_needs_composition(tiles[i]));
+		assert(liftoff_layer_get_plane(tiles[i]) == NULL);
+	}
+
+	/* Still composited on new buffers */
+	liftoff_group_layer_set_property(layer, "FB_ID",
+					 liftoff_mock_drm_create_fb(tiles[0]));
+	apply_and_commit(&ctx);
+	assert(liftoff_group_layer_needs_composition(layer));
+
+	/* Fits on the first tile only */
+	liftoff_group_layer_set_property(layer, "CRTC_X", 0);
+	apply_and_commit(&ctx);
+	assert(!liftoff_group_layer_needs_composition(layer));
+	assert(liftoff_layer_get_plane(tiles[0]) != NULL);
+	assert(liftoff_layer_get_plane(tiles[1]) == NULL);
+
+	liftoff_group_layer_destroy(layer);
+	finish(&ctx);
+}
+
+static struct liftoff_layer *
+add_composition_layer(struct liftoff_output *output)
+{
+	struct liftoff_layer *layer;
+
+	layer = liftoff_layer_create(output);
+	liftoff_layer_set_property(layer, "FB_ID",
+				   liftoff_mock_drm_create_fb(layer));
+	liftoff_layer_set_property(layer, "CRTC_W", TILE_WIDTH);
+	liftoff_layer_set_property(layer, "CRTC_H", TILE_HEIGHT);
+	liftoff_layer_set_property(layer, "SRC_W", (uint64_t)TILE_WIDTH << 16);
+	liftoff_layer_set_property(layer, "SRC_H", (uint64_t)TILE_HEIGHT << 16);
+	liftoff_output_set_composition_layer(output, layer);
+	liftoff_output_set_composition_damage(output, true);
+
+	return layer;
+}
+
+/* Returns the number of damage clips, -1 if the whole FB is damaged */
+static int
+get_damage_clips(struct context *ctx, struct liftoff_mock_plane *mock_plane,
+		 uint32_t prop_id, struct drm_mode_rect *clips,
+		 size_t max_clips)
+{
+	drmModePropertyBlobRes *blob;
+	uint64_t blob_id;
+	size_t clips_len;
+
+	blob_id = liftoff_mock_plane_get_property(mock_plane, prop_id);
+	if (blob_id == 0) {
+		return -1;
+	}
+
+	blob = drmModeGetPropertyBlob(ctx->drm_fd, blob_id);
+	assert(blob != NULL);
+	clips_len = blob->length / sizeof(clips[0]);
+	assert(clips_len <= max_clips);
+	memcpy(clips, blob->data, blob->length);
+	drmModeFreePropertyBlob(blob);
+
+	return clips_len;
+}
+
+/* Composition changes and damage are relative to the previous frame when the
+ * group is re-applied */
+static void
+test_retry_changes(void)
+{
+	struct context ctx;
+	struct liftoff_mock_plane *mock_primaries[2], *mock_overlay;
+	struct liftoff_layer *composition_layers[2], *composited, *tiles[2];
+	struct liftoff_group_layer *layer;
+	struct drm_mode_rect clips[8];
+	drmModePropertyRes prop;
+	uint32_t prop_ids[2];
+	uint32_t fb_id, changes;
+	size_t i;
+
+	prop = (drmModePropertyRes){0};
+	strncpy(prop.name, "FB_DAMAGE_CLIPS", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_BLOB;
+	for (i = 0; i < 2; i++) {
+		mock_primaries[i] =
+			liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+		prop_ids[i] = liftoff_mock_plane_add_property(mock_primaries[i],
+							      &prop);
+	}
+	mock_overlay = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	init(&ctx);
+
+	/* Each tile composites a layer, so the composition layers are
+	 * displayed from the start */
+	for (i = 0; i < 2; i++) {
+		composition_layers[i] = add_composition_layer(ctx.outputs[i]);
+		liftoff_mock_plane_add_compatible_layer(mock_primaries[i],
+							composition_layers[i]);
+		composited = liftoff_layer_create(ctx.outputs[i]);
+		fb_id = liftoff_mock_drm_create_fb(composited);
+		liftoff_layer_set_property(composited, "FB_ID", fb_id);
+		liftoff_layer_set_property(composited, "CRTC_X", 1000);
+		liftoff_layer_set_property(composited, "CRTC_Y", 1000);
+		liftoff_layer_set_property(composited, "CRTC_W", 100);
+		liftoff_layer_set_property(composited, "CRTC_H", 100);
+		liftoff_layer_set_property(composited, "SRC_W", 100 << 16);
+		liftoff_layer_set_property(composited, "SRC_H", 100 << 16);
+	}
+
+	/* On the first tile only */
+	layer = add_group_layer(&ctx, 100, 100, 200, 200);
+	for (i = 0; i < 2; i++) {
+		tiles[i] = liftoff_group_layer_get_tile(layer, ctx.outputs[i]);
+	}
+	liftoff_mock_plane_add_compatible_layer(mock_overlay, tiles[0]);
+
+	apply_and_commit(&ctx);
+	apply_and_commit(&ctx);
+	assert(!liftoff_group_layer_needs_composition(layer));
+	assert(liftoff_mock_plane_get_layer(mock_overlay) == tiles[0]);
+
+	/* Across both tiles, the first pass offloads it on the first one */
+	liftoff_group_layer_set_property(layer, "CRTC_X", TILE_WIDTH - 100);
+	apply_and_commit(&ctx);
+	assert(liftoff_group_layer_needs_composition(layer));
+	for (i = 0; i < 2; i++) {
+		assert(liftoff_output_composition_changed(ctx.outputs[i]));
+		changes = liftoff_layer_get_composition_changes(tiles[i]);
+		assert(changes & LIFTOFF_COMPOSITION_CHANGE_MEMBERSHIP);
+		assert(changes & LIFTOFF_COMPOSITION_CHANGE_GEOMETRY);
+	}
+
+	assert(get_damage_clips(&ctx, mock_primaries[0], prop_ids[0],
+				clips, 8) == 1);
+	assert(clips[0].x1 == TILE_WIDTH - 100 && clips[0].y1 == 100);
+	assert(clips[0].x2 == TILE_WIDTH && clips[0].y2 == 300);
+	assert(get_damage_clips(&ctx, mock_primaries[1], prop_ids[1],
+				clips, 8) == 1);
+	assert(clips[0].x1 == 0 && clips[0].y1 == 100);
+	assert(clips[0].x2 == 100 && clips[0].y2 == 300);
+
+	liftoff_group_layer_destroy(layer);
+	finish(&ctx);
+}
+
+/* Destroying a group destroys its layers */
+static void
+test_destroy(void)
+{
+	struct context ctx;
+	struct liftoff_mock_plane *mock_plane;
+	struct liftoff_group_layer *layer;
+	struct liftoff_layer *tile;
+	drmModeAtomicReq *req;
+	int ret;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	init(&ctx);
+
+	layer = add_group_layer(&ctx, 0, 0, TILE_WIDTH, TILE_HEIGHT);
+	tile = liftoff_group_layer_get_tile(layer, ctx.outputs[0]);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, tile);
+
+	apply_and_commit(&ctx);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == tile);
+
+	liftoff_output_group_destroy(ctx.group);
+	ctx.group = NULL;
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(ctx.outputs[0], req, 0);
+	assert(ret == 0);
+	ret = drmModeAtomicCommit(ctx.drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	liftoff_output_commit_done(ctx.outputs[0], ret);
+	drmModeAtomicFree(req);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	finish(&ctx);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *test_name;
+
+	liftoff_log_set_priority(LIFTOFF_DEBUG);
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <test-name>\n", argv[0]);
+		return 1;
+	}
+	test_name = argv[1];
+
+	if (strcmp(test_name, "tiles") == 0) {
+		test_tiles();
+	} else if (strcmp(test_name, "fallback") == 0) {
+		test_fallback();
+	} else if (strcmp(test_name, "retry-changes") == 0) {
+		test_retry_changes();
+	} else if (strcmp(test_name, "destroy") == 0) {
+		test_destroy();
+	} else {
+		fprintf(stderr, "no such test: %s\n", test_name);
+		return 1;
+	}
+
+	return 0;
+}
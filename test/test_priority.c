@@ -8,6 +8,8 @@
 /* Number of page-flips before the plane allocation has stabilized */
 #define STABILIZE_PAGEFLIP_COUNT 600 /* 10s at 60FPS */
 
+#define REFRESH_PERIOD_NSEC (1000000000 / 60)
+
 static struct liftoff_layer *
 add_layer(struct liftoff_output *output, int x, int y, int width, int height)
 {
@@ -38,6 +40,7 @@ main(int argc, char *argv[])
 	struct liftoff_output *output;
 	struct liftoff_layer *layers[2], *layer;
 	uint32_t fbs[2];
+	uint64_t time_nsec;
 	drmModeAtomicReq *req;
 	int ret;
 
@@ -61,6 +64,8 @@ main(int argc, char *argv[])
 	liftoff_mock_plane_add_compatible_layer(mock_plane, layers[0]);
 	liftoff_mock_plane_add_compatible_layer(mock_plane, layers[1]);
 
+	time_nsec = 0;
+
 	for (size_t i = 0; i < sizeof(layers) / sizeof(layers[0]); i++) {
 		/* We will continuously update layers[i]. After some time we
 		 * want to see it get a plane. */
@@ -76,6 +81,9 @@ main(int argc, char *argv[])
 
 			liftoff_layer_set_property(layer, "FB_ID", fbs[j % 2]);
 
+			time_nsec += REFRESH_PERIOD_NSEC;
+			liftoff_output_set_presentation_time(output, time_nsec);
+
 			ret = liftoff_output_apply(output, req, 0);
 			assert(ret == 0);
 			ret = drmModeAtomicCommit(drm_fd, req, 0, NULL);
@@ -1,7 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <drm_fourcc.h>
 #include <unistd.h>
 #include <libliftoff.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "libdrm_mock.h"
 
@@ -282,6 +286,939 @@ test_unmatched_prop(void)
 	return 0;
 }
 
+static void
+apply_and_commit(int drm_fd, struct liftoff_output *output)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	ret = liftoff_output_apply(output, req, 0);
+	assert(ret == 0);
+	ret = drmModeAtomicCommit(drm_fd, req, 0, NULL);
+	assert(ret == 0);
+	drmModeAtomicFree(req);
+}
+
+/* Checks that property values outside of the range, enum or bitmask advertised
+ * by the plane are rejected, even if the driver would accept them. */
+static int
+test_invalid_value(const char *prop_name)
+{
+	struct liftoff_mock_plane *mock_plane;
+	drmModePropertyRes prop = {0};
+	struct drm_mode_property_enum enums[2] = {0};
+	uint64_t range[2];
+	uint64_t valid_value, invalid_value;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+
+	strncpy(prop.name, prop_name, sizeof(prop.name) - 1);
+	if (strcmp(prop_name, "alpha") == 0) {
+		range[0] = 0;
+		range[1] = 0xFFFF;
+		prop.flags = DRM_MODE_PROP_RANGE;
+		prop.count_values = 2;
+		prop.values = range;
+		valid_value = 0xFFFF;
+		invalid_value = 0x10000;
+	} else if (strcmp(prop_name, "rotation") == 0) {
+		/* Bitmask enum values are bit indices */
+		enums[0].value = 0;
+		strncpy(enums[0].name, "rotate-0", sizeof(enums[0].name) - 1);
+		enums[1].value = 2;
+		strncpy(enums[1].name, "rotate-180", sizeof(enums[1].name) - 1);
+		prop.flags = DRM_MODE_PROP_BITMASK;
+		prop.count_enums = 2;
+		prop.enums = enums;
+		valid_value = DRM_MODE_ROTATE_180;
+		invalid_value = DRM_MODE_ROTATE_90;
+	} else if (strcmp(prop_name, "COLOR_ENCODING") == 0) {
+		enums[0].value = 0;
+		strncpy(enums[0].name, "ITU-R BT.601 YCbCr",
+			sizeof(enums[0].name) - 1);
+		enums[1].value = 1;
+		strncpy(enums[1].name, "ITU-R BT.709 YCbCr",
+			sizeof(enums[1].name) - 1);
+		prop.flags = DRM_MODE_PROP_ENUM;
+		prop.count_enums = 2;
+		prop.enums = enums;
+		valid_value = 1;
+		invalid_value = 2;
+	} else {
+		fprintf(stderr, "no such test: invalid-%s\n", prop_name);
+		return 1;
+	}
+	liftoff_mock_plane_add_property(mock_plane, &prop);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+
+	/* The mock driver accepts any value */
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	liftoff_layer_set_property(layer, prop_name, invalid_value);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	liftoff_layer_set_property(layer, prop_name, valid_value);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	/* Re-using the previous allocation isn't possible anymore */
+	liftoff_output_set_realloc_policy(output, prop_name,
+					  LIFTOFF_REALLOC_NEVER, 0);
+	liftoff_layer_set_property(layer, prop_name, invalid_value);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that layers with a format or modifier missing from IN_FORMATS are
+ * rejected, even if the driver would accept them. */
+static int
+test_in_formats(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	const uint32_t formats[] = { DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888 };
+	const uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	uint32_t fb_id;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	liftoff_mock_plane_set_in_formats(mock_plane, formats,
+					  sizeof(formats) / sizeof(formats[0]),
+					  modifiers,
+					  sizeof(modifiers) / sizeof(modifiers[0]));
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	/* Unsupported format */
+	fb_id = liftoff_mock_drm_create_fb_with_format(layer, DRM_FORMAT_NV12,
+						       DRM_FORMAT_MOD_LINEAR);
+	liftoff_layer_set_property(layer, "FB_ID", fb_id);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	/* Unsupported modifier */
+	fb_id = liftoff_mock_drm_create_fb_with_format(layer,
+						       DRM_FORMAT_ARGB8888,
+						       I915_FORMAT_MOD_X_TILED);
+	liftoff_layer_set_property(layer, "FB_ID", fb_id);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	/* Supported format and modifier */
+	fb_id = liftoff_mock_drm_create_fb_with_format(layer,
+						       DRM_FORMAT_ARGB8888,
+						       DRM_FORMAT_MOD_LINEAR);
+	liftoff_layer_set_property(layer, "FB_ID", fb_id);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	/* Implicit modifier */
+	fb_id = liftoff_mock_drm_create_fb_with_format(layer,
+						       DRM_FORMAT_XRGB8888,
+						       DRM_FORMAT_MOD_INVALID);
+	liftoff_layer_set_property(layer, "FB_ID", fb_id);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+struct in_formats_blob {
+	struct drm_format_modifier_blob header;
+	uint32_t formats[2];
+	struct drm_format_modifier modifiers[1];
+};
+
+/* Checks that malformed IN_FORMATS blobs are ignored instead of being read
+ * past their end. */
+static int
+test_in_formats_invalid(bool truncated)
+{
+	struct in_formats_blob data = {0};
+	struct liftoff_mock_plane *mock_plane;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	data.header.version = 1;
+	data.header.count_formats = 2;
+	data.header.formats_offset = offsetof(struct in_formats_blob, formats);
+	data.header.count_modifiers = 1;
+	data.header.modifiers_offset =
+		offsetof(struct in_formats_blob, modifiers);
+	data.formats[0] = DRM_FORMAT_XRGB8888;
+	data.formats[1] = DRM_FORMAT_ARGB8888;
+	data.modifiers[0].modifier = DRM_FORMAT_MOD_LINEAR;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	if (truncated) {
+		/* The modifier array is cut off */
+		data.modifiers[0].formats = 0x3;
+		liftoff_mock_plane_set_in_formats_blob(mock_plane, &data,
+			offsetof(struct in_formats_blob, modifiers) + 8);
+	} else {
+		/* The mask refers to a third format */
+		data.modifiers[0].formats = 0x7;
+		liftoff_mock_plane_set_in_formats_blob(mock_plane, &data,
+						       sizeof(data));
+	}
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+	liftoff_layer_set_property(layer, "FB_ID",
+		liftoff_mock_drm_create_fb_with_format(layer, DRM_FORMAT_NV12,
+						       DRM_FORMAT_MOD_LINEAR));
+
+	/* Formats are unknown, the test commit decides */
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that layers larger than the cursor size aren't put on cursor
+ * planes. */
+static int
+test_cursor_size(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *big_layer, *small_layer;
+	size_t commit_count;
+
+	liftoff_mock_drm_cursor_width = 256;
+	liftoff_mock_drm_cursor_height = 256;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_CURSOR);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	big_layer = add_layer(output, 0, 0, 1920, 1080);
+
+	/* The mock driver doesn't check the size */
+	liftoff_mock_plane_add_compatible_layer(mock_plane, big_layer);
+
+	/* No test commit is needed to figure out the layer doesn't fit */
+	commit_count = liftoff_mock_commit_count;
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_commit_count == commit_count + 1);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	liftoff_layer_destroy(big_layer);
+	small_layer = add_layer(output, 0, 0, 64, 64);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, small_layer);
+
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == small_layer);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that property metadata is only fetched once per property, even if
+ * many planes have it. */
+static int
+test_shared_metadata(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	drmModePropertyRes prop = {0};
+	int drm_fd;
+	struct liftoff_device *device;
+	size_t i;
+
+	liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	for (i = 0; i < 31; i++) {
+		mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	}
+
+	strncpy(prop.name, "alpha", sizeof(prop.name) - 1);
+	liftoff_mock_plane_add_property(mock_plane, &prop);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	/* 11 basic properties shared by all planes, plus alpha */
+	assert(liftoff_mock_get_property_count == 12);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Forces a new plane allocation and returns the number of test commits it
+ * required. */
+static size_t
+realloc_and_commit(int drm_fd, struct liftoff_output *output)
+{
+	size_t commit_count;
+
+	liftoff_layer_destroy(liftoff_layer_create(output));
+
+	commit_count = liftoff_mock_commit_count;
+	apply_and_commit(drm_fd, output);
+	return liftoff_mock_commit_count - commit_count - 1;
+}
+
+/* Checks that the cursor size, which may be the kernel's default, is
+ * re-verified from time to time and forgotten if the plane accepts larger
+ * layers. */
+static int
+test_cursor_size_verify(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	size_t i;
+
+	liftoff_mock_drm_cursor_width = 64;
+	liftoff_mock_drm_cursor_height = 64;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_CURSOR);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 128, 128);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	assert(realloc_and_commit(drm_fd, output) == 0);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	for (i = 0; i < 100; i++) {
+		realloc_and_commit(drm_fd, output);
+		if (liftoff_mock_plane_get_layer(mock_plane) == layer) {
+			break;
+		}
+	}
+	assert(i < 100);
+
+	/* The size limit isn't predicted anymore */
+	for (i = 0; i < 100; i++) {
+		assert(realloc_and_commit(drm_fd, output) == 1);
+		assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+	}
+
+	liftoff_output_destroy(output);
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that the cursor size applies to clipped layers */
+static int
+test_cursor_size_clipped(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	liftoff_mock_drm_cursor_width = 256;
+	liftoff_mock_drm_cursor_height = 256;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_CURSOR);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	liftoff_output_set_size(output, 1920, 1080);
+	liftoff_output_set_layer_clipping(output, true);
+
+	/* Only 256x256 are on-screen */
+	layer = add_layer(output, 1920 - 256, 0, 512, 256);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	liftoff_output_destroy(output);
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that scaling limits are learned from failed test commits, and
+ * re-verified from time to time. */
+static int
+test_learn_scaling(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	size_t i, test_count;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	liftoff_mock_plane_set_max_downscale(mock_plane, 2 << 16);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 480, 270);
+	/* 4x downscaling */
+	liftoff_layer_set_property(layer, "SRC_W", 1920 << 16);
+	liftoff_layer_set_property(layer, "SRC_H", 1080 << 16);
+
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	/* The first allocation learns the limit, once the layer has passed
+	 * unscaled */
+	assert(realloc_and_commit(drm_fd, output) == 2);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	/* Subsequent ones don't need a test commit, except to verify the
+	 * limit once in a while */
+	test_count = 0;
+	for (i = 0; i < 100; i++) {
+		test_count += realloc_and_commit(drm_fd, output);
+		assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+	}
+	assert(test_count > 0 && test_count < 10);
+
+	/* Limits are learned per FB format and modifier */
+	liftoff_layer_set_property(layer, "FB_ID",
+		liftoff_mock_drm_create_fb_with_format(layer,
+						       DRM_FORMAT_ARGB8888,
+						       DRM_FORMAT_MOD_LINEAR));
+	assert(realloc_and_commit(drm_fd, output) == 2);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+	assert(realloc_and_commit(drm_fd, output) == 0);
+
+	/* Limits are forgotten when they turn out to be wrong */
+	liftoff_mock_plane_set_max_downscale(mock_plane, 0);
+	for (i = 0; i < 100; i++) {
+		realloc_and_commit(drm_fd, output);
+		if (liftoff_mock_plane_get_layer(mock_plane) == layer) {
+			break;
+		}
+	}
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that test commits failing for reasons other than scaling don't teach
+ * scaling limits. */
+static int
+test_learn_scaling_unrelated(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 480, 270);
+	/* 4x downscaling */
+	liftoff_layer_set_property(layer, "SRC_W", 1920 << 16);
+	liftoff_layer_set_property(layer, "SRC_H", 1080 << 16);
+
+	/* Incompatible with the plane, scaled or not */
+	assert(realloc_and_commit(drm_fd, output) == 2);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+	/* Nothing was learned, the next allocation tests the plane */
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+	assert(realloc_and_commit(drm_fd, output) == 1);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that learned limits are persisted across devices with a cache
+ * file. */
+static int
+test_cache_file(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	char path[] = "/tmp/liftoff-test-cache-XXXXXX";
+	int drm_fd, fd, ret;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	size_t i;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	liftoff_mock_plane_set_max_downscale(mock_plane, 2 << 16);
+
+	drm_fd = liftoff_mock_drm_open();
+
+	/* The first device learns the limit, the second one re-uses it.
+	 * Changing the driver name invalidates the cache. */
+	for (i = 0; i < 3; i++) {
+		if (i == 2) {
+			liftoff_mock_drm_driver_name = "other";
+		}
+
+		device = liftoff_device_create(drm_fd);
+		assert(device != NULL);
+		ret = liftoff_device_set_cache_file(device, path);
+		assert(ret == 0);
+
+		liftoff_device_register_all_planes(device);
+
+		output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+		layer = add_layer(output, 0, 0, 480, 270);
+		/* 4x downscaling */
+		liftoff_layer_set_property(layer, "SRC_W", 1920 << 16);
+		liftoff_layer_set_property(layer, "SRC_H", 1080 << 16);
+		liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+		assert(realloc_and_commit(drm_fd, output) == (i == 1 ? 0 : 2));
+		assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+		liftoff_layer_destroy(layer);
+		liftoff_output_destroy(output);
+		liftoff_device_destroy(device);
+	}
+
+	close(drm_fd);
+	unlink(path);
+
+	return 0;
+}
+
+/* Checks that destroying a plane invalidates the cache file, which was
+ * written for the previous set of planes. */
+static int
+test_cache_file_plane_destroy(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	char path[] = "/tmp/liftoff-test-cache-XXXXXX";
+	int drm_fd, fd, ret;
+	drmModePlaneRes *plane_res;
+	struct liftoff_device *device;
+	struct liftoff_plane *planes[2];
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	size_t i, count, test_count;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	liftoff_mock_plane_set_max_downscale(mock_plane, 2 << 16);
+	liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+
+	drm_fd = liftoff_mock_drm_open();
+	plane_res = drmModeGetPlaneResources(drm_fd);
+	assert(plane_res != NULL && plane_res->count_planes == 2);
+
+	/* The first device loses a plane after learning the limit, the
+	 * second one has both planes and can't re-use it */
+	test_count = 0;
+	for (i = 0; i < 2; i++) {
+		device = liftoff_device_create(drm_fd);
+		assert(device != NULL);
+		ret = liftoff_device_set_cache_file(device, path);
+		assert(ret == 0);
+
+		planes[0] = liftoff_plane_create(device, plane_res->planes[0]);
+		planes[1] = liftoff_plane_create(device, plane_res->planes[1]);
+		assert(planes[0] != NULL && planes[1] != NULL);
+
+		output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+		layer = add_layer(output, 0, 0, 480, 270);
+		/* 4x downscaling */
+		liftoff_layer_set_property(layer, "SRC_W", 1920 << 16);
+		liftoff_layer_set_property(layer, "SRC_H", 1080 << 16);
+		liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+		count = realloc_and_commit(drm_fd, output);
+		if (i == 0) {
+			test_count = count;
+			assert(test_count > 0);
+			liftoff_plane_destroy(planes[1]);
+			realloc_and_commit(drm_fd, output);
+		} else {
+			assert(count == test_count);
+		}
+		assert(liftoff_mock_plane_get_layer(mock_plane) == NULL);
+
+		liftoff_layer_destroy(layer);
+		liftoff_output_destroy(output);
+		liftoff_device_destroy(device);
+	}
+
+	drmModeFreePlaneResources(plane_res);
+	close(drm_fd);
+	unlink(path);
+
+	return 0;
+}
+
+/* Checks that driver profiles prune the search: amdgpu requires the primary
+ * plane to be enabled. */
+static int
+test_driver_profile(void)
+{
+	struct liftoff_mock_plane *mock_primary, *mock_overlay;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+
+	liftoff_mock_drm_driver_name = "amdgpu";
+	liftoff_mock_require_primary_plane = true;
+
+	mock_primary = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+
+	/* The primary plane isn't compatible with the layer, so no other
+	 * plane can be enabled: only the primary plane is tested */
+	liftoff_mock_plane_add_compatible_layer(mock_overlay, layer);
+	assert(realloc_and_commit(drm_fd, output) == 1);
+	assert(liftoff_mock_plane_get_layer(mock_overlay) == NULL);
+
+	liftoff_mock_plane_add_compatible_layer(mock_primary, layer);
+	realloc_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == layer);
+
+	/* Users can override the profile */
+	liftoff_device_set_primary_plane_required(device, false);
+	liftoff_mock_require_primary_plane = false;
+	liftoff_layer_set_fb_composited(layer);
+	realloc_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_primary) == NULL);
+	assert(liftoff_mock_plane_get_layer(mock_overlay) == NULL);
+
+	liftoff_output_destroy(output);
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that i915 cursor planes aren't tried with layers which need
+ * scaling, and that the primary plane may stay disabled. */
+static int
+test_driver_profile_cursor(void)
+{
+	struct liftoff_mock_plane *mock_overlay, *mock_cursor;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer, *cursor_layer;
+
+	liftoff_mock_drm_driver_name = "i915";
+
+	liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	mock_overlay = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	mock_cursor = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_CURSOR);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+	cursor_layer = add_layer(output, 0, 0, 32, 32);
+	/* 2x upscaling */
+	liftoff_layer_set_property(cursor_layer, "SRC_W", 16 << 16);
+	liftoff_layer_set_property(cursor_layer, "SRC_H", 16 << 16);
+
+	/* The cursor layer needs scaling, so it's never put on the cursor
+	 * plane even though the mock driver would accept it */
+	liftoff_mock_plane_add_compatible_layer(mock_overlay, layer);
+	liftoff_mock_plane_add_compatible_layer(mock_cursor, cursor_layer);
+	realloc_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_overlay) == layer);
+	assert(liftoff_mock_plane_get_layer(mock_cursor) == NULL);
+
+	liftoff_output_destroy(output);
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that no more than the maximum number of overlay planes are
+ * enabled. */
+static int
+test_max_overlays(void)
+{
+	struct liftoff_mock_plane *mock_overlays[2];
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layers[2];
+	size_t i, used;
+
+	liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	for (i = 0; i < 2; i++) {
+		mock_overlays[i] =
+			liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_OVERLAY);
+	}
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+	liftoff_device_set_max_overlay_planes(device, 1);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layers[0] = add_layer(output, 0, 0, 256, 256);
+	layers[1] = add_layer(output, 512, 512, 256, 256);
+	for (i = 0; i < 2; i++) {
+		liftoff_mock_plane_add_compatible_layer(mock_overlays[i],
+							layers[0]);
+		liftoff_mock_plane_add_compatible_layer(mock_overlays[i],
+							layers[1]);
+	}
+
+	apply_and_commit(drm_fd, output);
+
+	used = 0;
+	for (i = 0; i < 2; i++) {
+		if (liftoff_mock_plane_get_layer(mock_overlays[i]) != NULL) {
+			used++;
+		}
+	}
+	assert(used == 1);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+static uint64_t
+apply_blob(int drm_fd, struct liftoff_output *output,
+	   struct liftoff_layer *layer, struct liftoff_mock_plane *mock_plane,
+	   uint32_t prop_id, uint32_t value)
+{
+	int ret;
+
+	ret = liftoff_layer_set_property_blob(layer, "CTM", &value,
+					      sizeof(value));
+	assert(ret == 0);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_layer(mock_plane) == layer);
+	return liftoff_mock_plane_get_property(mock_plane, prop_id);
+}
+
+static int
+test_blob(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	drmModePropertyRes prop = {0};
+	drmModePropertyBlobRes *blob;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	uint32_t prop_id, i;
+	uint64_t first_id, blob_id;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	strncpy(prop.name, "CTM", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_BLOB;
+	prop_id = liftoff_mock_plane_add_property(mock_plane, &prop);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	first_id = apply_blob(drm_fd, output, layer, mock_plane, prop_id, 42);
+	assert(first_id != 0);
+	blob = drmModeGetPropertyBlob(drm_fd, first_id);
+	assert(blob != NULL);
+	assert(blob->length == sizeof(uint32_t));
+	assert(*(uint32_t *)blob->data == 42);
+	drmModeFreePropertyBlob(blob);
+
+	/* Same contents, same blob */
+	blob_id = apply_blob(drm_fd, output, layer, mock_plane, prop_id, 42);
+	assert(blob_id == first_id);
+
+	/* Recently used blobs are re-used */
+	blob_id = apply_blob(drm_fd, output, layer, mock_plane, prop_id, 43);
+	assert(blob_id != first_id);
+	blob_id = apply_blob(drm_fd, output, layer, mock_plane, prop_id, 42);
+	assert(blob_id == first_id);
+
+	/* Unused blobs are eventually destroyed */
+	for (i = 0; i < 32; i++) {
+		apply_blob(drm_fd, output, layer, mock_plane, prop_id, 100 + i);
+	}
+	/* The mock re-uses IDs of destroyed blobs */
+	blob = drmModeGetPropertyBlob(drm_fd, first_id);
+	assert(blob == NULL || *(uint32_t *)blob->data != 42);
+	drmModeFreePropertyBlob(blob);
+
+	/* Raw values release the blob */
+	liftoff_layer_set_property(layer, "CTM", 0);
+	apply_and_commit(drm_fd, output);
+	assert(liftoff_mock_plane_get_property(mock_plane, prop_id) == 0);
+
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
+/* Checks that non-blob plane properties whose value happens to be a blob ID
+ * don't keep the blob alive */
+static int
+test_blob_id_collision(void)
+{
+	struct liftoff_mock_plane *mock_plane;
+	drmModePropertyRes prop = {0};
+	drmModePropertyBlobRes *blob;
+	int drm_fd;
+	struct liftoff_device *device;
+	struct liftoff_output *output;
+	struct liftoff_layer *layer;
+	uint32_t prop_id, i;
+	uint64_t first_id;
+
+	mock_plane = liftoff_mock_drm_create_plane(DRM_PLANE_TYPE_PRIMARY);
+	strncpy(prop.name, "CTM", sizeof(prop.name) - 1);
+	prop.flags = DRM_MODE_PROP_BLOB;
+	prop_id = liftoff_mock_plane_add_property(mock_plane, &prop);
+
+	drm_fd = liftoff_mock_drm_open();
+	device = liftoff_device_create(drm_fd);
+	assert(device != NULL);
+
+	liftoff_device_register_all_planes(device);
+
+	output = liftoff_output_create(device, liftoff_mock_drm_crtc_id);
+	layer = add_layer(output, 0, 0, 1920, 1080);
+	liftoff_mock_plane_add_compatible_layer(mock_plane, layer);
+
+	first_id = apply_blob(drm_fd, output, layer, mock_plane, prop_id, 42);
+	assert(first_id != 0);
+
+	/* Only a coordinate refers to the blob ID now */
+	liftoff_layer_set_property(layer, "CRTC_X", first_id);
+	for (i = 0; i < 32; i++) {
+		apply_blob(drm_fd, output, layer, mock_plane, prop_id, 100 + i);
+	}
+	blob = drmModeGetPropertyBlob(drm_fd, first_id);
+	assert(blob == NULL || *(uint32_t *)blob->data != 42);
+	drmModeFreePropertyBlob(blob);
+
+	liftoff_output_destroy(output);
+	liftoff_device_destroy(device);
+	close(drm_fd);
+
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -296,6 +1233,7 @@ main(int argc, char *argv[])
 	test_name = argv[1];
 
 	const char default_test_prefix[] = "default-";
+	const char invalid_test_prefix[] = "invalid-";
 	if (strncmp(test_name, default_test_prefix,
 	    strlen(default_test_prefix)) == 0) {
 		return test_prop_default(test_name + strlen(default_test_prefix));
@@ -305,6 +1243,41 @@ main(int argc, char *argv[])
 		return test_immutable_zpos();
 	} else if (strcmp(test_name, "unmatched") == 0) {
 		return test_unmatched_prop();
+	} else if (strcmp(test_name, "in-formats") == 0) {
+		return test_in_formats();
+	} else if (strcmp(test_name, "in-formats-truncated") == 0) {
+		return test_in_formats_invalid(true);
+	} else if (strcmp(test_name, "in-formats-invalid-mask") == 0) {
+		return test_in_formats_invalid(false);
+	} else if (strcmp(test_name, "cursor-size") == 0) {
+		return test_cursor_size();
+	} else if (strcmp(test_name, "cursor-size-verify") == 0) {
+		return test_cursor_size_verify();
+	} else if (strcmp(test_name, "cursor-size-clipped") == 0) {
+		return test_cursor_size_clipped();
+	} else if (strcmp(test_name, "learn-scaling") == 0) {
+		return test_learn_scaling();
+	} else if (strcmp(test_name, "shared-metadata") == 0) {
+		return test_shared_metadata();
+	} else if (strcmp(test_name, "learn-scaling-unrelated") == 0) {
+		return test_learn_scaling_unrelated();
+	} else if (strcmp(test_name, "cache-file") == 0) {
+		return test_cache_file();
+	} else if (strcmp(test_name, "cache-file-plane-destroy") == 0) {
+		return test_cache_file_plane_destroy();
+	} else if (strcmp(test_name, "driver-profile") == 0) {
+		return test_driver_profile();
+	} else if (strcmp(test_name, "driver-profile-cursor") == 0) {
+		return test_driver_profile_cursor();
+	} else if (strcmp(test_name, "max-overlays") == 0) {
+		return test_max_overlays();
+	} else if (strcmp(test_name, "blob") == 0) {
+		return test_blob();
+	} else if (strcmp(test_name, "blob-id-collision") == 0) {
+		return test_blob_id_collision();
+	} else if (strncmp(test_name, invalid_test_prefix,
+		   strlen(invalid_test_prefix)) == 0) {
+		return test_invalid_value(test_name + strlen(invalid_test_prefix));
 	} else {
 		fprintf(stderr, "no such test: %s\n", test_name);
 		return 1;